@@ -1,4 +1,9 @@
 #include "binners.h"
+#include "xcms.h"
+#include "float32Matrix.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 /*
  * Contains binning utils.
  */
@@ -250,6 +255,249 @@ SEXP binYonX_multi(SEXP x, SEXP y, SEXP breaks, SEXP nBins, SEXP binSize,
   return(res);
 }
 
+/*
+ * Creates the profile matrix of a set of spectra in a single pass: the values
+ * of each spectrum are binned (and missing values imputed) directly into the
+ * column of the (preallocated) result matrix, for spectra in parallel.
+ * Columns are identical to binYonX (with method max) followed by
+ * imputeLinInterpol (or profIntLinM for intlin) on each spectrum.
+ * Arguments:
+ * x: numeric vector with the m/z values (sorted increasingly within each
+ *     spectrum).
+ * y: numeric vector with the intensities.
+ * breaks: numeric vector with the breaks of the bins (length number of bins
+ *     + 1).
+ * mzrange: numeric vector with the first and last bin mid-point (for intlin).
+ * fromIdx, toIdx: 0-based indices of the first and last value of each
+ *     spectrum in x and y.
+ * impute: 0 (bin), 1 (binlin), 2 (binlinbase) or 3 (intlin).
+ * baseValue: for bin the value for empty bins (not replaced if NA), for
+ *     binlinbase the base value.
+ * distance: for binlinbase the number of neighboring bins to interpolate.
+ * threads: number of threads.
+ * file: NULL or the name of a file to write the matrix to in single precision
+ *     (see float32Matrix.h), e.g. for matrices that do not fit into memory.
+ * Returns a numeric matrix with one row per bin and one column per spectrum
+ * or, if file is provided, a list with elements file and dim.
+ */
+SEXP profile_matrix(SEXP x, SEXP y, SEXP breaks, SEXP mzrange, SEXP fromIdx,
+		    SEXP toIdx, SEXP impute, SEXP baseValue, SEXP distance, SEXP threads,
+		    SEXP file) {
+  SEXP ans;
+  int n_bin, n_spec, the_impute, n_threads, inter_bin, *p_from, *p_to;
+  double *p_x, *p_y, *p_brks, *p_ans = NULL, *p_buf = NULL, base_value, xstart, xend;
+  struct f32Matrix out;
+
+  n_bin = LENGTH(breaks) - 1;
+  n_spec = LENGTH(fromIdx);
+  the_impute = asInteger(impute);
+  n_threads = asInteger(threads);
+  inter_bin = asInteger(distance);
+  base_value = REAL(baseValue)[0];
+  if (n_bin < 1)
+    error("Not enough breaks defined!");
+  if (LENGTH(toIdx) != n_spec)
+    error("'fromIdx' and 'toIdx' have to have the same length!");
+  if (LENGTH(x) != LENGTH(y))
+    error("'x' and 'y' have to have the same length!");
+  p_x = REAL(x);
+  p_y = REAL(y);
+  p_brks = REAL(breaks);
+  p_from = INTEGER(fromIdx);
+  p_to = INTEGER(toIdx);
+  for (int i = 0; i < n_spec; i++) {
+    if (p_from[i] < 0 || p_to[i] >= LENGTH(x) || p_to[i] < p_from[i] - 1)
+      error("'fromIdx' and 'toIdx' have to be within 1 and length(x)!");
+  }
+  xstart = REAL(mzrange)[0];
+  xend = REAL(mzrange)[1];
+  if (n_threads < 1 || n_threads == NA_INTEGER)
+    n_threads = 1;
+
+  if (file == R_NilValue) {
+    PROTECT(ans = allocMatrix(REALSXP, n_bin, n_spec));
+    p_ans = REAL(ans);
+  } else {
+    /* allocate before mapping the file: an R error would leak the mapping */
+    PROTECT(ans = float32_file_sexp(CHAR(STRING_ELT(file, 0)),
+				    n_bin, n_spec));
+    /* one column buffer per thread */
+    p_buf = (double *) R_alloc((size_t)n_bin * n_threads, sizeof(double));
+    if (f32Matrix_create(&out, CHAR(STRING_ELT(file, 0)), n_bin,
+			 n_spec) != F32MATRIX_OK)
+      error("failed to create file '%s'", CHAR(STRING_ELT(file, 0)));
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(n_threads) if(n_threads > 1)
+#endif
+  for (int i = 0; i < n_spec; i++) {
+    double *col;
+    int n_val = p_to[i] - p_from[i] + 1;
+    if (p_buf == NULL)
+      col = p_ans + (size_t)i * n_bin;
+    else
+#ifdef _OPENMP
+      col = p_buf + (size_t)omp_get_thread_num() * n_bin;
+#else
+      col = p_buf;
+#endif
+    if (the_impute == 3) {
+      if (n_val > 0)
+	ProfIntLin(p_x + p_from[i], p_y + p_from[i], &n_val, &xstart, &xend,
+		   &n_bin, col);
+      else
+	for (int j = 0; j < n_bin; j++)
+	  col[j] = 0;
+    } else {
+      for (int j = 0; j < n_bin; j++)
+	col[j] = NA_REAL;
+      if (n_val > 0)
+	_bin_y_on_x_with_breaks_max(p_x, p_y, p_brks, col, n_bin, p_from[i],
+				    p_to[i]);
+      switch (the_impute) {
+      case 1:
+	_impute_linearly_interpolate_x(col, n_bin, 1);
+	break;
+      case 2:
+	_impute_linearly_interpolate_base_x(col, n_bin, base_value, inter_bin);
+	break;
+      default:
+	_fill_missing_with_value(col, base_value, n_bin);
+      }
+    }
+    if (p_buf != NULL) {
+      float *fcol = out.data + (size_t)i * n_bin;
+      for (int j = 0; j < n_bin; j++)
+	fcol[j] = col[j];
+    }
+  }
+  if (p_buf != NULL && f32Matrix_close(&out) != F32MATRIX_OK)
+    error("failed to write file '%s'", CHAR(STRING_ELT(file, 0)));
+  UNPROTECT(1);
+  return ans;
+}
+
+/*
+ * Creates the profile matrix of method bin (maximal intensity per bin, 0 for
+ * empty bins) in a sparse, compressed column format: only the bins with a
+ * (non-NA) value are stored, spectra are processed in parallel.
+ * Arguments x, y, breaks, fromIdx, toIdx and threads as for profile_matrix;
+ * the values of each spectrum have to be sorted by x.
+ * getIndex: 0 or 1, whether the (1-based) index of the maximal value of each
+ *     bin in x should be returned too (as binYonX with returnIndex).
+ * Returns a list with elements p (integer, 0-based index of the first entry of
+ * each spectrum, length number of spectra + 1), i (integer, 0-based index of
+ * the bin), x (numeric, the values), index (integer, only if getIndex is 1)
+ * and dim (integer, number of bins and spectra). Expanding the entries into a
+ * matrix of zeros gives exactly the result of profile_matrix.
+ */
+SEXP profile_matrix_sparse(SEXP x, SEXP y, SEXP breaks, SEXP fromIdx,
+			   SEXP toIdx, SEXP getIndex, SEXP threads) {
+  SEXP ans, names, p, bins, vals, index, dim;
+  int n_bin, n_spec, n_x, n_threads, get_index, *p_from, *p_to, *p_p, *vbin;
+  double *p_x, *p_y, *p_brks;
+
+  n_bin = LENGTH(breaks) - 1;
+  n_spec = LENGTH(fromIdx);
+  n_x = LENGTH(x);
+  n_threads = asInteger(threads);
+  get_index = asInteger(getIndex);
+  if (n_bin < 1)
+    error("Not enough breaks defined!");
+  if (LENGTH(toIdx) != n_spec)
+    error("'fromIdx' and 'toIdx' have to have the same length!");
+  if (LENGTH(y) != n_x)
+    error("'x' and 'y' have to have the same length!");
+  p_x = REAL(x);
+  p_y = REAL(y);
+  p_brks = REAL(breaks);
+  p_from = INTEGER(fromIdx);
+  p_to = INTEGER(toIdx);
+  for (int i = 0; i < n_spec; i++) {
+    if (p_from[i] < 0 || p_to[i] >= n_x || p_to[i] < p_from[i] - 1)
+      error("'fromIdx' and 'toIdx' have to be within 1 and length(x)!");
+  }
+
+  PROTECT(p = allocVector(INTSXP, n_spec + 1));
+  p_p = INTEGER(p);
+  vbin = (int *) R_alloc(n_x > 0 ? n_x : 1, sizeof(int));
+
+  /* Pass 1: bin of each value and number of non-empty bins per spectrum. */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(n_threads) if(n_threads > 1)
+#endif
+  for (int i = 0; i < n_spec; i++) {
+    int count = 0, last = -1;
+    for (int j = p_from[i]; j <= p_to[i]; j++) {
+      vbin[j] = _bin_of_value(p_x[j], p_brks, n_bin);
+      if (vbin[j] >= 0 && !ISNA(p_y[j]) && vbin[j] != last) {
+	count++;
+	last = vbin[j];
+      }
+    }
+    p_p[i + 1] = count;
+  }
+  p_p[0] = 0;
+  for (int i = 0; i < n_spec; i++) {
+    if ((double)p_p[i] + p_p[i + 1] > INT_MAX)
+      error("too many non-empty bins for a sparse profile matrix");
+    p_p[i + 1] += p_p[i];
+  }
+
+  PROTECT(bins = allocVector(INTSXP, p_p[n_spec]));
+  PROTECT(vals = allocVector(REALSXP, p_p[n_spec]));
+  PROTECT(index = allocVector(INTSXP, get_index ? p_p[n_spec] : 0));
+  int *p_bins = INTEGER(bins), *p_index = INTEGER(index);
+  double *p_vals = REAL(vals);
+
+  /* Pass 2: the maximal value of each bin (same NA handling and index as
+   * _bin_y_on_x_with_breaks_max_idx). */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(n_threads) if(n_threads > 1)
+#endif
+  for (int i = 0; i < n_spec; i++) {
+    int k = p_p[i] - 1, last = -1;
+    for (int j = p_from[i]; j <= p_to[i]; j++) {
+      if (vbin[j] < 0 || ISNA(p_y[j]))
+	continue;
+      if (vbin[j] != last) {
+	k++;
+	last = vbin[j];
+	p_bins[k] = last;
+	p_vals[k] = p_y[j];
+	if (get_index)
+	  p_index[k] = j + 1;
+      } else if (p_y[j] > p_vals[k]) {
+	p_vals[k] = p_y[j];
+	if (get_index)
+	  p_index[k] = j + 1;
+      }
+    }
+  }
+
+  PROTECT(dim = allocVector(INTSXP, 2));
+  INTEGER(dim)[0] = n_bin;
+  INTEGER(dim)[1] = n_spec;
+  PROTECT(ans = allocVector(VECSXP, 4 + get_index));
+  PROTECT(names = allocVector(STRSXP, 4 + get_index));
+  SET_VECTOR_ELT(ans, 0, p);
+  SET_STRING_ELT(names, 0, mkChar("p"));
+  SET_VECTOR_ELT(ans, 1, bins);
+  SET_STRING_ELT(names, 1, mkChar("i"));
+  SET_VECTOR_ELT(ans, 2, vals);
+  SET_STRING_ELT(names, 2, mkChar("x"));
+  if (get_index) {
+    SET_VECTOR_ELT(ans, 3, index);
+    SET_STRING_ELT(names, 3, mkChar("index"));
+  }
+  SET_VECTOR_ELT(ans, 3 + get_index, dim);
+  SET_STRING_ELT(names, 3 + get_index, mkChar("dim"));
+  setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(7);
+  return ans;
+}
+
 SEXP impute_with_linear_interpolation(SEXP x, SEXP noInterAtEnds) {
   SEXP x_copy;
   int x_length = LENGTH(x);
@@ -662,6 +910,28 @@ static void _bin_y_on_x_with_breaks_mean(double *x, double *y, double *brks,
 
 
 
+/*
+ * Index of the bin (defined by brks) containing value x, -1 if x is outside
+ * of all bins. Bins include the lower boundary, the last bin also the upper
+ * boundary (as in _bin_y_on_x_with_breaks_max for sorted x).
+ */
+static int _bin_of_value(double x, double *brks, int n_bin) {
+  int lo = 0, hi = n_bin + 1, mid;
+  /* first break larger than x */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (brks[mid] > x)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  if (lo == 0)
+    return -1;
+  if (lo <= n_bin)
+    return lo - 1;
+  return (x == brks[n_bin]) ? n_bin - 1 : -1;
+}
+
 static void _bin_midPoint(double *brks, double *bin_mids, int n_bin) {
   for (int i = 0; i < n_bin; i++) {
     bin_mids[i] = (brks[i] + brks[i+1]) / 2;
@@ -67,6 +67,11 @@ static void _bin_y_on_x_with_breaks_mean(double *x, double *y, double *brks,
 					 int x_end_idx);
 
 
+/*
+ * Index of the bin containing value x (-1 if outside of all bins).
+ */
+static int _bin_of_value(double x, double *brks, int n_bin);
+
 /*
  * Simple function to calculate the midpoint of bins, breaks provided.
  */
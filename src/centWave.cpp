@@ -0,0 +1,1264 @@
+/*
+ * Native implementation of the chromatographic peak detection step of
+ * centWave (the per-ROI part of .centWave_new without gaussian fits).
+ *
+ * For each region of interest (ROI) the continuous wavelet transform of its
+ * EIC is calculated, the ridges of the local maxima are identified and peaks
+ * are integrated as in the R code (MSW.cwt, MSW.getLocalMaximumCWT,
+ * MSW.getRidge, getLocalNoiseEstimate, descendMin, descendMinTol and
+ * .narrow_rt_boundaries). Arithmetic follows R's summation and rounding rules
+ * to return the same values as the R implementation.
+ *
+ * The EICs and m/z traces of the ROIs are extracted by the caller (getEICs)
+ * and the function is called on batches of ROIs.
+ */
+#include <cmath>
+#include <cfloat>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <new>
+#include <map>
+#include <algorithm>
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Applic.h>
+
+extern "C" {
+  double getScanEIC(int scan, double from, double to, double *pmz,
+		    double *pintensity, int *pscanindex, int nmz, int lastScan);
+  void DescendMin(double *yvals, int *numin, int *istart, int *ilower,
+		  int *iupper);
+  void continuousPtsAboveThreshold(double *x, int *istart, int *numin,
+				   double *threshold, int *num, int *n);
+  void continuousPtsAboveThresholdIdx(double *x, int *istart, int *numin,
+				      double *threshold, int *num, int *n);
+}
+
+#define CW_NCOL 22
+enum { CW_MZ, CW_MZMIN, CW_MZMAX, CW_RT, CW_RTMIN, CW_RTMAX, CW_INTO,
+       CW_INTB, CW_MAXO, CW_SN, CW_EGAUSS, CW_MU, CW_SIGMA, CW_H, CW_F,
+       CW_DPPM, CW_SCALE, CW_SCPOS, CW_SCMIN, CW_SCMAX, CW_LMIN, CW_LMAX };
+
+static const char *cwColnames[CW_NCOL] = {
+  "mz", "mzmin", "mzmax", "rt", "rtmin", "rtmax", "into", "intb", "maxo",
+  "sn", "egauss", "mu", "sigma", "h", "f", "dppm", "scale", "scpos", "scmin",
+  "scmax", "lmin", "lmax"};
+
+// m/z center functions, in the order of .CENTWAVE_NATIVE_MZCENTER
+enum { MZC_WMEAN, MZC_MEAN, MZC_APEX, MZC_WMEANAPEX3, MZC_MEANAPEX3 };
+
+// Thrown for input on which the R implementation would stop with an error.
+struct cwError {
+  const char *msg;
+  cwError(const char *m) : msg(m) {}
+};
+
+class cwtBank;
+
+struct cwParams {
+  const double *scales;
+  int nscales;
+  double snthresh;
+  int minPtsAboveBaseLine;
+  int scRangeTol;
+  int maxDescOutlier;
+  int noiserange;       // noiserange[1]
+  int noiseMinPts;      // minPts for estimateChromNoise
+  int firstBaselineCheck;
+  int integrate;
+  int mzCenterFun;
+  int minCentroids;
+  int verboseColumns;
+  cwtBank *bank;
+  const double *scantime;
+  int nscantime;
+  // the data, needed to re-extract EICs
+  double *mz;
+  double *intensity;
+  int *scanindex;
+  int nmz;
+};
+
+struct cwRoi {
+  int f;               // index of the ROI in the roiList
+  double mzmin;
+  double mzmax;
+  int scmin;
+  int scmax;
+  double scale;        // roiScales[f] or NA
+  int srFrom;          // first scan of the EIC
+  const double *d;     // EIC intensities (srFrom ...)
+  int nd;
+  const double *omz;   // m/z values for scmin ... scmax
+  const double *noised;
+  int nnoised;
+};
+
+/*
+ * Helpers reproducing R's arithmetic.
+ */
+// sum()
+static double r_sum(const double *x, int n) {
+  long double s = 0.0;
+  for (int i = 0; i < n; i++)
+    s += x[i];
+  return (double) s;
+}
+
+// mean()
+static double r_mean(const double *x, int n) {
+  long double s = 0.0;
+  for (int i = 0; i < n; i++)
+    s += x[i];
+  s /= n;
+  if (R_FINITE((double) s)) {
+    long double t = 0.0;
+    for (int i = 0; i < n; i++)
+      t += (x[i] - s);
+    s += t / n;
+  }
+  return (double) s;
+}
+
+// sd()
+static double r_sd(const double *x, int n) {
+  if (n < 2)
+    return NA_REAL;
+  double xm = r_mean(x, n);
+  long double s = 0.0;
+  for (int i = 0; i < n; i++)
+    s += (x[i] - xm) * (x[i] - xm);
+  return sqrt((double) (s / (n - 1)));
+}
+
+// weighted.mean()
+static double r_weighted_mean(const double *x, const double *w, int n) {
+  long double s = 0.0, sw = 0.0;
+  for (int i = 0; i < n; i++) {
+    if (w[i] != 0)
+      s += x[i] * w[i];
+    sw += w[i];
+  }
+  return (double) s / (double) sw;
+}
+
+// which.max(), 0-based
+static int r_which_max(const double *x, int n) {
+  int idx = -1;
+  for (int i = 0; i < n; i++)
+    if (!ISNAN(x[i]) && (idx < 0 || x[i] > x[idx]))
+      idx = i;
+  return idx;
+}
+
+// round(), i.e. rounding half to even
+static double r_round(double x) {
+  return nearbyint(x);
+}
+
+// min() and max() of two values, propagating NA
+static double r_min2(double a, double b) {
+  if (ISNAN(a) || ISNAN(b))
+    return NA_REAL;
+  return a < b ? a : b;
+}
+
+static double r_max2(double a, double b) {
+  if (ISNAN(a) || ISNAN(b))
+    return NA_REAL;
+  return a > b ? a : b;
+}
+
+// fft() on interleaved complex values.
+static void r_fft(std::vector<double> &z, int n, int inverse) {
+  if (n > 1) {
+    int maxf, maxp;
+    fft_factor(n, &maxf, &maxp);
+    if (maxf == 0)
+      throw cwError("fft factorization error");
+    std::vector<double> work(4 * maxf);
+    std::vector<int> iwork(maxp);
+    fft_work(&z[0], &z[1], 1, n, 1, inverse ? 2 : -2, &work[0], &iwork[0]);
+  }
+}
+
+/*
+ * estimateChromNoise and getLocalNoiseEstimate
+ */
+static double estimateChromNoise(const double *x, int n, double trim,
+				 int minPts) {
+  std::vector<double> gz;
+  for (int i = 0; i < n; i++)
+    if (x[i] > 0)
+      gz.push_back(x[i]);
+  if ((int) gz.size() < minPts)
+    return r_mean(x, n);
+  // mean(x, trim = trim)
+  int ngz = gz.size();
+  int lo = (int) floor(ngz * trim) + 1;
+  int hi = ngz + 1 - lo;
+  std::sort(gz.begin(), gz.end());
+  return r_mean(&gz[lo - 1], hi - lo + 1);
+}
+
+// Values not within a stretch of at least num values above threshold.
+static std::vector<double> notAboveThreshold(const double *x, int n,
+					     double threshold, int num) {
+  std::vector<int> cp(n, 0);
+  std::vector<double> res;
+  int istart = 0;
+  if (n > 0)
+    continuousPtsAboveThresholdIdx(const_cast<double *>(x), &istart, &n,
+				   &threshold, &num, &cp[0]);
+  for (int i = 0; i < n; i++)
+    if (!cp[i])
+      res.push_back(x[i]);
+  return res;
+}
+
+// d1, d2: range of the ROI (ftd) within d, 1-based.
+static void getLocalNoiseEstimate(const double *d, int nd, int d1, int d2,
+				  int noiserange, int nscantime,
+				  double threshold, int num, double *res) {
+  double baseline1, baseline2, sdnoise1, sdnoise2;
+  if (nd < nscantime) {
+    std::vector<double> n1;
+    for (int i = 1; i <= nd; i++)
+      if (i < d1 || i > d2)
+	n1.push_back(d[i - 1]);
+    n1 = notAboveThreshold(n1.empty() ? NULL : &n1[0], n1.size(), threshold,
+			   num);
+    if (n1.size() > 1) {
+      baseline1 = r_mean(&n1[0], n1.size());
+      sdnoise1 = r_sd(&n1[0], n1.size());
+    } else
+      baseline1 = sdnoise1 = 1;
+    std::vector<double> n2;
+    for (int i = std::max(1, d1 - noiserange); i <= d1; i++)
+      n2.push_back(d[i - 1]);
+    for (int i = d2; i <= std::min(nd, d2 + noiserange); i++)
+      n2.push_back(d[i - 1]);
+    n2 = notAboveThreshold(&n2[0], n2.size(), threshold, num);
+    if (n2.size() > 1) {
+      baseline2 = r_mean(&n2[0], n2.size());
+      sdnoise2 = r_sd(&n2[0], n2.size());
+    } else
+      baseline2 = sdnoise2 = 1;
+  } else {
+    // trimm(d, c(0.05, 0.95))
+    std::vector<double> a;
+    for (int i = 0; i < nd; i++)
+      if (d[i] > 0)
+	a.push_back(d[i]);
+    std::sort(a.begin(), a.end());
+    int na = a.size();
+    int lo = (int) r_round(na * 0.05 + 1);
+    int hi = (int) r_round(na * 0.95);
+    std::vector<double> trimmed;
+    if (lo <= hi) {
+      for (int i = lo; i <= hi; i++)
+	trimmed.push_back(a[i - 1]);
+    } else {
+      // descending sequence, index 0 is dropped
+      for (int i = lo; i >= hi; i--) {
+	if (i > 0)
+	  trimmed.push_back(i <= na ? a[i - 1] : NA_REAL);
+      }
+    }
+    baseline1 = baseline2 = trimmed.empty() ?
+      R_NaN : r_mean(&trimmed[0], trimmed.size());
+    sdnoise1 = sdnoise2 = r_sd(trimmed.empty() ? NULL : &trimmed[0],
+			       trimmed.size());
+  }
+  res[0] = r_min2(baseline1, baseline2);
+  res[1] = r_min2(sdnoise1, sdnoise2);
+}
+
+/*
+ * MSW.cwt with the mexican hat wavelet.
+ *
+ * The wavelet taps of each scale are computed once when the bank is created
+ * and re-used for all signals (ROIs) of a detection run. Short signals are
+ * convolved directly with the taps; the inner loop runs over the output
+ * positions and is vectorized by the compiler. Long signals are convolved via
+ * FFT as in R's convolve(), caching the FFT of the taps per padded signal
+ * length. Both give the coefficients of MSW.cwt (up to floating point
+ * rounding).
+ */
+#define CWT_AUTO 0
+#define CWT_DIRECT 1
+#define CWT_FFT 2
+// direct convolution is used if signal length * wavelet length is below
+// CWT_DIRECT_FACTOR * len * log2(len) with len the padded signal length
+#define CWT_DIRECT_FACTOR 16
+
+class cwtBank {
+public:
+  cwtBank(const double *scales, int nscales) :
+    scales(scales, scales + nscales), taps(nscales), spectra(nscales) {
+    double psi[256], psi_xval[256];
+    double by = (6.0 - -6.0) / 255;
+    for (int i = 0; i < 256; i++) {
+      double x = (i == 0) ? -6.0 : ((i == 255) ? 6.0 : -6.0 + i * by);
+      psi[i] = 2 / sqrt(3.0) * pow(M_PI, -0.25) * (1 - x * x) *
+	exp(-(x * x) / 2);
+      psi_xval[i] = x;
+    }
+    double dxval = psi_xval[1] - psi_xval[0];
+    double xmax = psi_xval[255] - psi_xval[0];
+    for (int i = 0; i < nscales; i++) {
+      double sd = scales[i] * dxval;
+      int nj = (int) (scales[i] * xmax + 1 + FLT_EPSILON);
+      std::vector<double> pj;
+      for (int k = 0; k < nj; k++)
+	pj.push_back(psi[(int) floor(k / sd)]);
+      if (nj == 1)
+	pj.push_back(psi[0]);
+      double mp = r_mean(&pj[0], pj.size());
+      for (int k = pj.size() - 1; k >= 0; k--)
+	taps[i].push_back(pj[k] - mp);
+    }
+  }
+
+  /*
+   * Calculates the coefficients for signal ms of length n (column-major in
+   * wCoefs) and returns the number of scales for which they were calculated
+   * (scales larger than the padded signal are skipped as in MSW.cwt).
+   */
+  int transform(const double *ms, int n, std::vector<double> &wCoefs,
+		int method = CWT_AUTO) {
+    // MSW.extendNBase: extend to a power of 2 by reflection
+    int len = 1, nlog = 0;
+    while (len < n) {
+      len *= 2;
+      nlog++;
+    }
+    ext.resize(len);
+    for (int i = 0; i < len; i++)
+      ext[i] = (i < n) ? ms[i] : ms[2 * n - i - 1];
+    wCoefs.assign((size_t) n * scales.size(), 0.0);
+    bool fftDone = false;
+    size_t i;
+    for (i = 0; i < scales.size(); i++) {
+      int lenWave = taps[i].size();
+      if (lenWave > len)
+	break;
+      double *out = &wCoefs[i * n];
+      bool direct = method == CWT_DIRECT ||
+	(method == CWT_AUTO && (double) n * lenWave <=
+	 (double) CWT_DIRECT_FACTOR * len * std::max(nlog, 1));
+      if (direct)
+	convolveDirect(i, n, len, out);
+      else {
+	if (!fftDone) {
+	  extFft.assign(2 * len, 0.0);
+	  for (int k = 0; k < len; k++)
+	    extFft[2 * k] = ext[k];
+	  r_fft(extFft, len, 0);
+	  fftDone = true;
+	}
+	convolveFft(i, n, len, out);
+      }
+    }
+    wCoefs.resize(i * n);
+    return i;
+  }
+
+  // whether the bank was created for the nscales scales
+  bool hasScales(const double *sc, int nscales) const {
+    return (int) scales.size() == nscales &&
+      std::equal(scales.begin(), scales.end(), sc);
+  }
+
+private:
+  std::vector<double> scales;
+  std::vector<std::vector<double> > taps;
+  // FFT of the taps, per padded signal length
+  std::vector<std::map<int, std::vector<double> > > spectra;
+  // buffers
+  std::vector<double> ext, extFft, buf;
+
+  // out[k] = sum_j ext[(k + j - lenWave / 2) mod len] * taps[j]
+  void convolveDirect(int i, int n, int len, double *out) {
+    const std::vector<double> &f = taps[i];
+    int lenWave = f.size();
+    int h = lenWave / 2;
+    buf.resize(n + lenWave - 1);
+    for (int t = 0; t < n + lenWave - 1; t++)
+      buf[t] = ext[((t - h) % len + len) % len];
+    const double *b = &buf[0];
+    for (int j = 0; j < lenWave; j++) {
+      const double fj = f[j];
+      const double *bj = b + j;
+      for (int k = 0; k < n; k++)
+	out[k] += fj * bj[k];
+    }
+    double fac = 1 / sqrt(scales[i]);
+    for (int k = 0; k < n; k++)
+      out[k] *= fac;
+  }
+
+  // Re(fft(fft(x) * Conj(fft(f)), inverse = TRUE)) / len as in convolve()
+  void convolveFft(int i, int n, int len, double *out) {
+    std::vector<double> &spec = spectra[i][len];
+    if (spec.empty()) {
+      spec.assign(2 * len, 0.0);
+      for (size_t k = 0; k < taps[i].size(); k++)
+	spec[2 * k] = taps[i][k];
+      r_fft(spec, len, 0);
+    }
+    buf.resize(2 * len);
+    for (int k = 0; k < len; k++) {
+      double xr = extFft[2 * k], xi = extFft[2 * k + 1];
+      double yr = spec[2 * k], yi = -spec[2 * k + 1];
+      buf[2 * k] = xr * yr - xi * yi;
+      buf[2 * k + 1] = xr * yi + xi * yr;
+    }
+    r_fft(buf, len, 1);
+    double fac = 1 / sqrt(scales[i]);
+    int h = taps[i].size() / 2;
+    for (int k = 0; k < n; k++)
+      out[k] = fac * (buf[2 * ((k + len - h) % len)] / len);
+  }
+};
+
+/*
+ * MSW.localMaximum
+ */
+static void localMaximum(const double *x, int len, int winSize, double *lm) {
+  for (int i = 0; i < len; i++)
+    lm[i] = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    int shift = pass ? winSize / 2 : 0;
+    int rNum = (int) ceil((double) (len + shift) / winSize);
+    std::vector<double> y(rNum * winSize);
+    for (int i = 0; i < (int) y.size(); i++) {
+      int k = i - shift;
+      y[i] = (k < 0) ? x[0] : ((k >= len) ? x[len - 1] : x[k]);
+    }
+    for (int c = 0; c < rNum; c++) {
+      const double *col = &y[c * winSize];
+      int mi = r_which_max(col, winSize);
+      if (mi < 0)
+	continue;
+      if (col[mi] > col[0] && col[mi] > col[winSize - 1]) {
+	int idx = c * winSize + mi - shift;
+	if (idx >= 0 && idx < len)
+	  lm[idx] = 1;
+      }
+    }
+  }
+  std::vector<int> maxInd;
+  for (int i = 0; i < len; i++)
+    if (lm[i] > 0)
+      maxInd.push_back(i);
+  std::vector<int> zero;
+  for (int i = 0; i + 1 < (int) maxInd.size(); i++) {
+    if (maxInd[i + 1] - maxInd[i] < winSize) {
+      if (x[maxInd[i]] - x[maxInd[i + 1]] <= 0)
+	zero.push_back(maxInd[i]);
+      else
+	zero.push_back(maxInd[i + 1]);
+    }
+  }
+  for (size_t i = 0; i < zero.size(); i++)
+    lm[zero[i]] = 0;
+}
+
+/*
+ * MSW.getRidge. The R implementation operates on named lists; the rules of
+ * R's list indexing (also in corner cases) are reproduced by rList.
+ */
+static const std::string NA_NAME("\001NA");
+
+struct rElem {
+  bool null;
+  std::vector<int> v;
+  std::string name;
+  rElem() : null(true) {}
+  rElem(int x, const std::string &nm) : null(false), v(1, x), name(nm) {}
+};
+
+struct rList {
+  std::vector<rElem> e;
+  bool hasNames;
+  rList() : hasNames(false) {}
+
+  int find(const std::string &nm) const {
+    if (!hasNames)
+      return -1;
+    for (size_t i = 0; i < e.size(); i++)
+      if (e[i].name == nm)
+	return i;
+    return -1;
+  }
+  // x[[nm]], NULL if not found
+  const rElem *get(const std::string &nm) const {
+    int i = find(nm);
+    return (i < 0) ? NULL : &e[i];
+  }
+  // x[[nm]] <- v
+  void set(const std::string &nm, const std::vector<int> &v) {
+    int i = find(nm);
+    if (i < 0) {
+      if (!hasNames) {
+	for (size_t k = 0; k < e.size(); k++)
+	  e[k].name = "";
+	hasNames = true;
+      }
+      e.push_back(rElem());
+      i = e.size() - 1;
+      e[i].name = nm;
+    }
+    e[i].null = false;
+    e[i].v = v;
+  }
+  // x <- x[-idx] (1-based positions)
+  void remove(const std::vector<int> &idx) {
+    if (idx.empty()) {
+      e.clear();
+      return;
+    }
+    std::vector<bool> drop(e.size(), false);
+    for (size_t i = 0; i < idx.size(); i++)
+      if (idx[i] >= 1 && idx[i] <= (int) e.size())
+	drop[idx[i] - 1] = true;
+    std::vector<rElem> keep;
+    for (size_t i = 0; i < e.size(); i++)
+      if (!drop[i])
+	keep.push_back(e[i]);
+    e.swap(keep);
+  }
+  // names(x) <- nms
+  void setNames(const std::vector<int> &nms) {
+    if (nms.empty()) {
+      hasNames = false;
+      return;
+    }
+    if (nms.size() > e.size())
+      throw cwError("'names' attribute must be the same length as the vector");
+    for (size_t i = 0; i < e.size(); i++)
+      e[i].name = (i < nms.size()) ? std::to_string(nms[i]) : NA_NAME;
+    hasNames = true;
+  }
+  // x <- c(x, list(...)) with a named list
+  void append(const std::vector<int> &vals, int value, bool useVals) {
+    if (!hasNames)
+      for (size_t k = 0; k < e.size(); k++)
+	e[k].name = "";
+    hasNames = true;
+    for (size_t i = 0; i < vals.size(); i++)
+      e.push_back(rElem(useVals ? vals[i] : value, std::to_string(vals[i])));
+  }
+};
+
+static void getRidge(const double *localMax, int nMz, const double *scales,
+		     int ncol, std::vector<std::vector<int> > &ridges) {
+  const int gapTh = 3, minWinSize = 3;
+  ridges.clear();
+  const int iInit = ncol;
+  const int skip = iInit + 1;
+  std::vector<int> maxInd_curr;
+  for (int i = 0; i < nMz; i++)
+    if (localMax[(iInit - 1) * nMz + i] > 0)
+      maxInd_curr.push_back(i + 1);
+  std::vector<int> colInd;
+  if (ncol > 1)
+    for (int c = iInit - 1; c >= 1; c--)
+      colInd.push_back(c);
+  else
+    colInd.push_back(1);
+  rList ridgeList, peakStatus;
+  ridgeList.append(maxInd_curr, 0, true);
+  peakStatus.append(maxInd_curr, 0, false);
+  std::vector<rElem> orphanRidgeList;
+  std::vector<std::string> orphanRidgeName;
+
+  for (size_t jj = 0; jj < colInd.size(); jj++) {
+    int col = colInd[jj];
+    double scale = scales[col - 1];
+    const double *lmc = &localMax[(col - 1) * nMz];
+    if (col == skip)
+      continue;
+    if (maxInd_curr.empty()) {
+      for (int i = 0; i < nMz; i++)
+	if (lmc[i] > 0)
+	  maxInd_curr.push_back(i + 1);
+      continue;
+    }
+    int winSize = (int) floor(scale / 2);
+    if (winSize < minWinSize)
+      winSize = minWinSize;
+    std::vector<int> selPeak;
+    std::vector<std::string> removeJ;
+    for (size_t k = 0; k < maxInd_curr.size(); k++) {
+      int ind = maxInd_curr[k];
+      int start = std::max(1, ind - winSize);
+      int end = std::min(nMz, ind + winSize);
+      std::vector<int> indCurr;
+      for (int i = start; i <= end; i++)
+	if (lmc[i - 1] > 0)
+	  indCurr.push_back(i);
+      std::string nm = std::to_string(ind);
+      int sel;
+      if (indCurr.empty()) {
+	const rElem *st = peakStatus.get(nm);
+	int status = (st == NULL || st->null) ? gapTh + 1 : st->v[0];
+	if (status > gapTh && scale >= 2) {
+	  const rElem *temp = ridgeList.get(nm);
+	  rElem orphan;
+	  if (temp != NULL && !temp->null) {
+	    int m = temp->v.size() - status;
+	    if (m < 0)
+	      throw cwError("can't mix positive and negative subscripts");
+	    orphan.null = false;
+	    orphan.v.assign(temp->v.begin(),
+			    temp->v.begin() + std::max(m, 1));
+	  }
+	  orphanRidgeList.push_back(orphan);
+	  orphanRidgeName.push_back(std::to_string(col + status + 1) + "_" +
+				    nm);
+	  removeJ.push_back(nm);
+	  continue;
+	}
+	sel = ind;
+	peakStatus.set(nm, std::vector<int>(1, status + 1));
+      } else {
+	peakStatus.set(nm, std::vector<int>(1, 0));
+	sel = indCurr[0];
+	for (size_t i = 1; i < indCurr.size(); i++)
+	  if (abs(indCurr[i] - ind) < abs(sel - ind))
+	    sel = indCurr[i];
+      }
+      const rElem *cur = ridgeList.get(nm);
+      std::vector<int> v;
+      if (cur != NULL && !cur->null)
+	v = cur->v;
+      v.push_back(sel);
+      ridgeList.set(nm, v);
+      selPeak.push_back(sel);
+    }
+    // remove the disconnected ridges
+    if (!removeJ.empty()) {
+      std::vector<int> removeInd;
+      if (ridgeList.hasNames)
+	for (size_t i = 0; i < ridgeList.e.size(); i++)
+	  if (std::find(removeJ.begin(), removeJ.end(),
+			ridgeList.e[i].name) != removeJ.end())
+	    removeInd.push_back(i + 1);
+      ridgeList.remove(removeInd);
+      peakStatus.remove(removeInd);
+    }
+    // keep only the longest ridge of duplicated peaks
+    std::vector<int> dupPeak;
+    for (size_t i = 0; i < selPeak.size(); i++) {
+      bool dup = std::find(selPeak.begin(), selPeak.begin() + i, selPeak[i])
+	!= selPeak.begin() + i;
+      if (dup && std::find(dupPeak.begin(), dupPeak.end(), selPeak[i]) ==
+	  dupPeak.end())
+	dupPeak.push_back(selPeak[i]);
+    }
+    if (!dupPeak.empty()) {
+      std::vector<int> removeInd;
+      for (size_t i = 0; i < dupPeak.size(); i++) {
+	std::vector<int> selInd;
+	for (size_t k = 0; k < selPeak.size(); k++)
+	  if (selPeak[k] == dupPeak[i])
+	    selInd.push_back(k + 1);
+	int best = 0;
+	size_t bestLen = 0;
+	for (size_t k = 0; k < selInd.size(); k++) {
+	  size_t l = 0;
+	  if (selInd[k] <= (int) ridgeList.e.size() &&
+	      !ridgeList.e[selInd[k] - 1].null)
+	    l = ridgeList.e[selInd[k] - 1].v.size();
+	  if (k == 0 || l > bestLen) {
+	    best = k;
+	    bestLen = l;
+	  }
+	}
+	for (size_t k = 0; k < selInd.size(); k++)
+	  if ((int) k != best)
+	    removeInd.push_back(selInd[k]);
+	// as in the R code, the ridge at position best (and not selInd[best])
+	// is added to the orphans
+	if (best < (int) ridgeList.e.size())
+	  orphanRidgeList.push_back(ridgeList.e[best]);
+	else
+	  orphanRidgeList.push_back(rElem());
+	orphanRidgeName.push_back(std::to_string(col) + "_" +
+				  std::to_string(selPeak[best]));
+      }
+      std::vector<int> keep;
+      std::vector<bool> drop(selPeak.size(), false);
+      for (size_t i = 0; i < removeInd.size(); i++)
+	drop[removeInd[i] - 1] = true;
+      for (size_t i = 0; i < selPeak.size(); i++)
+	if (!drop[i])
+	  keep.push_back(selPeak[i]);
+      selPeak.swap(keep);
+      ridgeList.remove(removeInd);
+      peakStatus.remove(removeInd);
+    }
+    if (!ridgeList.e.empty())
+      ridgeList.setNames(selPeak);
+    if (!peakStatus.e.empty())
+      peakStatus.setNames(selPeak);
+    if (scale >= 2) {
+      std::vector<int> unSel;
+      for (int i = 0; i < nMz; i++)
+	if (lmc[i] > 0 &&
+	    std::find(selPeak.begin(), selPeak.end(), i + 1) == selPeak.end())
+	  unSel.push_back(i + 1);
+      ridgeList.append(unSel, 0, true);
+      peakStatus.append(unSel, 0, false);
+      maxInd_curr = selPeak;
+      maxInd_curr.insert(maxInd_curr.end(), unSel.begin(), unSel.end());
+    } else
+      maxInd_curr = selPeak;
+  }
+
+  // names(ridgeList) <- paste(1, names(ridgeList), sep = '_')
+  std::vector<rElem> all;
+  for (size_t i = 0; i < ridgeList.e.size(); i++) {
+    rElem el = ridgeList.e[i];
+    if (ridgeList.hasNames)
+      el.name = "1_" + (el.name == NA_NAME ? std::string("NA") : el.name);
+    else
+      el.name = (i == 0) ? "1_" : NA_NAME;
+    all.push_back(el);
+  }
+  for (size_t i = 0; i < orphanRidgeList.size(); i++) {
+    orphanRidgeList[i].name = orphanRidgeName[i];
+    all.push_back(orphanRidgeList[i]);
+  }
+  // remove duplicated ridges
+  std::vector<std::string> seen;
+  for (size_t i = 0; i < all.size(); i++) {
+    if (std::find(seen.begin(), seen.end(), all[i].name) != seen.end())
+      continue;
+    seen.push_back(all[i].name);
+    std::vector<int> r(all[i].v.rbegin(), all[i].v.rend());
+    ridges.push_back(r);
+  }
+}
+
+/*
+ * descendMinTol and .narrow_rt_boundaries; positions are 1-based.
+ */
+static void descendMinTol(const double *d, int N, int s1, int s2,
+			  int maxDescOutlier, int *lm) {
+  int l = s1, r = s2, outl = 0, opos = 0, vpos;
+  while (l > 1 && d[l - 1] > 0 && outl <= maxDescOutlier) {
+    vpos = (outl > 0) ? opos : l;
+    if (d[l - 2] > d[vpos - 1])
+      outl++;
+    else
+      outl = 0;
+    if (outl == 1)
+      opos = l;
+    l--;
+  }
+  if (outl > 0)
+    l += outl;
+  outl = 0;
+  while (r < N && d[r - 1] > 0 && outl <= maxDescOutlier) {
+    vpos = (outl > 0) ? opos : r;
+    if (d[r] > d[vpos - 1])
+      outl++;
+    else
+      outl = 0;
+    if (outl == 1)
+      opos = r;
+    r++;
+  }
+  if (outl > 0)
+    r -= outl;
+  lm[0] = l;
+  lm[1] = r;
+}
+
+static void narrowRtBoundaries(int *lm, const double *d) {
+  int n = lm[1] - lm[0] + 1;
+  std::vector<bool> above(n);
+  bool any = false;
+  for (int i = 0; i < n; i++) {
+    above[i] = d[lm[0] + i - 1] >= 1;
+    any = any || above[i];
+  }
+  if (!any)
+    return;
+  int lo = -1, hi = -1;
+  for (int i = 0; i < n; i++) {
+    if (above[i] || (i + 1 < n && above[i + 1]) || (i > 0 && above[i - 1])) {
+      if (lo < 0)
+	lo = i;
+      hi = i;
+    }
+  }
+  int l0 = lm[0];
+  lm[0] = l0 + lo;
+  lm[1] = l0 + hi;
+}
+
+static double mzCenter(const double *mz, const double *intensity, int n,
+		       int fun) {
+  int iap, st, en;
+  switch (fun) {
+  case MZC_WMEAN:
+    return r_weighted_mean(mz, intensity, n);
+  case MZC_MEAN:
+    return r_mean(mz, n);
+  case MZC_APEX:
+    return mz[r_which_max(intensity, n)];
+  default:
+    iap = r_which_max(intensity, n);
+    st = std::max(0, iap - 1);
+    en = std::min(iap + 1, n - 1);
+    if (fun == MZC_WMEANAPEX3)
+      return r_weighted_mean(mz + st, intensity + st, en - st + 1);
+    return r_mean(mz + st, en - st + 1);
+  }
+}
+
+/*
+ * Peak detection in a single ROI. Returns false if no m/z or intensity
+ * values were found in the ROI.
+ */
+static bool centWaveROI(const cwRoi &roi, const cwParams &par,
+			std::vector<double> &res) {
+  const double *d = roi.d;
+  const int nd = roi.nd;
+  const int N = roi.scmax - roi.scmin + 1;
+  const double *omz = roi.omz;
+  const double *od = d + (roi.scmin - roi.srFrom);
+  // td[i] = srFrom + i - 1
+#define TD(i) (roi.srFrom + (i) - 1)
+  bool any = false;
+  for (int i = 0; i < N && !any; i++)
+    any = omz[i] != 0;
+  if (!any)
+    return false;
+  any = false;
+  for (int i = 0; i < N && !any; i++)
+    any = od[i] != 0;
+  if (!any)
+    return false;
+  int ftdFrom = std::max(TD(1), roi.scmin - par.scRangeTol);
+  int ftdTo = std::min(TD(nd), roi.scmax + par.scRangeTol);
+  int nfd = ftdTo - ftdFrom + 1;
+  const double *fd = d + (ftdFrom - roi.srFrom);
+
+  double noise = roi.noised ?
+    estimateChromNoise(roi.noised, roi.nnoised, 0.05, par.noiseMinPts) :
+    estimateChromNoise(d, nd, 0.05, par.noiseMinPts);
+  if (par.firstBaselineCheck) {
+    int istart = 0, n = 0, num = par.minPtsAboveBaseLine;
+    continuousPtsAboveThreshold(const_cast<double *>(fd), &istart, &nfd,
+				&noise, &num, &n);
+    if (n <= 0)
+      return true;
+  }
+  double lnoise[2];
+  getLocalNoiseEstimate(d, nd, ftdFrom - roi.srFrom + 1,
+			ftdTo - roi.srFrom + 1, par.noiserange, par.nscantime,
+			noise, par.minPtsAboveBaseLine, lnoise);
+  double baseline = r_max2(1, r_min2(lnoise[0], noise));
+  double sdnoise = r_max2(1, lnoise[1]);
+  double sdthr = sdnoise * par.snthresh;
+  any = false;
+  for (int i = 0; i < nfd && !any; i++)
+    any = fd[i] - baseline >= sdthr;
+  if (!any)
+    return true;
+  std::vector<double> wCoefs;
+  int nsc = par.bank->transform(d, nd, wCoefs);
+  if (nsc < 1)
+    return true;
+  any = false;
+  for (size_t i = 0; i < wCoefs.size() && !any; i++)
+    any = wCoefs[i] - baseline >= sdthr;
+  if (!any)
+    return true;
+#define WC(i, j) wCoefs[(size_t) (j) * nd + (i)]
+  if (TD(nd) == par.nscantime) {
+    if (nd < 2)
+      throw cwError("replacement has length zero");
+    for (int j = 0; j < nsc; j++)
+      WC(nd - 1, j) = WC(nd - 2, j) * 0.99;
+  }
+  // MSW.getLocalMaximumCWT
+  std::vector<double> localMax(wCoefs.size());
+  for (int j = 0; j < nsc; j++) {
+    double winSize = par.scales[j] * 2 + 1;
+    if (winSize < 5)
+      winSize = 5;
+    localMaximum(&WC(0, j), nd, (int) winSize, &localMax[(size_t) j * nd]);
+  }
+  for (size_t i = 0; i < wCoefs.size(); i++)
+    if (wCoefs[i] < 0)
+      localMax[i] = 0;
+  std::vector<std::vector<int> > rL;
+  getRidge(&localMax[0], nd, par.scales, nsc, rL);
+
+  // candidate peaks
+  std::vector<double> peaks;
+  std::vector<int> peakinfo;   // scaleNr, scpos, scmin, scmax
+  for (size_t r = 0; r < rL.size(); r++) {
+    const std::vector<int> &opp = rL[r];
+    if (opp.empty())
+      continue;
+    bool wpeak = false;
+    for (size_t k = 0; k < opp.size() && !wpeak; k++)
+      wpeak = WC(opp[k] - 1, 0) - baseline >= sdthr;
+    if (!wpeak)
+      continue;
+    // any(d[pp[dv]] - baseline >= sdthr) with pp within ftd
+    bool ok = false;
+    for (size_t k = 0; k < opp.size() && !ok; k++) {
+      int t = TD(opp[k]);
+      ok = t >= ftdFrom && t <= ftdTo && d[opp[k] - 1] - baseline >= sdthr;
+    }
+    if (!ok)
+      continue;
+    int nopp = opp.size();
+    int best_nr;
+    if (!ISNAN(roi.scale)) {
+      best_nr = 0;
+      for (int s = 0; s < par.nscales && !best_nr; s++)
+	if (par.scales[s] == roi.scale)
+	  best_nr = s + 1;
+      if (!best_nr)
+	throw cwError("argument is of length zero");
+      if (best_nr > nopp)
+	best_nr = nopp;
+    } else {
+      std::vector<double> inti(nopp);
+      int irange = (int) ceil(par.scales[0] / 2);
+      for (int k = 0; k < nopp; k++) {
+	int kpos = opp[k];
+	int r1 = (kpos - irange > 1) ? kpos - irange : 1;
+	int r2 = (kpos + irange < nd) ? kpos + irange : nd;
+	inti[k] = r_sum(d + r1 - 1, r2 - r1 + 1);
+      }
+      best_nr = r_which_max(&inti[0], nopp) + 1;
+    }
+    double best_scale = par.scales[best_nr - 1];
+    int best_pos = opp[best_nr - 1];
+    int lwpos = (int) std::max(1.0, best_pos - best_scale);
+    int rwpos = (int) std::min(best_pos + best_scale, (double) nd);
+    int p1 = TD(lwpos) - roi.scmin + 1;
+    if (p1 < 1 || p1 > N)
+      p1 = 1;
+    int p2 = TD(rwpos) - roi.scmin + 1;
+    if (p2 < 1 || p2 > N)
+      p2 = N;
+    std::vector<double> mzv, mzi;
+    double maxint = R_NegInf;
+    // p1:p2 might be a descending sequence
+    int step = (p2 >= p1) ? 1 : -1;
+    for (int k = p1; ; k += step) {
+      if (od[k - 1] > maxint || ISNAN(od[k - 1]))
+	maxint = od[k - 1];
+      if (od[k - 1] > 0) {
+	mzv.push_back(omz[k - 1]);
+	mzi.push_back(od[k - 1]);
+      }
+      if (k == p2)
+	break;
+    }
+    if (mzv.empty())
+      continue;
+    int nmzv = mzv.size();
+    double mzrmin = *std::min_element(mzv.begin(), mzv.end());
+    double mzrmax = *std::max_element(mzv.begin(), mzv.end());
+    double mzmean = mzCenter(&mzv[0], &mzi[0], nmzv, par.mzCenterFun);
+    double dppm = NA_REAL;
+    if (par.verboseColumns) {
+      if (nmzv >= par.minCentroids + 1) {
+	std::vector<double> x(nmzv - 1);
+	for (int k = 0; k < nmzv - 1; k++)
+	  x[k] = fabs(mzv[k + 1] - mzv[k]) / (mzrmax * 1e-6);
+	int w = par.minCentroids;
+	double mn = R_PosInf;
+	for (int k = w - 1; k < nmzv - 1; k++) {
+	  double mx = R_NegInf;
+	  for (int l = k - w + 1; l <= k; l++)
+	    mx = std::max(mx, x[l]);
+	  mn = std::min(mn, mx);
+	}
+	dppm = r_round(mn);
+      } else
+	dppm = r_round((mzrmax - mzrmin) / (mzrmax * 1e-6));
+    }
+    double row[CW_NCOL] = {
+      mzmean, mzrmin, mzrmax, NA_REAL, NA_REAL, NA_REAL, NA_REAL, NA_REAL,
+      maxint, r_round((maxint - baseline) / sdnoise), NA_REAL, NA_REAL,
+      NA_REAL, NA_REAL, (double) roi.f, dppm, best_scale,
+      (double) TD(best_pos), (double) TD(lwpos), (double) TD(rwpos),
+      NA_REAL, NA_REAL};
+    peaks.insert(peaks.end(), row, row + CW_NCOL);
+    int info[4] = {best_nr, best_pos, lwpos, rwpos};
+    peakinfo.insert(peakinfo.end(), info, info + 4);
+  }
+
+  // postprocessing
+  int npeaks = peaks.size() / CW_NCOL;
+  double mzrange_ROI[2] = {roi.mzmin, roi.mzmax};
+  std::vector<double> current_ints;
+  for (int p = 0; p < npeaks; p++) {
+    double *pk = &peaks[p * CW_NCOL];
+    int *pi = &peakinfo[p * 4];
+    const double *cur = d;
+    if (pk[CW_MZMIN] != mzrange_ROI[0] || pk[CW_MZMAX] != mzrange_ROI[1]) {
+      int lastScan = par.nscantime;
+      current_ints.resize(nd);
+      for (int i = 0; i < nd; i++)
+	current_ints[i] = getScanEIC(TD(i + 1), pk[CW_MZMIN], pk[CW_MZMAX],
+				     par.mz, par.intensity, par.scanindex,
+				     par.nmz, lastScan);
+      cur = &current_ints[0];
+      mzrange_ROI[0] = mzrange_ROI[1] = 0;
+    }
+    int lm[2];
+    if (par.integrate == 1) {
+      if (pi[0] > nsc)
+	throw cwError("subscript out of bounds");
+      int numin = nd, istart = pi[1] - 1;
+      DescendMin(&WC(0, pi[0] - 1), &numin, &istart, &lm[0], &lm[1]);
+      lm[0]++;
+      lm[1]++;
+      bool gap = true;
+      for (int i = lm[0]; i <= lm[1] && gap; i++)
+	gap = cur[i - 1] == 0;
+      if (lm[0] == lm[1] || gap)
+	descendMinTol(cur, nd, pi[2], pi[3], par.maxDescOutlier, lm);
+    } else
+      descendMinTol(cur, nd, pi[2], pi[3], par.maxDescOutlier, lm);
+    narrowRtBoundaries(lm, d);
+    int npd = lm[1] - lm[0] + 1;
+    const double *pd = cur + lm[0] - 1;
+    int pr1 = TD(lm[0]), pr2 = TD(lm[1]);
+    pk[CW_RTMIN] = par.scantime[pr1 - 1];
+    pk[CW_RTMAX] = par.scantime[pr2 - 1];
+    double maxo = R_NegInf;
+    for (int i = 0; i < npd; i++)
+      if (pd[i] > maxo || ISNAN(pd[i]))
+	maxo = pd[i];
+    pk[CW_MAXO] = maxo;
+    double pwid = (par.scantime[pr2 - 1] - par.scantime[pr1 - 1]) /
+      (pr2 - pr1);
+    if (ISNAN(pwid))
+      pwid = 1;
+    pk[CW_INTO] = pwid * r_sum(pd, npd);
+    std::vector<double> db;
+    for (int i = 0; i < npd; i++)
+      if (pd[i] - baseline > 0)
+	db.push_back(pd[i] - baseline);
+    pk[CW_INTB] = pwid * r_sum(db.empty() ? NULL : &db[0], db.size());
+    pk[CW_LMIN] = lm[0];
+    pk[CW_LMAX] = lm[1];
+    pk[CW_RT] = par.scantime[(int) pk[CW_SCPOS] - 1];
+  }
+  // unique(peaks)
+  for (int p = 0; p < npeaks; p++) {
+    const double *pk = &peaks[p * CW_NCOL];
+    bool dup = false;
+    for (int q = 0; q < p && !dup; q++) {
+      const double *pq = &peaks[q * CW_NCOL];
+      dup = true;
+      for (int c = 0; c < CW_NCOL && dup; c++)
+	dup = (pk[c] == pq[c]) || (ISNAN(pk[c]) && ISNAN(pq[c]));
+    }
+    if (!dup)
+      res.insert(res.end(), pk, pk + CW_NCOL);
+  }
+#undef WC
+#undef TD
+  return true;
+}
+
+/*
+ * Detect chromatographic peaks in a batch of ROIs.
+ *
+ * mzmin, mzmax, scmin, scmax: the ROIs.
+ * f: index of the ROIs in the full ROI list.
+ * roiScales: scale to be used for each ROI, numeric of length 0 to select the
+ *      scale based on the data.
+ * srFrom: first scan of the EICs.
+ * eics, mzs: lists with the ROIs' EICs (scans srFrom to srTo) and their m/z
+ *      values (scans scmin to scmax) as returned by getEICs.
+ * noiseEics: list with EICs for the noise estimation, NULL elements for ROIs
+ *      for which the EIC in eics should be used.
+ * bank: external pointer to the wavelets of the scales (see cwtBankCreate),
+ *      shared by the batches of a detection run, or NULL to compute them for
+ *      this batch only.
+ *
+ * Returns a list with the peak matrix and the number of ROIs without data.
+ */
+extern "C" SEXP centWaveROIs(SEXP mz, SEXP intensity, SEXP scanindex,
+			     SEXP scantime, SEXP mzmin, SEXP mzmax,
+			     SEXP scmin, SEXP scmax, SEXP f, SEXP roiScales,
+			     SEXP srFrom, SEXP eics,
+			     SEXP mzs, SEXP noiseEics, SEXP scales,
+			     SEXP snthresh, SEXP minPtsAboveBaseLine,
+			     SEXP scRangeTol, SEXP maxDescOutlier,
+			     SEXP noiserange, SEXP noiseMinPts,
+			     SEXP firstBaselineCheck, SEXP integrate,
+			     SEXP mzCenterFun, SEXP minCentroids,
+			     SEXP verboseColumns, SEXP bank) {
+  cwParams par;
+  par.scales = REAL(scales);
+  par.nscales = LENGTH(scales);
+  par.snthresh = asReal(snthresh);
+  par.minPtsAboveBaseLine = asInteger(minPtsAboveBaseLine);
+  par.scRangeTol = asInteger(scRangeTol);
+  par.maxDescOutlier = asInteger(maxDescOutlier);
+  par.noiserange = asInteger(noiserange);
+  par.noiseMinPts = asInteger(noiseMinPts);
+  par.firstBaselineCheck = asLogical(firstBaselineCheck);
+  par.integrate = asInteger(integrate);
+  par.mzCenterFun = asInteger(mzCenterFun);
+  par.minCentroids = asInteger(minCentroids);
+  par.verboseColumns = asLogical(verboseColumns);
+  par.scantime = REAL(scantime);
+  par.nscantime = LENGTH(scantime);
+  par.mz = REAL(mz);
+  par.intensity = REAL(intensity);
+  par.scanindex = INTEGER(scanindex);
+  par.nmz = LENGTH(mz);
+  cwtBank *shared = NULL;
+  if (TYPEOF(bank) == EXTPTRSXP)
+    shared = (cwtBank *) R_ExternalPtrAddr(bank);
+  if (shared != NULL && !shared->hasScales(par.scales, par.nscales))
+    error("centWave: the wavelet bank was created for different scales");
+  par.bank = shared;
+
+  int nroi = LENGTH(scmin);
+  int nscale = LENGTH(roiScales);
+
+  std::vector<double> res;
+  int nopeaks = 0;
+  const char *err = NULL;
+  try {
+    if (par.bank == NULL)
+      par.bank = new cwtBank(par.scales, par.nscales);
+    for (int i = 0; i < nroi; i++) {
+      cwRoi r;
+      r.f = INTEGER(f)[i];
+      r.mzmin = REAL(mzmin)[i];
+      r.mzmax = REAL(mzmax)[i];
+      r.scmin = INTEGER(scmin)[i];
+      r.scmax = INTEGER(scmax)[i];
+      r.scale = nscale ? REAL(roiScales)[i] : NA_REAL;
+      r.srFrom = INTEGER(srFrom)[i];
+      r.d = REAL(VECTOR_ELT(eics, i));
+      r.nd = LENGTH(VECTOR_ELT(eics, i));
+      r.omz = REAL(VECTOR_ELT(mzs, i));
+      SEXP nd = VECTOR_ELT(noiseEics, i);
+      r.noised = isNull(nd) ? NULL : REAL(nd);
+      r.nnoised = isNull(nd) ? 0 : LENGTH(nd);
+      if (!centWaveROI(r, par, res))
+	nopeaks++;
+    }
+  } catch (cwError &e) {
+    err = e.msg;
+  } catch (std::bad_alloc &e) {
+    err = "memory could not be allocated";
+  } catch (...) {
+    err = "unexpected error";
+  }
+  if (shared == NULL)
+    delete par.bank;
+  if (err != NULL) {
+    std::vector<double>().swap(res);
+    error("centWave: %s", err);
+  }
+
+  int n = res.size() / CW_NCOL;
+  SEXP peaks, dimnames, cn, out, names;
+  PROTECT(peaks = allocMatrix(REALSXP, n, CW_NCOL));
+  double *pp = REAL(peaks);
+  for (int i = 0; i < n; i++)
+    for (int c = 0; c < CW_NCOL; c++)
+      pp[(size_t) c * n + i] = res[(size_t) i * CW_NCOL + c];
+  PROTECT(dimnames = allocVector(VECSXP, 2));
+  PROTECT(cn = allocVector(STRSXP, CW_NCOL));
+  for (int c = 0; c < CW_NCOL; c++)
+    SET_STRING_ELT(cn, c, mkChar(cwColnames[c]));
+  SET_VECTOR_ELT(dimnames, 1, cn);
+  setAttrib(peaks, R_DimNamesSymbol, dimnames);
+  PROTECT(out = allocVector(VECSXP, 2));
+  PROTECT(names = allocVector(STRSXP, 2));
+  SET_VECTOR_ELT(out, 0, peaks);
+  SET_VECTOR_ELT(out, 1, ScalarInteger(nopeaks));
+  SET_STRING_ELT(names, 0, mkChar("peaks"));
+  SET_STRING_ELT(names, 1, mkChar("nopeaks"));
+  setAttrib(out, R_NamesSymbol, names);
+  UNPROTECT(5);
+  return out;
+}
+
+static void cwtBank_finalize(SEXP ptr) {
+  cwtBank *bank = (cwtBank *) R_ExternalPtrAddr(ptr);
+  if (bank != NULL) {
+    delete bank;
+    R_ClearExternalPtr(ptr);
+  }
+}
+
+/*
+ * Creates the wavelets of the scales for centWaveROIs, returned as external
+ * pointer to be used for all batches of ROIs of a detection run.
+ */
+extern "C" SEXP cwtBankCreate(SEXP scales) {
+  SEXP res;
+  cwtBank *bank = NULL;
+  PROTECT(res = R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(res, cwtBank_finalize, TRUE);
+  try {
+    bank = new cwtBank(REAL(scales), LENGTH(scales));
+  } catch (...) {
+    bank = NULL;
+  }
+  if (bank == NULL)
+    error("centWave: memory could not be allocated");
+  R_SetExternalPtrAddr(res, bank);
+  UNPROTECT(1);
+  return res;
+}
+
+/*
+ * Continuous wavelet transform of x with the mexican hat wavelet, returning
+ * the same coefficient matrix as MSW.cwt (one column per scale, scales larger
+ * than the extended signal are dropped). method: 0 auto, 1 direct, 2 fft.
+ */
+extern "C" SEXP cwtMexh(SEXP x, SEXP scales, SEXP method) {
+  int n = LENGTH(x);
+  std::vector<double> wCoefs;
+  int nsc = 0, pmethod = asInteger(method);
+  const char *err = NULL;
+  try {
+    cwtBank bank(REAL(scales), LENGTH(scales));
+    nsc = bank.transform(REAL(x), n, wCoefs, pmethod);
+  } catch (cwError &e) {
+    err = e.msg;
+  } catch (std::bad_alloc &e) {
+    err = "memory could not be allocated";
+  } catch (...) {
+    err = "unexpected error";
+  }
+  if (err != NULL) {
+    std::vector<double>().swap(wCoefs);
+    error("cwtMexh: %s", err);
+  }
+  SEXP res;
+  PROTECT(res = allocMatrix(REALSXP, n, nsc));
+  if (nsc > 0)
+    std::copy(wCoefs.begin(), wCoefs.end(), REAL(res));
+  UNPROTECT(1);
+  return res;
+}
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "float32Matrix.h"
+
+static const char F32MATRIX_MAGIC[8] = {'X', 'C', 'M', 'S', 'F', '3', '2',
+					'M'};
+#define F32MATRIX_HEADER 16
+
+static void f32Matrix_zero(struct f32Matrix *m) {
+  m->nrow = 0;
+  m->ncol = 0;
+  m->data = NULL;
+  m->writable = 0;
+  m->map = NULL;
+  m->len = 0;
+  m->file = NULL;
+}
+
+static size_t f32Matrix_size(int nrow, int ncol) {
+  return F32MATRIX_HEADER + sizeof(float) * (size_t)nrow * ncol;
+}
+
+static void f32Matrix_header(char *head, int nrow, int ncol) {
+  int dim[2] = {nrow, ncol};
+  memcpy(head, F32MATRIX_MAGIC, sizeof(F32MATRIX_MAGIC));
+  memcpy(head + sizeof(F32MATRIX_MAGIC), dim, sizeof(dim));
+}
+
+int f32Matrix_create(struct f32Matrix *m, const char *file, int nrow,
+		     int ncol) {
+  char head[F32MATRIX_HEADER];
+  size_t len;
+  f32Matrix_zero(m);
+  if (nrow < 0 || ncol < 0)
+    return(F32MATRIX_ERR_FORMAT);
+  len = f32Matrix_size(nrow, ncol);
+  f32Matrix_header(head, nrow, ncol);
+#ifdef _WIN32
+  // the data is written on close
+  m->data = (float *) calloc((size_t)nrow * ncol + 1, sizeof(float));
+  m->file = (char *) malloc(strlen(file) + 1);
+  if (m->data == NULL || m->file == NULL) {
+    free(m->data);
+    free(m->file);
+    f32Matrix_zero(m);
+    return(F32MATRIX_ERR_MEMORY);
+  }
+  strcpy(m->file, file);
+#else
+  void *map;
+  int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return(F32MATRIX_ERR_FILE);
+  if (ftruncate(fd, (off_t)len) != 0) {
+    close(fd);
+    return(F32MATRIX_ERR_FILE);
+  }
+  map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return(F32MATRIX_ERR_FILE);
+  memcpy(map, head, F32MATRIX_HEADER);
+  m->map = map;
+  m->len = len;
+  m->data = (float *)((char *) map + F32MATRIX_HEADER);
+#endif
+  m->nrow = nrow;
+  m->ncol = ncol;
+  m->writable = 1;
+  return(F32MATRIX_OK);
+}
+
+int f32Matrix_open(struct f32Matrix *m, const char *file) {
+  char head[F32MATRIX_HEADER];
+  int dim[2];
+  size_t len, nread;
+  FILE *fp;
+  f32Matrix_zero(m);
+  fp = fopen(file, "rb");
+  if (fp == NULL)
+    return(F32MATRIX_ERR_FILE);
+  nread = fread(head, 1, F32MATRIX_HEADER, fp);
+  memcpy(dim, head + sizeof(F32MATRIX_MAGIC), sizeof(dim));
+  if (nread != F32MATRIX_HEADER ||
+      memcmp(head, F32MATRIX_MAGIC, sizeof(F32MATRIX_MAGIC)) ||
+      dim[0] < 0 || dim[1] < 0) {
+    fclose(fp);
+    return(F32MATRIX_ERR_FORMAT);
+  }
+  len = f32Matrix_size(dim[0], dim[1]);
+#ifdef _WIN32
+  m->data = (float *) malloc(len - F32MATRIX_HEADER + sizeof(float));
+  if (m->data == NULL) {
+    fclose(fp);
+    return(F32MATRIX_ERR_MEMORY);
+  }
+  nread = fread(m->data, 1, len - F32MATRIX_HEADER, fp);
+  fclose(fp);
+  if (nread != len - F32MATRIX_HEADER) {
+    free(m->data);
+    m->data = NULL;
+    return(F32MATRIX_ERR_FORMAT);
+  }
+#else
+  void *map;
+  struct stat st;
+  int fd;
+  fclose(fp);
+  fd = open(file, O_RDONLY);
+  if (fd < 0)
+    return(F32MATRIX_ERR_FILE);
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < len) {
+    close(fd);
+    return(F32MATRIX_ERR_FORMAT);
+  }
+  map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return(F32MATRIX_ERR_FILE);
+  m->map = map;
+  m->len = len;
+  m->data = (float *)((char *) map + F32MATRIX_HEADER);
+#endif
+  m->nrow = dim[0];
+  m->ncol = dim[1];
+  return(F32MATRIX_OK);
+}
+
+int f32Matrix_close(struct f32Matrix *m) {
+  int res = F32MATRIX_OK;
+#ifdef _WIN32
+  if (m->writable && m->file != NULL) {
+    char head[F32MATRIX_HEADER];
+    size_t n = (size_t)m->nrow * m->ncol;
+    FILE *fp = fopen(m->file, "wb");
+    f32Matrix_header(head, m->nrow, m->ncol);
+    if (fp == NULL)
+      res = F32MATRIX_ERR_FILE;
+    else {
+      if (fwrite(head, 1, F32MATRIX_HEADER, fp) != F32MATRIX_HEADER ||
+	  fwrite(m->data, sizeof(float), n, fp) != n)
+	res = F32MATRIX_ERR_FILE;
+      if (fclose(fp) != 0)
+	res = F32MATRIX_ERR_FILE;
+    }
+  }
+  free(m->data);
+  free(m->file);
+#else
+  if (m->map != NULL)
+    munmap(m->map, m->len);
+#endif
+  f32Matrix_zero(m);
+  return(res);
+}
+
+int is_float32_file(SEXP x) {
+  SEXP names;
+  if (TYPEOF(x) != VECSXP)
+    return(0);
+  names = getAttrib(x, R_NamesSymbol);
+  for (int i = 0; i < length(names); i++)
+    if (strcmp(CHAR(STRING_ELT(names, i)), "file") == 0)
+      return(1);
+  return(0);
+}
+
+static void float32_file_finalize(SEXP ptr) {
+  float32_file_close(ptr);
+}
+
+/*
+ * Maps the file of the single precision matrix x (list with elements file and
+ * dim) read-only. The mapping is owned by the returned external pointer, which
+ * is created (with its finalizer) before the file is mapped.
+ */
+SEXP float32_file_open(SEXP x) {
+  SEXP names, file = R_NilValue, dim = R_NilValue, ptr;
+  struct f32Matrix *m;
+  int res;
+  names = getAttrib(x, R_NamesSymbol);
+  for (int i = 0; i < length(x); i++) {
+    if (strcmp(CHAR(STRING_ELT(names, i)), "file") == 0)
+      file = VECTOR_ELT(x, i);
+    else if (strcmp(CHAR(STRING_ELT(names, i)), "dim") == 0)
+      dim = VECTOR_ELT(x, i);
+  }
+  if (TYPEOF(file) != STRSXP || length(file) != 1)
+    error("invalid single precision matrix: 'file' has to be a character");
+  if (dim != R_NilValue)
+    dim = coerceVector(dim, INTSXP);
+  PROTECT(dim);
+  PROTECT(ptr = R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, float32_file_finalize, TRUE);
+  m = (struct f32Matrix *) malloc(sizeof(struct f32Matrix));
+  if (m == NULL)
+    error("failed to allocate memory");
+  res = f32Matrix_open(m, CHAR(STRING_ELT(file, 0)));
+  if (res == F32MATRIX_OK && dim != R_NilValue &&
+      (length(dim) != 2 || INTEGER(dim)[0] != m->nrow ||
+       INTEGER(dim)[1] != m->ncol)) {
+    f32Matrix_close(m);
+    res = F32MATRIX_ERR_FORMAT;
+  }
+  if (res != F32MATRIX_OK) {
+    free(m);
+    error("failed to open the single precision matrix file '%s'",
+	  CHAR(STRING_ELT(file, 0)));
+  }
+  R_SetExternalPtrAddr(ptr, m);
+  UNPROTECT(2);
+  return(ptr);
+}
+
+struct f32Matrix *float32_file_get(SEXP ptr) {
+  struct f32Matrix *m = (struct f32Matrix *) R_ExternalPtrAddr(ptr);
+  if (m == NULL)
+    error("the single precision matrix is already closed");
+  return(m);
+}
+
+void float32_file_close(SEXP ptr) {
+  struct f32Matrix *m = (struct f32Matrix *) R_ExternalPtrAddr(ptr);
+  if (m != NULL) {
+    f32Matrix_close(m);
+    free(m);
+    R_ClearExternalPtr(ptr);
+  }
+}
+
+SEXP float32_file_sexp(const char *file, int nrow, int ncol) {
+  SEXP res, names, dim;
+  PROTECT(res = allocVector(VECSXP, 2));
+  PROTECT(names = allocVector(STRSXP, 2));
+  PROTECT(dim = allocVector(INTSXP, 2));
+  INTEGER(dim)[0] = nrow;
+  INTEGER(dim)[1] = ncol;
+  SET_VECTOR_ELT(res, 0, mkString(file));
+  SET_VECTOR_ELT(res, 1, dim);
+  SET_STRING_ELT(names, 0, mkChar("file"));
+  SET_STRING_ELT(names, 1, mkChar("dim"));
+  setAttrib(res, R_NamesSymbol, names);
+  UNPROTECT(3);
+  return(res);
+}
+
+/*
+ * Columns first to last (1-based) of the single precision matrix x (list with
+ * elements file and dim) as numeric matrix.
+ */
+SEXP float32_file_columns(SEXP x, SEXP first, SEXP last) {
+  SEXP ptr, res;
+  struct f32Matrix *m;
+  int pfirst = asInteger(first) - 1, plast = asInteger(last) - 1;
+  PROTECT(ptr = float32_file_open(x));
+  m = float32_file_get(ptr);
+  if (pfirst < 0 || plast >= m->ncol || plast < pfirst - 1)
+    error("invalid column range");
+  PROTECT(res = allocMatrix(REALSXP, m->nrow, plast - pfirst + 1));
+  double *out = REAL(res);
+  const float *in = m->data + (size_t)pfirst * m->nrow;
+  for (size_t i = 0; i < (size_t)m->nrow * (plast - pfirst + 1); i++)
+    out[i] = in[i];
+  float32_file_close(ptr);
+  UNPROTECT(2);
+  return(res);
+}
@@ -0,0 +1,75 @@
+/*
+ * Single precision matrices (column-major) stored in a file and mapped into
+ * memory, e.g. profile matrices that are shared (read-only) between several
+ * processes or that do not fit into memory.
+ *
+ * The file starts with a header of 16 bytes (magic, number of rows and
+ * number of columns) followed by the values. On systems without mmap the
+ * data is read into memory (and written to the file on close).
+ *
+ * On the R side such a matrix is represented by a list with elements "file"
+ * (the file name) and "dim" (number of rows and columns).
+ *
+ * Usage:
+ *   struct f32Matrix m;
+ *   if (f32Matrix_open(&m, file) == F32MATRIX_OK) {
+ *     ... m.data[i + (size_t)j * m.nrow] ...
+ *     f32Matrix_close(&m);
+ *   }
+ */
+#ifndef FLOAT32MATRIX_H
+#define FLOAT32MATRIX_H
+
+#include <stddef.h>
+#include <R.h>
+#include <Rinternals.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Status codes.
+#define F32MATRIX_OK 0
+#define F32MATRIX_ERR_FILE 1      // file could not be created, read or mapped
+#define F32MATRIX_ERR_FORMAT 2    // not a single precision matrix file
+#define F32MATRIX_ERR_MEMORY 3    // memory could not be allocated
+
+struct f32Matrix {
+  int nrow;
+  int ncol;
+  float *data;
+  int writable;
+  void *map;                      // mapped file or NULL
+  size_t len;                     // length of the mapped file
+  char *file;                     // file to write the data to on close if
+                                  // not mapped
+};
+
+// Creates the file for a nrow x ncol matrix (all values 0) and maps it
+// writable.
+int f32Matrix_create(struct f32Matrix *m, const char *file, int nrow,
+		     int ncol);
+
+// Maps the matrix of a file read-only.
+int f32Matrix_open(struct f32Matrix *m, const char *file);
+
+// Unmaps the matrix; returns F32MATRIX_ERR_FILE if the data of a writable
+// matrix could not be written.
+int f32Matrix_close(struct f32Matrix *m);
+
+// R interface: whether x is a file backed single precision matrix and an
+// external pointer with the (read-only) mapped matrix, unmapped by the
+// garbage collector or float32_file_close.
+int is_float32_file(SEXP x);
+SEXP float32_file_open(SEXP x);
+struct f32Matrix *float32_file_get(SEXP ptr);
+void float32_file_close(SEXP ptr);
+
+// List with elements file and dim representing a matrix on the R side.
+SEXP float32_file_sexp(const char *file, int nrow, int ncol);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
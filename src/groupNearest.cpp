@@ -0,0 +1,393 @@
+/*
+ * Native implementation of the nearest neighbor correspondence analysis
+ * (do_groupChromPeaks_nearest).
+ *
+ * Samples are processed in the given order. The peaks of each sample are
+ * matched against the master peak list (one row per feature, starting with
+ * the peaks of the first sample): each peak is scored against the first of
+ * its kNN nearest rows (euclidean distance of m/z * mzVsRtBalance and
+ * retention time to the mean of the row's peaks) that is within absMz and
+ * absRt, the peaks are then assigned to the rows in the order of their score
+ * (each row getting at most one peak per sample) and peaks without row are
+ * added as new rows.
+ *
+ * The row means are kept in a grid (cells of absMz * mzVsRtBalance and absRt)
+ * that is updated after each sample. The first row within the tolerances
+ * among the kNN nearest is the nearest row within the tolerances, provided
+ * that less than kNN rows are closer to the peak; both are looked up in the
+ * cells around the peak instead of searching the full master list. Means are
+ * calculated as by R's mean() (in the order of the samples) to return the
+ * same results as the R implementation (patternVsRowScore).
+ */
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <new>
+#include <unordered_map>
+#include <algorithm>
+
+#include <R.h>
+#include <Rinternals.h>
+
+namespace {
+
+// mean() of the m/z or retention times of a row's peaks
+double r_mean(const std::vector<std::pair<int, int> > &row, const double *x) {
+  int n = row.size();
+  long double s = 0.0;
+  for (int i = 0; i < n; i++)
+    s += x[row[i].second];
+  s /= n;
+  if (R_FINITE((double) s)) {
+    long double t = 0.0;
+    for (int i = 0; i < n; i++)
+      t += (x[row[i].second] - s);
+    s += t / n;
+  }
+  return (double) s;
+}
+
+double r_median(std::vector<double> &x) {
+  int n = x.size(), half = (n + 1) / 2;
+  std::sort(x.begin(), x.end());
+  if (n % 2)
+    return x[half - 1];
+  return (x[half - 1] + x[half]) / 2;
+}
+
+class MasterList {
+public:
+  // peaks (sample, peak index) of each row, ordered by sample
+  std::vector<std::vector<std::pair<int, int> > > rows;
+  std::vector<double> mz, rt, x;  // means of the rows, x: mz * balance
+
+  MasterList(const double *pmz, const double *prt, double balance,
+	     double cellX, double cellY) :
+    _pmz(pmz), _prt(prt), _balance(balance), _cellX(cellX),
+    _cellY(cellY) {}
+
+  int nrow() const { return rows.size(); }
+
+  void add_row(int sample, int peak) {
+    rows.push_back(std::vector<std::pair<int, int> >(
+		     1, std::make_pair(sample, peak)));
+    mz.push_back(_pmz[peak]);
+    rt.push_back(_prt[peak]);
+    x.push_back(_pmz[peak] * _balance);
+    _cell_of_row.push_back(0);
+    insert(rows.size() - 1);
+  }
+
+  void add_peak(int row, int sample, int peak) {
+    std::vector<std::pair<int, int> > &r = rows[row];
+    r.insert(std::upper_bound(r.begin(), r.end(),
+			      std::make_pair(sample, peak)),
+	     std::make_pair(sample, peak));
+  }
+
+  // recalculates the mean of the row (after add_peak)
+  void update_mean(int row) {
+    mz[row] = r_mean(rows[row], _pmz);
+    rt[row] = r_mean(rows[row], _prt);
+    x[row] = mz[row] * _balance;
+    remove(row);
+    insert(row);
+  }
+
+  // Calls f(row) for the rows in the cells overlapping the rectangle (till f
+  // returns false).
+  template <typename F>
+  void for_rows(double x0, double x1, double y0, double y1, F f) const {
+    long long ix0 = cell_index(x0 / _cellX) - 1,
+      ix1 = cell_index(x1 / _cellX) + 1,
+      iy0 = cell_index(y0 / _cellY) - 1, iy1 = cell_index(y1 / _cellY) + 1;
+    if ((double)(ix1 - ix0 + 1) * (iy1 - iy0 + 1) > (double)_cells.size()) {
+      // less cells with rows than cells in the rectangle
+      for (CellMap::const_iterator it = _cells.begin(); it != _cells.end();
+	   ++it) {
+	if (it->second.ix < ix0 || it->second.ix > ix1 ||
+	    it->second.iy < iy0 || it->second.iy > iy1)
+	  continue;
+	for (size_t i = 0; i < it->second.rows.size(); i++)
+	  if (!f(it->second.rows[i]))
+	    return;
+      }
+      return;
+    }
+    for (long long ix = ix0; ix <= ix1; ix++) {
+      for (long long iy = iy0; iy <= iy1; iy++) {
+	CellMap::const_iterator it = _cells.find(key(ix, iy));
+	if (it == _cells.end())
+	  continue;
+	for (size_t i = 0; i < it->second.rows.size(); i++)
+	  if (!f(it->second.rows[i]))
+	    return;
+      }
+    }
+  }
+
+private:
+  const double *_pmz, *_prt;
+  double _balance, _cellX, _cellY;
+  struct Cell {
+    long long ix, iy;
+    std::vector<int> rows;
+  };
+  typedef std::unordered_map<long long, Cell> CellMap;
+  CellMap _cells;
+  std::vector<long long> _cell_of_row;
+
+  static long long cell_index(double v) {
+    if (!(v > -1e9))
+      return -1000000000LL;
+    if (!(v < 1e9))
+      return 1000000000LL;
+    return (long long) std::floor(v);
+  }
+  static long long key(long long ix, long long iy) {
+    return ix * 2147483647LL + iy;
+  }
+  void insert(int row) {
+    long long ix = cell_index(x[row] / _cellX),
+      iy = cell_index(rt[row] / _cellY), k = key(ix, iy);
+    Cell &c = _cells[k];
+    c.ix = ix;
+    c.iy = iy;
+    c.rows.push_back(row);
+    _cell_of_row[row] = k;
+  }
+  void remove(int row) {
+    CellMap::iterator it = _cells.find(_cell_of_row[row]);
+    std::vector<int> &v = it->second.rows;
+    v.erase(std::find(v.begin(), v.end(), row));
+    if (v.empty())
+      _cells.erase(it);
+  }
+};
+
+struct Score {
+  double score;
+  int peak;
+  int row;
+};
+
+bool score_less(const Score &a, const Score &b) {
+  return a.score < b.score;
+}
+
+// squared distance as calculated by nn2 (ANN)
+inline double dist2(double x0, double y0, double x1, double y1) {
+  double d = 0, t;
+  t = x0 - x1;
+  d += t * t;
+  t = y0 - y1;
+  d += t * t;
+  return d;
+}
+
+// The feature definitions of the rows of ml (column-major, see
+// group_peaks_nearest).
+void feature_definitions(const MasterList &ml, const double *pmz,
+			 const double *prt, const int *pgroup, int ngrp,
+			 std::vector<double> &def) {
+  int nrow = ml.nrow(), ncol = 7 + ngrp;
+  def.assign((size_t)nrow * ncol, 0.0);
+  double *pdef = def.empty() ? NULL : &def[0];
+  std::vector<double> v;
+  for (int i = 0; i < nrow; i++) {
+    const std::vector<std::pair<int, int> > &r = ml.rows[i];
+    int n = r.size();
+    v.resize(n);
+    for (int j = 0; j < n; j++) {
+      v[j] = pmz[r[j].second];
+      if (pgroup[r[j].first] >= 0)
+	pdef[i + (size_t)(7 + pgroup[r[j].first]) * nrow]++;
+    }
+    pdef[i] = r_median(v);
+    pdef[i + (size_t)nrow] = v[0];
+    pdef[i + (size_t)2 * nrow] = v[n - 1];
+    for (int j = 0; j < n; j++)
+      v[j] = prt[r[j].second];
+    pdef[i + (size_t)3 * nrow] = r_median(v);
+    pdef[i + (size_t)4 * nrow] = v[0];
+    pdef[i + (size_t)5 * nrow] = v[n - 1];
+    // number of peaks with an m/z > 0 (as in the R implementation)
+    for (int j = 0; j < n; j++)
+      if (pmz[r[j].second] > 0)
+	pdef[i + (size_t)6 * nrow]++;
+  }
+}
+
+// Groups the peaks into the rows of ml (see group_peaks_nearest).
+void group_nearest(MasterList &ml, const double *pmz, const double *prt,
+		   const int *psample, int npeak, int nsample,
+		   const int *pord, int nord, double balance, double abs_mz,
+		   double abs_rt, int knn, double tol_x, double tol_y) {
+  // peaks of each sample
+  std::vector<std::vector<int> > speaks(nsample);
+  for (int i = 0; i < npeak; i++)
+    speaks[psample[i] - 1].push_back(i);
+
+  std::vector<Score> scores;
+  std::vector<char> joined_row;
+  std::vector<char> joined_peak;
+  for (int o = 0; o < nord; o++) {
+    int s = pord[o] - 1;
+    const std::vector<int> &pks = speaks[s];
+    if (o == 0) {
+      for (size_t i = 0; i < pks.size(); i++)
+	ml.add_row(s, pks[i]);
+      continue;
+    }
+    int k = std::min(ml.nrow(), knn);
+    scores.clear();
+    for (size_t i = 0; i < pks.size(); i++) {
+      int p = pks[i];
+      double qx = pmz[p] * balance, qy = prt[p];
+      // nearest row within the tolerances
+      int best = -1;
+      double best_d = 0;
+      if (k > 0)
+	ml.for_rows(qx - tol_x, qx + tol_x, qy - tol_y, qy + tol_y,
+		    [&](int r) {
+		      if (std::fabs(ml.mz[r] - pmz[p]) < abs_mz &&
+			  std::fabs(ml.rt[r] - prt[p]) < abs_rt) {
+			double d = dist2(ml.x[r], ml.rt[r], qx, qy);
+			if (best < 0 || d < best_d || (d == best_d && r < best)) {
+			  best = r;
+			  best_d = d;
+			}
+		      }
+		      return true;
+		    });
+      if (best < 0)
+	continue;
+      // is it among the kNN nearest rows?
+      int closer = 0;
+      double rad = std::sqrt(best_d);
+      ml.for_rows(qx - rad, qx + rad, qy - rad, qy + rad,
+		  [&](int r) {
+		    double d = dist2(ml.x[r], ml.rt[r], qx, qy);
+		    if (d < best_d || (d == best_d && r < best))
+		      closer++;
+		    return closer < k;
+		  });
+      if (closer >= k)
+	continue;
+      Score sc = {std::sqrt(best_d), p, best};
+      scores.push_back(sc);
+    }
+    // assign the peaks to the rows in the order of their score
+    std::stable_sort(scores.begin(), scores.end(), score_less);
+    joined_row.assign(ml.nrow(), 0);
+    joined_peak.assign(pks.size(), 0);
+    std::vector<int> changed;
+    for (size_t i = 0; i < scores.size(); i++) {
+      if (joined_row[scores[i].row])
+	continue;
+      joined_row[scores[i].row] = 1;
+      ml.add_peak(scores[i].row, s, scores[i].peak);
+      changed.push_back(scores[i].row);
+      joined_peak[std::lower_bound(pks.begin(), pks.end(), scores[i].peak) -
+		  pks.begin()] = 1;
+    }
+    for (size_t i = 0; i < changed.size(); i++)
+      ml.update_mean(changed[i]);
+    for (size_t i = 0; i < pks.size(); i++)
+      if (!joined_peak[i])
+	ml.add_row(s, pks[i]);
+  }
+
+}
+
+}
+
+/*
+ * Correspondence analysis with the nearest neighbor approach.
+ * mz, rt, sample: the peaks (sample 1-based).
+ * sampleOrder: the (1-based) samples in the order in which they are processed.
+ * sampleGroup: 0-based sample group of each sample (-1 for none), nGroups:
+ *     number of sample groups.
+ * mzVsRtBalance, absMz, absRt, kNN: see do_groupChromPeaks_nearest.
+ * Returns a list with the numeric matrix of the feature definitions (columns
+ * mzmed, mzmin, mzmax, rtmed, rtmin, rtmax, npeaks and the number of peaks
+ * per sample group) and the (1-based) indices of the peaks of each feature
+ * (ordered by sample).
+ */
+extern "C" SEXP group_peaks_nearest(SEXP mz, SEXP rt, SEXP sample,
+				    SEXP sampleOrder, SEXP sampleGroup,
+				    SEXP nGroups, SEXP mzVsRtBalance,
+				    SEXP absMz, SEXP absRt, SEXP kNN) {
+  int npeak = LENGTH(mz), nsample = LENGTH(sampleGroup);
+  int nord = LENGTH(sampleOrder), ngrp = asInteger(nGroups);
+  int knn = asInteger(kNN);
+  double balance = asReal(mzVsRtBalance), abs_mz = asReal(absMz),
+    abs_rt = asReal(absRt);
+  const double *pmz = REAL(mz), *prt = REAL(rt);
+  const int *psample = INTEGER(sample), *pord = INTEGER(sampleOrder),
+    *pgroup = INTEGER(sampleGroup);
+
+  if (LENGTH(rt) != npeak || LENGTH(sample) != npeak)
+    error("'mz', 'rt' and 'sample' have to have the same length");
+  for (int i = 0; i < npeak; i++)
+    if (psample[i] < 1 || psample[i] > nsample)
+      error("sample indices have to be between 1 and the number of samples");
+  for (int i = 0; i < nord; i++)
+    if (pord[i] < 1 || pord[i] > nsample)
+      error("invalid 'sampleOrder'");
+  for (int i = 0; i < nsample; i++)
+    if (pgroup[i] >= ngrp)
+      error("invalid sample group");
+
+  // the tolerances in the scaled space define the size of the grid cells
+  double tol_x = std::fabs(abs_mz * balance), tol_y = std::fabs(abs_rt);
+  double cell_x = tol_x, cell_y = tol_y;
+  if (!(cell_y > 0) || !R_FINITE(cell_y))
+    cell_y = 1;
+  if (!(cell_x > 0) || !R_FINITE(cell_x))
+    cell_x = cell_y;
+
+  MasterList *ml = NULL;
+  std::vector<double> defv;
+  const char *err = NULL;
+  try {
+    ml = new MasterList(pmz, prt, balance, cell_x, cell_y);
+    group_nearest(*ml, pmz, prt, psample, npeak, nsample, pord, nord,
+		  balance, abs_mz, abs_rt, knn, tol_x, tol_y);
+    feature_definitions(*ml, pmz, prt, pgroup, ngrp, defv);
+  } catch (std::bad_alloc &e) {
+    err = "memory could not be allocated";
+  } catch (...) {
+    err = "unexpected error";
+  }
+  if (err != NULL) {
+    delete ml;
+    std::vector<double>().swap(defv);
+    error("group_peaks_nearest: %s", err);
+  }
+
+  int nrow = ml->nrow(), ncol = 7 + ngrp;
+  SEXP ans, def, pidx, names;
+  PROTECT(def = allocMatrix(REALSXP, nrow, ncol));
+  PROTECT(pidx = allocVector(VECSXP, nrow));
+  if (!defv.empty())
+    std::copy(defv.begin(), defv.end(), REAL(def));
+  for (int i = 0; i < nrow; i++) {
+    const std::vector<std::pair<int, int> > &r = ml->rows[i];
+    int n = r.size();
+    SEXP idx = allocVector(REALSXP, n);
+    SET_VECTOR_ELT(pidx, i, idx);
+    for (int j = 0; j < n; j++)
+      REAL(idx)[j] = r[j].second + 1;
+  }
+  delete ml;
+  PROTECT(ans = allocVector(VECSXP, 2));
+  PROTECT(names = allocVector(STRSXP, 2));
+  SET_VECTOR_ELT(ans, 0, def);
+  SET_VECTOR_ELT(ans, 1, pidx);
+  SET_STRING_ELT(names, 0, mkChar("featureDefinitions"));
+  SET_STRING_ELT(names, 1, mkChar("peakIndex"));
+  setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(4);
+  return ans;
+}
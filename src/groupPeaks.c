@@ -0,0 +1,385 @@
+#include <stdlib.h>
+#include <string.h>
+#include <R.h>
+#include <Rinternals.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "util.h"
+
+/*
+ * Correspondence analysis (grouping of chromatographic peaks across samples).
+ */
+
+/*
+ * ----------------------- peak density -----------------------
+ */
+
+// The density grid shared by all m/z slices (see .density_grid).
+struct densGrid {
+  int n;              // number of bins of the binned data
+  double lo, up;      // range of the binned data
+  const double *kern; // kernel at distances 0, 1, ... bins (n + 1 values)
+  int nkern;          // number of non-zero kernel values
+  int nout;           // number of points of the density
+  const double *x;    // density points followed by the points of the bins
+  int *ival;          // interval of the binned data for each density point
+};
+
+// Groups of one m/z slice.
+struct densGroups {
+  int ngroup;
+  int nidx;
+  double *def;        // ngroup x ncol, by row
+  int *len;           // number of peaks per group
+  double *idx;        // (sorted) peak indices of all groups
+};
+
+static int compareDouble(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return((x > y) - (x < y));
+}
+
+static double median_sorted(const double *x, int n) {
+  int half = (n + 1) / 2;
+  if (n % 2)
+    return(x[half - 1]);
+  return((x[half - 1] + x[half]) / 2);
+}
+
+/*
+ * Density of the n values x at the points of the grid, as calculated by
+ * density.default with a gaussian kernel: the values are linearly binned
+ * (BinDist, with weights 1/n), convolved with the kernel and interpolated
+ * (approx) to the density points. The convolution is calculated directly,
+ * skipping empty bins and kernel values that are 0.
+ * y needs space for 2 * (grid->n + 1) values.
+ */
+static void density_on_grid(const double *x, int n,
+			    const struct densGrid *grid, double *y,
+			    double *out) {
+  int nb = grid->n, ixmax = nb - 2, ix;
+  const double *xo = grid->x + grid->nout; // points of the bins
+  double w = 1.0 / n, xdelta = (grid->up - grid->lo) / (nb - 1), xpos, fx;
+  double *conv = y + nb + 1;
+  for (int i = 0; i <= nb; i++)
+    y[i] = 0;
+  for (int i = 0; i < n; i++) {
+    if (!R_FINITE(x[i]))
+      continue;
+    xpos = (x[i] - grid->lo) / xdelta;
+    ix = (int) floor(xpos);
+    fx = xpos - ix;
+    if (ix >= 0 && ix <= ixmax) {
+      y[ix] += w * (1 - fx);
+      y[ix + 1] += w * fx;
+    } else if (ix == -1) {
+      y[0] += w * fx;
+    } else if (ix == ixmax + 1) {
+      y[ix] += w * (1 - fx);
+    }
+  }
+  for (int i = 0; i < nb; i++)
+    conv[i] = 0;
+  for (int j = 0; j <= nb; j++) {
+    if (y[j] == 0)
+      continue;
+    int from = j - grid->nkern + 1, to = j + grid->nkern - 1;
+    if (from < 0)
+      from = 0;
+    if (to > nb - 1)
+      to = nb - 1;
+    for (int i = from; i <= to; i++)
+      conv[i] += y[j] * grid->kern[i > j ? i - j : j - i];
+  }
+  for (int i = 0; i < nb; i++)
+    if (conv[i] < 0)
+      conv[i] = 0;
+  // linear interpolation to the density points (as approx)
+  for (int k = 0; k < grid->nout; k++) {
+    int i = grid->ival[k];
+    double v = grid->x[k];
+    if (v == xo[i + 1])
+      out[k] = conv[i + 1];
+    else if (v == xo[i])
+      out[k] = conv[i];
+    else
+      out[k] = conv[i] + (conv[i + 1] - conv[i]) *
+	((v - xo[i]) / (xo[i + 1] - xo[i]));
+  }
+}
+
+/*
+ * Groups the n peaks of one m/z slice (mz, rt, sample and index of the peaks)
+ * as .group_peaks_density. Buffers:
+ * ybuf: 2 * (grid->n + 1), deny: grid->nout, seen: number of samples (all
+ * 0), gcount: number of sample groups, vbuf and ibuf: n.
+ */
+static int group_slice(const double *mz, const double *rt, const int *sample,
+		       const double *index, int n, const struct densGrid *grid,
+		       const int *sgroup, const int *gsize, int ngrp,
+		       double minFraction, double minSamples, int maxFeatures,
+		       double *ybuf, double *deny, int *seen, double *gcount,
+		       double *vbuf, int *ibuf, struct densGroups *res) {
+  int ncol = 7 + ngrp, maxy, lower, upper, numin = grid->nout, ng, cap = 0;
+  double maxden = 0;
+  res->ngroup = 0;
+  res->nidx = 0;
+  res->def = NULL;
+  res->len = NULL;
+  res->idx = NULL;
+  density_on_grid(rt, n, grid, ybuf, deny);
+  for (int k = 0; k < numin; k++)
+    if (deny[k] > maxden)
+      maxden = deny[k];
+  while (res->ngroup < maxFeatures) {
+    // which.max
+    maxy = 0;
+    for (int k = 1; k < numin; k++)
+      if (deny[k] > deny[maxy])
+	maxy = k;
+    if (!(deny[maxy] > maxden / 20))
+      break;
+    DescendMin(deny, &numin, &maxy, &lower, &upper);
+    for (int k = lower; k <= upper; k++)
+      deny[k] = 0;
+    ng = 0;
+    for (int i = 0; i < n; i++)
+      if (rt[i] >= grid->x[lower] && rt[i] <= grid->x[upper])
+	ibuf[ng++] = i;
+    // number of samples per sample group
+    int ok = 0;
+    for (int g = 0; g < ngrp; g++)
+      gcount[g] = 0;
+    for (int i = 0; i < ng; i++) {
+      int s = sample[ibuf[i]] - 1;
+      if (!seen[s]) {
+	seen[s] = 1;
+	if (sgroup[s] >= 0)
+	  gcount[sgroup[s]]++;
+      }
+    }
+    for (int i = 0; i < ng; i++)
+      seen[sample[ibuf[i]] - 1] = 0;
+    for (int g = 0; g < ngrp; g++)
+      if (gcount[g] > 0 && gcount[g] / gsize[g] >= minFraction &&
+	  gcount[g] >= minSamples)
+	ok = 1;
+    if (!ok)
+      continue;
+    if (res->ngroup == cap) {
+      cap = cap ? 2 * cap : 4;
+      double *def = (double *) realloc(res->def,
+				       sizeof(double) * ncol * cap);
+      int *len = (int *) realloc(res->len, sizeof(int) * cap);
+      if (def != NULL)
+	res->def = def;
+      if (len != NULL)
+	res->len = len;
+      if (def == NULL || len == NULL)
+	return(1);
+    }
+    double *idx = (double *) realloc(res->idx,
+				     sizeof(double) * (res->nidx + ng));
+    if (idx == NULL)
+      return(1);
+    res->idx = idx;
+    double *def = res->def + (size_t)res->ngroup * ncol;
+    for (int i = 0; i < ng; i++)
+      vbuf[i] = mz[ibuf[i]];
+    qsort(vbuf, ng, sizeof(double), compareDouble);
+    def[0] = median_sorted(vbuf, ng);
+    def[1] = vbuf[0];
+    def[2] = vbuf[ng - 1];
+    for (int i = 0; i < ng; i++)
+      vbuf[i] = rt[ibuf[i]];
+    qsort(vbuf, ng, sizeof(double), compareDouble);
+    def[3] = median_sorted(vbuf, ng);
+    def[4] = vbuf[0];
+    def[5] = vbuf[ng - 1];
+    def[6] = ng;
+    for (int g = 0; g < ngrp; g++)
+      def[7 + g] = gcount[g];
+    for (int i = 0; i < ng; i++)
+      idx[res->nidx + i] = index[ibuf[i]];
+    qsort(idx + res->nidx, ng, sizeof(double), compareDouble);
+    res->len[res->ngroup] = ng;
+    res->nidx += ng;
+    res->ngroup++;
+  }
+  return(0);
+}
+
+static void free_groups(struct densGroups *res, int n) {
+  for (int i = 0; i < n; i++) {
+    free(res[i].def);
+    free(res[i].len);
+    free(res[i].idx);
+  }
+  free(res);
+}
+
+/*
+ * Groups chromatographic peaks based on their density along the retention
+ * time in overlapping m/z slices (peak density method), slices in parallel.
+ * mz, rt, sample (1-based) and index: the peaks, ordered by mz.
+ * masspos: 1-based index of the first peak with an m/z >= each of the mass
+ *     boundaries; slice i contains the peaks from masspos[i] to
+ *     masspos[i + 2] - 1.
+ * lo, up, kern, binX: range of the binned retention times, kernel values
+ *     (at distances of 0, 1, ... bins) and the points of the bins, densX:
+ *     the points at which the density is evaluated (see .density_grid).
+ * sampleGroup: 0-based sample group of each sample (-1 for samples without
+ *     group), groupSize: number of samples of each sample group.
+ * minFraction, minSamples, maxFeatures: as for do_groupChromPeaks_density.
+ * Returns a list with the numeric matrix of the feature definitions (one row
+ * per feature, columns mzmed, mzmin, mzmax, rtmed, rtmin, rtmax, npeaks and
+ * the number of samples per sample group) and the list with the (sorted)
+ * indices of the peaks of each feature, in the order of the m/z slices.
+ */
+SEXP group_peaks_density(SEXP mz, SEXP rt, SEXP sample, SEXP index,
+			 SEXP masspos, SEXP lo, SEXP up, SEXP kern,
+			 SEXP binX, SEXP densX, SEXP sampleGroup, SEXP groupSize,
+			 SEXP minFraction, SEXP minSamples, SEXP maxFeatures,
+			 SEXP threads) {
+  SEXP ans, def, pidx, names;
+  struct densGrid grid;
+  struct densGroups *res;
+  int npeak = LENGTH(mz), nslice = LENGTH(masspos) - 2, nsample, ngrp, ncol;
+  int n_threads = asInteger(threads), max_features = asInteger(maxFeatures);
+  int failed = 0, *p_mpos = INTEGER(masspos), *p_sample = INTEGER(sample);
+  double min_fraction = asReal(minFraction), min_samples = asReal(minSamples);
+  double *xords, *p_mz = REAL(mz), *p_rt = REAL(rt), *p_index = REAL(index);
+  int *p_sgroup = INTEGER(sampleGroup), *p_gsize = INTEGER(groupSize);
+
+  nsample = LENGTH(sampleGroup);
+  ngrp = LENGTH(groupSize);
+  ncol = 7 + ngrp;
+  if (LENGTH(rt) != npeak || LENGTH(sample) != npeak ||
+      LENGTH(index) != npeak)
+    error("'mz', 'rt', 'sample' and 'index' have to have the same length");
+  for (int i = 0; i < npeak; i++)
+    if (p_sample[i] < 1 || p_sample[i] > nsample)
+      error("sample indices have to be between 1 and the number of samples");
+  for (int i = 0; i < nsample; i++)
+    if (p_sgroup[i] >= ngrp)
+      error("invalid sample group");
+  if (n_threads < 1)
+    n_threads = 1;
+  if (nslice < 0)
+    nslice = 0;
+  for (int i = 0; i < LENGTH(masspos); i++)
+    if (p_mpos[i] < 1 || p_mpos[i] > npeak + 1)
+      error("invalid 'masspos'");
+
+  grid.n = LENGTH(binX);
+  grid.nout = LENGTH(densX);
+  if (grid.n < 2 || grid.nout < 1 || LENGTH(kern) != grid.n + 1)
+    error("invalid density grid");
+  grid.lo = asReal(lo);
+  grid.up = asReal(up);
+  grid.kern = REAL(kern);
+  grid.nkern = grid.n + 1;
+  while (grid.nkern > 1 && grid.kern[grid.nkern - 1] == 0)
+    grid.nkern--;
+  xords = (double *) R_alloc(grid.nout + grid.n, sizeof(double));
+  memcpy(xords, REAL(densX), sizeof(double) * grid.nout);
+  memcpy(xords + grid.nout, REAL(binX), sizeof(double) * grid.n);
+  grid.x = xords;
+  grid.ival = (int *) R_alloc(grid.nout, sizeof(int));
+  for (int k = 0; k < grid.nout; k++) {
+    // bisection as in approx
+    int i = 0, j = grid.n - 1;
+    const double *xo = xords + grid.nout;
+    if (xords[k] < xo[i] || xords[k] > xo[j])
+      error("the density points have to be within 'lo' and 'up'");
+    while (i < j - 1) {
+      int ij = (i + j) / 2;
+      if (xords[k] < xo[ij])
+	j = ij;
+      else
+	i = ij;
+    }
+    grid.ival[k] = i;
+  }
+
+  res = (struct densGroups *) calloc(nslice > 0 ? nslice : 1,
+				     sizeof(struct densGroups));
+  if (res == NULL)
+    error("group_peaks_density: memory could not be allocated!");
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads) if(n_threads > 1)
+#endif
+  {
+    double *ybuf = (double *) malloc(sizeof(double) * 2 * (grid.n + 1));
+    double *deny = (double *) malloc(sizeof(double) * grid.nout);
+    double *gcount = (double *) malloc(sizeof(double) * (ngrp + 1));
+    double *vbuf = (double *) malloc(sizeof(double) * (npeak + 1));
+    int *ibuf = (int *) malloc(sizeof(int) * (npeak + 1));
+    int *seen = (int *) calloc(nsample + 1, sizeof(int));
+    int ok = ybuf != NULL && deny != NULL && gcount != NULL && vbuf != NULL &&
+      ibuf != NULL && seen != NULL;
+    if (!ok) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+      failed = 1;
+    }
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (int i = 0; i < nslice; i++) {
+      int first = p_mpos[i] - 1, n = p_mpos[i + 2] - 1 - first;
+      if (!ok || n <= 0)
+	continue;
+      if (group_slice(p_mz + first, p_rt + first, p_sample + first,
+		      p_index + first, n, &grid, p_sgroup, p_gsize, ngrp, min_fraction, min_samples,
+		      max_features, ybuf, deny, seen, gcount, vbuf, ibuf,
+		      &res[i])) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+	failed = 1;
+      }
+    }
+    free(ybuf);
+    free(deny);
+    free(gcount);
+    free(vbuf);
+    free(ibuf);
+    free(seen);
+  }
+  if (failed) {
+    free_groups(res, nslice);
+    error("group_peaks_density: memory could not be allocated!");
+  }
+
+  int ngroup = 0;
+  for (int i = 0; i < nslice; i++)
+    ngroup += res[i].ngroup;
+  PROTECT(def = allocMatrix(REALSXP, ngroup, ncol));
+  PROTECT(pidx = allocVector(VECSXP, ngroup));
+  double *p_def = REAL(def);
+  int g = 0;
+  for (int i = 0; i < nslice; i++) {
+    double *idx = res[i].idx;
+    for (int k = 0; k < res[i].ngroup; k++, g++) {
+      for (int c = 0; c < ncol; c++)
+	p_def[g + (size_t)c * ngroup] = res[i].def[(size_t)k * ncol + c];
+      SEXP gidx = allocVector(REALSXP, res[i].len[k]);
+      SET_VECTOR_ELT(pidx, g, gidx);
+      memcpy(REAL(gidx), idx, sizeof(double) * res[i].len[k]);
+      idx += res[i].len[k];
+    }
+  }
+  free_groups(res, nslice);
+  PROTECT(ans = allocVector(VECSXP, 2));
+  PROTECT(names = allocVector(STRSXP, 2));
+  SET_VECTOR_ELT(ans, 0, def);
+  SET_VECTOR_ELT(ans, 1, pidx);
+  SET_STRING_ELT(names, 0, mkChar("featureDefinitions"));
+  SET_STRING_ELT(names, 1, mkChar("peakIndex"));
+  setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(4);
+  return(ans);
+}
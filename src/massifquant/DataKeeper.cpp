@@ -109,6 +109,46 @@ void  DataKeeper::getScanXcms(int scan, int nmz, int lastScan, std::vector<doubl
     }
 }
 
+//same as getScanXcms, but only the data points with an m/z in [mzFrom, mzTo).
+//below and above are set to the m/z of the closest data points of the scan
+//outside of this range (-Inf and Inf if there are none). Returns the index of
+//the first returned data point within the scan.
+int DataKeeper::getScanXcmsRange(int scan, int nmz, int lastScan,
+        double mzFrom, double mzTo, std::vector<double> & mzScan,
+        std::vector<double> & intenScan, double & below, double & above) {
+
+    mzScan.clear();
+    intenScan.clear();
+    below = -HUGE_VAL;
+    above = HUGE_VAL;
+
+    int start = pscanindex[scan - 1];
+    int end;
+    if (scan == lastScan) {
+        end = nmz - 1;
+    }
+    else {
+        end = pscanindex[scan];
+    }
+    if (end <= start) {
+        return 0;
+    }
+    int lo = int(lower_bound(pmz + start, pmz + end, mzFrom) - pmz);
+    int hi = int(lower_bound(pmz + lo, pmz + end, mzTo) - pmz);
+    if (lo > start) {
+        below = pmz[lo - 1];
+    }
+    if (hi < end) {
+        above = pmz[hi];
+    }
+    mzScan.assign(pmz + lo, pmz + hi);
+    intenScan.resize(hi - lo);
+    for (int i = lo; i < hi; i++) {
+        intenScan[i - lo] = sqrt(pinten[i]);
+    }
+    return lo - start;
+}
+
 double DataKeeper::getScanTime(int s) {
     return pscantime[s];
 }
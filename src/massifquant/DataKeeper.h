@@ -81,6 +81,11 @@ void printList(const std::list<double> & mylist);
         void  getScanMQ(int s, std::vector<double> & mzScan, std::vector<double> & intenScan);
         void  getScanXcms(int scan, int nmz, int lastScan, std::vector<double> & mzScan, std::vector<double> & intenScan);
 
+        int getScanXcmsRange(int scan, int nmz, int lastScan,
+                double mzFrom, double mzTo, std::vector<double> & mzScan,
+                std::vector<double> & intenScan, double & below,
+                double & above);
+
         double getScanTime(int s);
 
         void ghostScan();
@@ -275,6 +275,17 @@ double computeAnyXbar(const std::list<double> & x) {
     return xbar;
 }
 
+double computeAnyXbar(const std::vector<double> & x) {
+
+    double xbar = 0;
+    std::vector<double>::const_iterator it;
+    for (it = x.begin(); it != x.end(); ++it) {
+        xbar +=  *it;
+    }
+    xbar = xbar/x.size();
+    return xbar;
+}
+
 double computeAnySampVar(const std::list<double> & x) {
 
     double s2 = 0;
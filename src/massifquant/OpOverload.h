@@ -81,6 +81,8 @@ std::vector<int> createSequence(const int start,
 
 double computeAnyXbar(const std::list<double> & x);
 
+double computeAnyXbar(const std::vector<double> & x);
+
 double computeAnySampVar(const std::list<double> & x);
 
 void printvector(const std::vector<int> & myvec);
@@ -271,10 +271,11 @@ void SegProc::solderSegs(TrMgr & busybody) {
         for(it = sIdx.begin(); it != (sIdx.end() - 1); ++it) {
             //cout << "Deleting this pic idx: " << *it << endl;
             //int testOSize = busybody.getTracker(appIdx)->getScanList().size();
-            list<int> sl = busybody.getTracker(*it)->getScanList();
-            list<int> cl = busybody.getTracker(*it)->getCentroidList();
-            list<double> ml = busybody.getTracker(*it)->getMzList();
-            list<double> il = busybody.getTracker(*it)->getIntensityList();
+            Tracker * tr = busybody.getTracker(*it);
+            const vector<int> & sl = tr->getScanList();
+            const vector<int> & cl = tr->getCentroidList();
+            const vector<double> & ml = tr->getMzList();
+            const vector<double> & il = tr->getIntensityList();
 	    busybody.getTracker(appIdx)->appendToTracker(sl, cl, ml, il);
 
             //assert((testOSize + sl.size()) == busybody.getTracker(appIdx)->getScanList().size());
@@ -314,11 +315,11 @@ void SegProc::segsToFile(TrMgr & busybody) {
             totalCents +=  busybody.getTracker(*it)->getTrLen();
             feat_idx << totalCents << endl;
 
-            std::list<int> iscanList = busybody.getTracker(*it)->getScanList();
-            std::list<int> icentList = busybody.getTracker(*it)->getCentroidList();
+            const std::vector<int> & iscanList = busybody.getTracker(*it)->getScanList();
+            const std::vector<int> & icentList = busybody.getTracker(*it)->getCentroidList();
 
-            std::list<int>::iterator it_s;
-            std::list<int>::iterator it_c = icentList.begin();
+            std::vector<int>::const_iterator it_s;
+            std::vector<int>::const_iterator it_c = icentList.begin();
             //write data to file
             for(it_s = iscanList.begin(); it_s != iscanList.end(); ++it_s) {
                 scan_idx << *it_s << endl;
@@ -2,6 +2,7 @@
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <math.h>
 #include "Tracker.h"
 #include "TrMgr.h"
 
@@ -18,6 +19,11 @@ TrMgr::TrMgr(int sidx, const double mi,
     scanBack(sB) {
 
         initCounts = 0;
+        currMissPoint = -1;
+        outBelow = -HUGE_VAL;
+        outAbove = HUGE_VAL;
+        leakBelow = false;
+        leakAbove = false;
 }
 
 TrMgr::~TrMgr() {
@@ -25,6 +31,9 @@ TrMgr::~TrMgr() {
     for(i = 0; i < initCounts; i++) {
         delete trks[i];
     }
+    for(size_t j = 0; j < freeTrks.size(); j++) {
+        delete freeTrks[j];
+    }
 }
 
 void TrMgr::setDataScan(const std::vector<double> & mdat,
@@ -38,15 +47,15 @@ void TrMgr::setCurrScanIdx(const int sidx) {
     currScanIdx = sidx;
 }
 
-void TrMgr::setPredDatIdx(const std::list<int> & pdi) {
+void TrMgr::setPredDatIdx(const std::vector<int> & pdi) {
     predDatIdx = pdi;
 }
 
-void TrMgr::setFoundActIdx(const std::list<int> & fai) {
+void TrMgr::setFoundActIdx(const std::vector<int> & fai) {
     foundActIdx = fai;
 }
 
-void TrMgr::setMissActIdx(const std::list<int> & mai) {
+void TrMgr::setMissActIdx(const std::vector<int> & mai) {
     missActIdx = mai;
 }
 
@@ -93,171 +102,123 @@ void TrMgr::predictScan(const vector<double> & mzScan, const vector<double> & in
   predDatIdx.clear();
   foundActIdx.clear();
   missActIdx.clear();
+  missPoint.clear();
   predDist.clear();
+  claims.clear();
   int centIdx = -1;
+  bool bounded = outBelow != -HUGE_VAL || outAbove != HUGE_VAL;
   for (i = 0; i < actIdx.size(); i++) {
     //cout << "ActIdx: " << actIdx.at(i) << endl;
     trks[actIdx.at(i)]->predictCentroid();
+    if (bounded)
+      checkWindow(trks[actIdx.at(i)]);
     centIdx = trks[actIdx.at(i)]->claimDataIdx(mData,iData,predDist,minTrLen, scanBack);
     //build list of indices corresponding to found or missed
     if (centIdx > -1) {
       foundActIdx.push_back(actIdx.at(i));
       predDatIdx.push_back(centIdx);
+      claims.push_back(std::make_pair(centIdx, int(i)));
     }
     else {
       missActIdx.push_back(actIdx.at(i));
-      predDatIdx.push_back(-1);
+      missPoint.push_back(-1);
     }
   }
 }
 
 void TrMgr::competeAct() {
-  list<int> dupPredDatIdx = predDatIdx; //get copy of original
-
-//  cout << "**********Does New Scan Have Duplicates?***********" << endl;
-  //cout << "Act Idx is " << endl;
-  /*for (size_t test_act = 0; test_act < actIdx.size(); test_act++) {
-      cout << actIdx.at(test_act) << "  ";
-  }*/
- //cout << endl;
-
- //cout << "predDatIdx with misses  is " << endl;
- //printList(dupPredDatIdx);
-
-  predDatIdx = excludeMisses(predDatIdx);
-  std::list<int> cpNoMisses = predDatIdx;
- //cout << "Without Misses DatIdx " << endl;
-  //printList(predDatIdx);
-
-  int origLen  = predDatIdx.size();
-  predDatIdx.sort();
-  predDatIdx.unique();
-  //cout << "predDatIdx after unique is " << endl;
-  //printList(predDatIdx);
-  int chgdLen =  predDatIdx.size();
-  //check to see if there are duplicates
-
-
-  if (origLen == chgdLen) {
-
-
- //cout << "**********It had no duplicates***********" << endl;
- //cout << "Found List " << endl;
- //printList(foundActIdx);
-  //cout << "Buggy Corresponding Found PredDatIdx" << endl;
-  //printList(predDatIdx);
-  //cout << "Better Corresponding Found PredDatIdx" << endl;
-  //printList(cpNoMisses);
-  predDatIdx = cpNoMisses;
-  //cout << "Missed List " << endl;
-  //printList(missActIdx);
-
-
-      return;
+  //order the claims by data idx, the claims of a data idx stay in the
+  //order of actIdx
+  std::sort(claims.begin(), claims.end());
+  size_t k;
+  for (k = 1; k < claims.size(); k++) {
+    if (claims[k].first == claims[k - 1].first) { break; }
   }
-      //cout << "**********It had duplicates***********" << endl;
-  std::list<int> restructFoundIdx;
-  std::list<int> moreMissIdx;
-
-  std::list<int>::iterator it;
-  for (it = predDatIdx.begin(); it != predDatIdx.end(); ++it) {
+  //no duplicates: predDatIdx and foundActIdx stay in the order of actIdx
+  if (k >= claims.size()) { return; }
 
-
-    std::vector<int> collideIdx = dupPredDatIdx == *it;
-
-    if (collideIdx.size() == 0) {  continue; }
-    //cout << "A competing dat pt considered" << endl;
-    //cout << "collide idx for datptidx " << *it << endl;
-    /*for (size_t test = 0; test < collideIdx.size(); test++) {
-        cout << collideIdx.at(test) << "  ";
-    }
-    cout << endl;     */
-    if (collideIdx.size() == 1) {
-      restructFoundIdx.push_back(actIdx.at(collideIdx.at(0)));
-      continue;
+  //the tr closest to a contested data point claims it, the others missed
+  predDatIdx.clear();
+  foundActIdx.clear();
+  size_t first = 0;
+  while (first < claims.size()) {
+    int datIdx = claims[first].first;
+    size_t best = first;
+    size_t last = first + 1;
+    while (last < claims.size() && claims[last].first == datIdx) {
+      if (predDist[claims[last].second] < predDist[claims[best].second]) {
+        best = last;
+      }
+      ++last;
     }
-    /*not working*/ // findMinIdx(predDist, collideIdx);
-    std::vector<double> subPredDist = copySubIdx(predDist, collideIdx);
-    std::vector<double>::iterator bestIt;
-    bestIt = min_element(subPredDist.begin(), subPredDist.end());
-    int  bestIdx = int(bestIt - subPredDist.begin());
-    //cout << "predDist" << endl;
-   /* for(size_t test = 0; test < predDist.size(); test++) {
-        cout << predDist.at(test) << " ";
-    }*/
-    //cout << endl;
-    //cout << "best subPredIdx : " << bestIdx << endl;
-    //cout << "Best Accepted Collide Idx: " << collideIdx.at(bestIdx) << endl;
-    restructFoundIdx.push_back(actIdx.at(collideIdx.at(bestIdx)));
-    moreMissIdx = collideIdx != collideIdx.at(bestIdx);
-    //append moreMissIdx to missActIdx
-    std::list<int>::iterator it_miss;
-    for (it_miss = moreMissIdx.begin(); it_miss != moreMissIdx.end(); ++it_miss) {
-//        //cout << "Missed Collide Idx: " << collideIdx.at(*it_miss) << endl;
-        missActIdx.push_back(actIdx.at(collideIdx.at(*it_miss)));
+    predDatIdx.push_back(datIdx);
+    foundActIdx.push_back(actIdx.at(claims[best].second));
+    for (k = first; k < last; k++) {
+      if (k == best) { continue; }
+      missActIdx.push_back(actIdx.at(claims[k].second));
+      missPoint.push_back(datIdx);
     }
+    first = last;
   }
-  foundActIdx = restructFoundIdx;
-  //cout << "Found List " << endl;
-  //printList(foundActIdx);
-  //cout << "Corresponding Found PredDatIdx" << endl;
-  //printList(predDatIdx);
-  //cout << "Missed List " << endl;
-  //printList(missActIdx);
 }
 
 void TrMgr::manageMissed() {
-    std::list<int>::iterator it;
-  //  //cout << "Init Counts: " << initCounts << endl;
-    for (it = missActIdx.begin(); it != missActIdx.end(); ++it) {
-        trks[*it]->incrementMiss();
-        //cout << "active tracker id: " << *it << " missed" << endl;
+    retiredIdx.clear();
+    for (size_t k = 0; k < missActIdx.size(); k++) {
+        int i = missActIdx[k];
+        currMissPoint = missPoint[k];
+        trks[i]->incrementMiss();
+        //cout << "active tracker id: " << i << " missed" << endl;
         //consider adding the extra checks like matlab code
-        if (trks[*it]->getCurrMissed() > currMissedMax ||
-            trks[*it]->getCurrMissed() > trks[*it]->getTrLen() ||
-            (trks[*it]->getPredCounts()/2) > trks[*it]->getTrLen()) {
-            judgeTracker(*it);
+        if (trks[i]->getCurrMissed() > currMissedMax ||
+            trks[i]->getCurrMissed() > trks[i]->getTrLen() ||
+            (trks[i]->getPredCounts()/2) > trks[i]->getTrLen()) {
+            judgeTracker(i);
+            retiredIdx.push_back(i);
 	}
     }
+    if (retiredIdx.size() == 0) { return; }
+    //take the judged trs off the active list in one pass (actIdx is sorted)
+    std::sort(retiredIdx.begin(), retiredIdx.end());
+    size_t n = 0;
+    size_t r = 0;
+    for (size_t j = 0; j < actIdx.size(); j++) {
+        while (r < retiredIdx.size() && retiredIdx[r] < actIdx[j]) { ++r; }
+        if (r < retiredIdx.size() && retiredIdx[r] == actIdx[j]) { continue; }
+        actIdx[n] = actIdx[j];
+        ++n;
+    }
+    actIdx.resize(n);
 }
 
 void TrMgr::judgeTracker(const int & i) {
     //Perform serial criteria ordered by computational complexity
 
-    //get the index for final deletion
-    std::vector<int> subActIdx = actIdx == i;
+    //the caller takes it off the active list
     //length check
     if (trks[i]->getTrLen() < minTrLen) {
         //cout << "Deleting on account of length: ActIdx is " << i << endl;
-        actIdx.erase(actIdx.begin() + subActIdx.at(0));
-        delete trks[i];
-        trks[i] = NULL;
+        recycleTracker(i);
         return;
     }
     //intensity checks
-    std::list<double> iList = trks[i]->getIntensityList();
+    const std::vector<double> & iList = trks[i]->getIntensityList();
     double maxHeight = *max_element(iList.begin(), iList.end());
     if (minIntensity > maxHeight) {
         //cout << "Deleting on account of intensity: ActIdx is " << i << endl;
-        actIdx.erase(actIdx.begin() + subActIdx.at(0));
-        delete trks[i];
-        trks[i] = NULL;
+        recycleTracker(i);
         return;
     }
     if (hasMzDeviation(i)) {
         //cout << " Deleted on account of mean deviance" << endl;
-        actIdx.erase(actIdx.begin() + subActIdx.at(0));
-        delete trks[i];
-        trks[i] = NULL;
+        recycleTracker(i);
         return;
     }
 
     /*
    if (isSeizmo(i)) {
        //cout << " Deleted on account of seizmo" << endl;
-       actIdx.erase(actIdx.begin() + subActIdx.at(0));
-       delete trks[i];
-       trks[i] = NULL;
+       recycleTracker(i);
        return;
    }
     */
@@ -271,19 +232,24 @@ void TrMgr::judgeTracker(const int & i) {
 
     //a real pic, have a good retirement.
     picIdx.push_back(i);
-    //take off the active list
-    //cout << "Its Miss sub index is : " << subActIdx.at(0) << endl;
-    actIdx.erase(actIdx.begin() + subActIdx.at(0));
+    picScan.push_back(currScanIdx);
+    picPoint.push_back(currMissPoint);
     return;
 }
 
+//the tracker is deleted, keep it (and the memory of its history) for reuse
+void TrMgr::recycleTracker(const int i) {
+    freeTrks.push_back(trks[i]);
+    trks[i] = NULL;
+}
+
 void TrMgr::manageTracked() {
 
 
 
     //assume the two iterators are same size
-    std::list<int>::iterator it_f;
-    std::list<int>::iterator it_d = predDatIdx.begin();
+    std::vector<int>::iterator it_f;
+    std::vector<int>::iterator it_d = predDatIdx.begin();
     for (it_f = foundActIdx.begin(); it_f != foundActIdx.end(); ++it_f) {
 
         trks[*it_f]->makeZeroCurrMissed();
@@ -309,11 +275,23 @@ void TrMgr::initTrackers(const double & q_int, const double & q_mz,
     unsigned int i;
     for(i = 0; i < mData.size(); i++) {
         if (mData.at(i) == CLAIMEDPT) { continue; }
-//         trks[initCounts] =
-       trks.push_back(new Tracker(mData.at(i),iData.at(i),
-                currScanIdx, i,
-                q_int, q_mz, r_int, r_mz, criticalT));
+        Tracker * tr;
+        if (freeTrks.empty()) {
+            tr = new Tracker(mData.at(i),iData.at(i),
+                    currScanIdx, i,
+                    q_int, q_mz, r_int, r_mz, criticalT);
+        }
+        else {
+            tr = freeTrks.back();
+            freeTrks.pop_back();
+            tr->reset(mData.at(i),iData.at(i),
+                    currScanIdx, i,
+                    q_int, q_mz, r_int, r_mz, criticalT);
+        }
+        trks.push_back(tr);
         actIdx.push_back(initCounts);
+        birthScan.push_back(currScanIdx);
+        birthCent.push_back(i);
         ++initCounts;
 
         //make sure I allocated enough space
@@ -332,7 +310,7 @@ void TrMgr::removeOvertimers() {
             continue;
         }
         //intensity checks
-        std::list<double> iList = trks[*it]->getIntensityList();
+        const std::vector<double> & iList = trks[*it]->getIntensityList();
         double maxHeight = *max_element(iList.begin(), iList.end());
 
         //used to be default at 60, but that is an arbitrary cut off
@@ -359,6 +337,8 @@ continue; }
         }
 
         picIdx.push_back(*it);
+        picScan.push_back(0);
+        picPoint.push_back(-1);
     }
     actIdx.clear();
 }
@@ -371,17 +351,6 @@ void TrMgr::displayTracked() {
     }
 }
 
-std::list<int> TrMgr::excludeMisses(const std::list<int> & A) {
-
-  std::list<int> clean;
-  std::list<int>::const_iterator it;
-  for (it = A.begin(); it != A.end(); ++it) {
-    if (*it != -1)
-      clean.push_back(*it);
-  }
-  return clean;
-}
-
 int TrMgr::findMinIdx(const std::vector<double> & d,
 		   const std::vector<int> & idx) {
   std::vector<int>::const_iterator it;
@@ -414,15 +383,15 @@ void TrMgr::writePICsToFile() {
         totalCents +=  trks[picIdx.at(i)]->getTrLen();
         feat_idx << totalCents << endl;
 
-        std::list<int> iscanList = trks[picIdx.at(i)]->getScanList();
-        std::list<int> icentList = trks[picIdx.at(i)]->getCentroidList();
-        std::list<double> imzList = trks[picIdx.at(i)]->getMzList();
-        std::list<double> iintensityList = trks[picIdx.at(i)]->getIntensityList();
+        const std::vector<int> & iscanList = trks[picIdx.at(i)]->getScanList();
+        const std::vector<int> & icentList = trks[picIdx.at(i)]->getCentroidList();
+        const std::vector<double> & imzList = trks[picIdx.at(i)]->getMzList();
+        const std::vector<double> & iintensityList = trks[picIdx.at(i)]->getIntensityList();
 
-        std::list<int>::iterator it_s;
-        std::list<int>::iterator it_c = icentList.begin();
-        std::list<double>::iterator it_m = imzList.begin();
-        std::list<double>::iterator it_i = iintensityList.begin();
+        std::vector<int>::const_iterator it_s;
+        std::vector<int>::const_iterator it_c = icentList.begin();
+        std::vector<double>::const_iterator it_m = imzList.begin();
+        std::vector<double>::const_iterator it_i = iintensityList.begin();
 
         /*iterate over all scans, indices in tracker (i)*/
         for(it_s = iscanList.begin(); it_s != iscanList.end(); ++it_s) {
@@ -490,26 +459,18 @@ void TrMgr::erasePicElements(const std::vector<int> & eIdx) {
     }
 }
 
-std::list<double> TrMgr::diff(const std::list<double> vec) {
-
-    std::list<double> delta;
-    std::list<double>::const_iterator it = vec.begin();
-    size_t i = 0;
-    while (i != vec.size() - 1) {
-        delta.push_back(*it - *(++it));
-        //cout << "delta.back(): " << delta.back() << endl;
-        i++;
-    }
-    return delta;
-}
-
-
 bool TrMgr::hasMzDeviation(int i) {
     trks[i]->computeMyXbar();
     trks[i]->computeMyS2();
     double mzTol = ppm*trks[i]->getXbar()/10e5;
    //cout << "mzTol is: " << mzTol << endl;
-    double peakDeviance = fabs(computeAnyXbar(diff(trks[i]->getMzList())));
+    //mean difference of consecutive m/z values
+    const std::vector<double> & mzList = trks[i]->getMzList();
+    double peakDeviance = 0;
+    for (size_t k = 0; k + 1 < mzList.size(); ++k) {
+        peakDeviance += mzList[k] - mzList[k + 1];
+    }
+    peakDeviance = fabs(peakDeviance/(mzList.size() - 1));
     //cout << "Peak Deviance is " << peakDeviance << endl;
     if (peakDeviance > mzTol)
         return true;
@@ -552,3 +513,68 @@ void TrMgr::shiftUpIndices(const int i) {
         }
     }
 }
+
+void TrMgr::setScanBounds(const double below, const double above) {
+    outBelow = below;
+    outAbove = above;
+}
+
+//flag if the tracker's window includes data points outside of the m/z range
+void TrMgr::checkWindow(Tracker * tr) {
+    double left, right;
+    tr->getPredWindow(left, right);
+    if (outBelow != -HUGE_VAL && !(outBelow < left)) {
+        leakBelow = true;
+    }
+    if (outAbove != HUGE_VAL && !(right < outAbove)) {
+        leakAbove = true;
+    }
+}
+
+bool TrMgr::leakedBelow() {
+    return leakBelow;
+}
+
+bool TrMgr::leakedAbove() {
+    return leakAbove;
+}
+
+int TrMgr::getInitCounts() {
+    return initCounts;
+}
+
+int TrMgr::getBirthScan(int i) {
+    return birthScan.at(i);
+}
+
+int TrMgr::getBirthCent(int i) {
+    return birthCent.at(i);
+}
+
+int TrMgr::getPicScan(int i) {
+    return picScan.at(i);
+}
+
+int TrMgr::getPicPoint(int i) {
+    return picPoint.at(i);
+}
+
+//hand over the tracker, it is no longer deleted by this TrMgr
+Tracker* TrMgr::releaseTracker(int i) {
+    Tracker* tr = trks.at(i);
+    trks[i] = NULL;
+    return tr;
+}
+
+//take ownership of the trackers t (NULL for deleted ones), pics being the
+//indices of the pics in t
+void TrMgr::adoptTrackers(const std::vector<Tracker*> & t,
+        const std::vector<int> & pics) {
+    for (int i = 0; i < initCounts; i++) {
+        delete trks[i];
+    }
+    trks = t;
+    initCounts = t.size();
+    picIdx = pics;
+    actIdx.clear();
+}
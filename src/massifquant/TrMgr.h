@@ -35,25 +35,48 @@ class TrMgr {
                                     //second is subidx of picIdx.
         int picCounts;
         int actCounts;
-        //prediction info
-        std::list<int> predDatIdx; //store data points corresponding to claimed tr
-        std::list<int> initDatIdx; //mark points for new trackers to be init.
+        //prediction info, the vectors are reused for all scans
+        std::vector<int> predDatIdx; //store data points corresponding to claimed tr
         std::vector<double> predDist; //store distance from claimed tr pred
-        std::list<int> foundActIdx; //active index of trs that found
-        std::list<int> missActIdx; //active index of trs that missed
+        std::vector<int> foundActIdx; //active index of trs that found
+        std::vector<int> missActIdx; //active index of trs that missed
+        std::vector<int> missPoint; //contested data idx of each missed tr
+                                  //(-1 if it did not lose a competition)
+        std::vector<std::pair<int, int> > claims; //claimed data idx and
+                                                  //subidx of actIdx
+        std::vector<int> retiredIdx; //trs taken off the active list
+        int currMissPoint;
+
+        //deleted trackers, reused for new ones
+        std::vector<Tracker*> freeTrks;
+
+        //parallel mode: m/z of the closest data points below and above the
+        //processed m/z range; set if a tracker's window reaches them.
+        double outBelow;
+        double outAbove;
+        bool leakBelow;
+        bool leakAbove;
+
+        //scan and data idx at which each tracker was initialized and
+        //scan (0 if retired at the end) and contested data idx at which
+        //each pic was retired.
+        std::vector<int> birthScan;
+        std::vector<int> birthCent;
+        std::vector<int> picScan;
+        std::vector<int> picPoint;
 
 
-        std::list<int> excludeMisses(const std::list<int> & A);
-
         int findMinIdx(const std::vector<double> & d,
                 const std::vector<int> & idx);
 
         void judgeTracker(const int & i);
 
-        std::list<double> diff(const std::list<double> vec);
+        void recycleTracker(const int i);
 
         bool hasMzDeviation(int i);
 
+        void checkWindow(Tracker * tr);
+
         /* bool isSeizmo(int i); */
 
     public:
@@ -70,10 +93,10 @@ class TrMgr {
         void setDataScan(const std::vector<double> & mdat,
                 const std::vector<double> & idat);
         void setCurrScanIdx(const int sidx);
-        void setPredDatIdx(const std::list<int> & pdi);
+        void setPredDatIdx(const std::vector<int> & pdi);
 
-        void setFoundActIdx(const std::list<int> & fai);
-        void setMissActIdx(const std::list<int> & mai);
+        void setFoundActIdx(const std::vector<int> & fai);
+        void setMissActIdx(const std::vector<int> & mai);
         void setPredDist(const std::vector<double> & dist);
         void setActIdx(const std::vector<int> & ai);
 
@@ -113,6 +136,28 @@ class TrMgr {
 
         void shiftUpIndices(const int i);
 
+        //parallel mode
+        void setScanBounds(const double below, const double above);
+
+        bool leakedBelow();
+
+        bool leakedAbove();
+
+        int getInitCounts();
+
+        int getBirthScan(int i);
+
+        int getBirthCent(int i);
+
+        int getPicScan(int i);
+
+        int getPicPoint(int i);
+
+        Tracker* releaseTracker(int i);
+
+        void adoptTrackers(const std::vector<Tracker*> & t,
+                const std::vector<int> & pics);
+
 };
 
 
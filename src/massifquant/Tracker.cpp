@@ -12,6 +12,20 @@
 
 using namespace std;
 
+//2 x 2 matrix product C = AB; C must not alias A or B
+static inline void mult22(const double * A, const double * B, double * C) {
+  C[0] = A[0]*B[0] + A[1]*B[2];
+  C[1] = A[0]*B[1] + A[1]*B[3];
+  C[2] = A[2]*B[0] + A[3]*B[2];
+  C[3] = A[2]*B[1] + A[3]*B[3];
+}
+
+//x = Ab for a 2 x 2 matrix A; x must not alias b
+static inline void mult22Vec(const double * A, const double * b, double * x) {
+  x[0] = A[0]*b[0] + A[1]*b[1];
+  x[1] = A[2]*b[0] + A[3]*b[1];
+}
+
 Tracker::Tracker(const double & init_cent_m,
         const double & init_cent_i,
         const int & scan_num,
@@ -20,6 +34,27 @@ Tracker::Tracker(const double & init_cent_m,
         const double & r_int, const double & r_mz,
         const double & ct) {
 
+    reset(init_cent_m, init_cent_i, scan_num, cent_num,
+          q_int, q_mz, r_int, r_mz, ct);
+}
+
+void Tracker::reset(const double & init_cent_m,
+        const double & init_cent_i,
+        const int & scan_num,
+        const int & cent_num,
+        const double & q_int, const double & q_mz,
+        const double & r_int, const double & r_mz,
+        const double & ct) {
+
+    //clear() keeps the capacity of a recycled tracker
+    centroidList.clear();
+    scanList.clear();
+    intensityList.clear();
+    mzList.clear();
+    lowerList.clear();
+    upperList.clear();
+    each_ppm.clear();
+
     mzList.push_back(init_cent_m);
     intensityList.push_back(init_cent_i);
 
@@ -39,20 +74,8 @@ Tracker::Tracker(const double & init_cent_m,
     mzS2 = 0;
 
     //NO DEPENDENCY INIT
-    irXhat = vector<double>(DIMV, 0);
-    irF = vector<double>(DIMM, 0);
-    irFt = vector<double>(DIMM, 0);
-    irH = vector<double>(DIMV, 0);
-    irQ = vector<double>(DIMM, 0);
-    irP = vector<double>(DIMM, 0);
-
-    mrXhat = vector<double>(DIMV, 0);
-    mrF = vector<double>(DIMM, 0);
-    mrFt = vector<double>(DIMM, 0);
-    mrH = vector<double>(DIMV, 0);
-    mrQ = vector<double>(DIMM, 0);
-    mrP = vector<double>(DIMM, 0);
-
+    irXhat[0] = irXhat[1] = 0;
+    mrXhat[0] = mrXhat[1] = 0;
 
     mrXhat[0] = init_cent_m;
     irXhat[0] = init_cent_i;
@@ -152,18 +175,18 @@ double Tracker::getS2() {
     return mzS2;
 }
 
-std::list<int> Tracker::getScanList() {
+const std::vector<int> & Tracker::getScanList() {
     return scanList;
 }
 
-std::list<int> Tracker::getCentroidList() {
+const std::vector<int> & Tracker::getCentroidList() {
     return centroidList;
 }
 
-void  Tracker::appendToTracker(const std::list<int> & sl,
-		const std::list<int> & cl,
-		const std::list<double> & ml,
-		const std::list<double> & il) {
+void  Tracker::appendToTracker(const std::vector<int> & sl,
+		const std::vector<int> & cl,
+		const std::vector<double> & ml,
+		const std::vector<double> & il) {
     scanList.insert(scanList.end(), sl.begin(), sl.end());
     centroidList.insert(centroidList.end(), cl.begin(), cl.end());
     mzList.insert(mzList.end(), ml.begin(), ml.end());
@@ -179,11 +202,11 @@ int Tracker::getStopScanIdx() {
     return scanList.front();
 }
 
-std::list<double> Tracker::getIntensityList() {
+const std::vector<double> & Tracker::getIntensityList() {
     return intensityList;
 }
 
-std::list<double> Tracker::getMzList() {
+const std::vector<double> & Tracker::getMzList() {
     return mzList;
 }
 
@@ -192,11 +215,20 @@ void Tracker::predictCentroid() {
     /*NO DEPENDENCY VERSION*/
     //mass
     //  mP = mF*mP*mFt + mQ;
-    mrP = mrF*mrP*mrFt;
-    mrXhat = multiplyMatVec(mrF, mrXhat);
+    double tmp[DIMM], x[DIMV];
+    mult22(mrF, mrP, tmp);
+    mult22(tmp, mrFt, mrP);
+    mult22Vec(mrF, mrXhat, x);
+    mrXhat[0] = x[0]; mrXhat[1] = x[1];
     //intensity
-    irP = irF*irP*irFt + irQ;
-    irXhat = multiplyMatVec(irF, irXhat);
+    double tmp2[DIMM];
+    mult22(irF, irP, tmp);
+    mult22(tmp, irFt, tmp2);
+    for (int j = 0; j < DIMM; j++) {
+        irP[j] = tmp2[j] + irQ[j];
+    }
+    mult22Vec(irF, irXhat, x);
+    irXhat[0] = x[0]; irXhat[1] = x[1];
 
     predCounts += 1;
 }
@@ -207,7 +239,8 @@ void Tracker::innovateCentroid(const double & my,
         const int centIdx) {
 
     /*NO DEPENDENCY VERSION*/
-    std::vector<double> mrK(2, 0);
+    double mrK[DIMV];
+    double IminusK[DIMM], P[DIMM];
     //mass
     //step1
     mrK[0] = mrP[0] * (1/(mrP[0] + mrR));
@@ -217,14 +250,14 @@ void Tracker::innovateCentroid(const double & my,
     mrXhat[0] = mrXhat[0] + mrK[0]*(my - mrXhat[0]);
    //step3
     //    /*intermediate vector*/
-    std::vector<double> IminusK(4,0);
     IminusK[0] = 1 - mrK[0];
     IminusK[1] = 0;
     IminusK[2] = 0 - mrK[1];
     IminusK[3] = 1;
-    mrP = IminusK*mrP;
+    mult22(IminusK, mrP, P);
+    std::copy(P, P + DIMM, mrP);
        //intensity
-    std::vector<double> irK(2);
+    double irK[DIMV];
     //step1
     irK[0] = irP[0] * (1/(irP[0] + irR));
     irK[1] = irP[2] * (1/(irP[0] + irR));
@@ -237,7 +270,8 @@ void Tracker::innovateCentroid(const double & my,
     IminusK[1] = 0;
     IminusK[2] = 0 - irK[1];
     IminusK[3] = 1;
-    irP = IminusK*irP;
+    mult22(IminusK, irP, P);
+    std::copy(P, P + DIMM, irP);
 
     //record keeping
     scanList.push_back(scanIdx);
@@ -247,6 +281,21 @@ void Tracker::innovateCentroid(const double & my,
 
 }
 
+//m/z window in which the predicted centroid is searched
+void Tracker::getPredWindow(double & left, double & right) {
+  //Marginal Error
+  double mzErrMg = sqrt(mrP[0])*criticalT;
+  left = mrXhat[0] - mzErrMg;
+  right = mrXhat[0] + mzErrMg;
+}
+
+//add offset[scan] to the index of the centroid of each scan
+void Tracker::offsetCentroids(const std::vector<int> & offset) {
+    for (size_t k = 0; k < centroidList.size(); k++) {
+        centroidList[k] += offset.at(scanList[k]);
+    }
+}
+
 int Tracker::claimDataIdx(const std::vector<double> & mData,
 			  const std::vector<double> & iData,
 			  std::vector<double> & predDist, int minTrLen, int scanBack) {
@@ -254,10 +303,8 @@ int Tracker::claimDataIdx(const std::vector<double> & mData,
   //The returned data point index
   int centIdx;
 
-  //Marginal Error
-  double mzErrMg = sqrt(mrP[0])*criticalT;
-  double left = mrXhat[0] - mzErrMg;
-  double right = mrXhat[0] + mzErrMg;
+  double left, right;
+  getPredWindow(left, right);
 
   if ( (trLen >= minTrLen  - 1) && (scanBack == 1) ) {
      lowerList.push_back(left);
@@ -267,29 +314,31 @@ int Tracker::claimDataIdx(const std::vector<double> & mData,
   std::vector<double>::const_iterator low,up;
   low = lower_bound(mData.begin(), mData.end(), left);
   up = upper_bound(mData.begin(), mData.end(), right);
-  std::vector<int> neighborIdxR;
   int lowint = int(low - mData.begin());
   int upint = int(up - mData.begin());
-  if (lowint != upint) {
-      neighborIdxR = createSequence(lowint, upint - 1, 1);
-  }
-  else {
+  if (lowint == upint) {
       predDist.push_back(-1);
       centIdx = -1;
       return centIdx;
   }
 
-  //Distance Metric R
-  std::vector<double> mSubDataR = copySubIdx(mData, neighborIdxR);
-  std::vector<double> iSubDataR = copySubIdx(iData, neighborIdxR);
-  std::vector<double> distR = measureDist(mSubDataR, iSubDataR);
-  //will be changed inside findMin b/c passed as reference.
-  unsigned int centSubIdxR;
-  double bestDistR = findMin(distR, centSubIdxR);
+  //Distance Metric R, first data point with the smallest distance
+  double mSd = sqrt(mrP[0]);
+  double iSd = sqrt(irP[0]);
+  double bestDistR = 0;
+  centIdx = lowint;
+  for (int j = lowint; j < upint; j++) {
+      double mNumerator = mData[j] - mrXhat[0];
+      double iNumerator = iData[j] - irXhat[0];
+      double d = (mNumerator*mNumerator)/mSd + (iNumerator*iNumerator)/iSd;
+      if (j == lowint || d < bestDistR) {
+          bestDistR = d;
+          centIdx = j;
+      }
+  }
   predDist.push_back(bestDistR);
-  int centIdxR = neighborIdxR.at(centSubIdxR);
 
-  return centIdxR;
+  return centIdx;
 }
 
 
@@ -311,7 +360,7 @@ std::vector<double> Tracker::getFeatureInfo(double * scanTime) {
     featInfo[5] = double(*max_element(scanList.begin(), scanList.end()));
     //featInfo[5] = scanTime[*max_element(scanList.begin(), scanList.end())];
     //7-integrated (not normalized intensity)
-    std::list<double>::iterator it_i;
+    std::vector<double>::iterator it_i;
     double area = 0;
     double maxInten = 0;
     /*note that sqrt transformation is one to one for values >= 0*/
@@ -342,39 +391,10 @@ std::vector<double> Tracker::getFeatureInfo(double * scanTime) {
     return featInfo;
 }
 
-std::vector<double> Tracker::measureDist(const vector<double> & mSubData,
-					 const vector<double> & iSubData) {
-
-    std::vector<double> d;
-
-    vector<double> mNumerator = mSubData - mrXhat[0];
-    vector<double> iNumerator = iSubData - irXhat[0];
-
-    vector<double> mDist = dottimes(mNumerator, mNumerator)/sqrt(mrP[0]);
-    vector<double> iDist = dottimes(iNumerator, iNumerator)/sqrt(irP[0]);
-    d = dotadd(mDist, iDist);
-    return d;
-}
-
-double Tracker::findMin(const std::vector<double> & d,
-			unsigned int & centIdx) {
-
-  double myMin = d.at(0);
-  centIdx = 0;
-  unsigned int i;
-  for(i = 0; i < d.size(); i++) {
-    if (d.at(i) < myMin) {
-      myMin = d.at(i);
-      centIdx = i;
-    }
-  }
-  return myMin;
-}
-
 double Tracker::computeMyXbar() {
     //make it a weighted mean
-    std::list<double>::iterator it_m;
-    std::list<double>::iterator it_w = intensityList.begin();
+    std::vector<double>::iterator it_m;
+    std::vector<double>::iterator it_w = intensityList.begin();
     double intenSum = 0;
     for (it_m = mzList.begin(); it_m != mzList.end(); ++it_m) {
         double inten2 = (*it_w) * (*it_w);
@@ -412,28 +432,25 @@ bool Tracker::performScanBack() {
     double lower = getLowerXbar();
     double upper = getUpperXbar();
 
-    std::list<double>::iterator it_m = mzList.begin();
-    std::list<double>::iterator it_i = intensityList.begin();
-    std::list<int>::iterator it_s = scanList.begin();
-    std::list<int>::iterator it_c = centroidList.begin();
-
+    //compact the history in place, keeping the order
+    size_t n = 0;
     int delCount = 0;
-    while (it_m != mzList.end()) {
+    for (size_t k = 0; k < mzList.size(); k++) {
         //is it outside the converged bounds?
-        if (*it_m < lower || upper < *it_m) {
-            it_m = mzList.erase(it_m);
-            it_i = intensityList.erase(it_i);
-            it_s = scanList.erase(it_s);
-            it_c = centroidList.erase(it_c);
+        if (mzList[k] < lower || upper < mzList[k]) {
             delCount++;
+            continue;
         }
-        else {
-            ++it_m;
-            ++it_i;
-            ++it_s;
-            ++it_c;
-        }
+        mzList[n] = mzList[k];
+        intensityList[n] = intensityList[k];
+        scanList[n] = scanList[k];
+        centroidList[n] = centroidList[k];
+        n++;
     }
+    mzList.resize(n);
+    intensityList.resize(n);
+    scanList.resize(n);
+    centroidList.resize(n);
     //Rprintf("%d\t", delCount);
 
     if (delCount > 0) {
@@ -448,7 +465,7 @@ bool Tracker::performScanBack() {
 
 double Tracker::computeMyS2() {
 
-    std::list<double>::iterator it;
+    std::vector<double>::iterator it;
     for (it = mzList.begin(); it != mzList.end(); ++it) {
         mzS2 += (*it - mzXbar) * (*it - mzXbar);
     }
@@ -460,9 +477,7 @@ double Tracker::computeMyS2() {
 
 double Tracker::approxMassAccuracy() {
 
-    std::list<double> diff;
-
-    std::list<double>::iterator it_m;
+    std::vector<double>::iterator it_m;
     for (it_m = mzList.begin(); it_m != mzList.end(); ++it_m) {
         each_ppm.push_back((fabs(*it_m - mzXbar) * MILLION)/mzXbar);
 
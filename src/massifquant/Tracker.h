@@ -17,14 +17,15 @@ class Tracker {
 
     private:
 
-        std::list<int> centroidList;
-        std::list<int> scanList;
+        //history of the tracked centroids, one contiguous array per field
+        std::vector<int> centroidList;
+        std::vector<int> scanList;
 
-        std::list<double> intensityList;
-        std::list<double> mzList;
-        std::list<double> lowerList;
-        std::list<double> upperList;
-        std::list<double> each_ppm;
+        std::vector<double> intensityList;
+        std::vector<double> mzList;
+        std::vector<double> lowerList;
+        std::vector<double> upperList;
+        std::vector<double> each_ppm;
 
         int predCounts;
         int trLen;
@@ -37,13 +38,13 @@ class Tracker {
 
         //Model Specs
         /*intensity*/
-        std::vector<double> irXhat;
-        std::vector<double> irF;
-        std::vector<double> irFt;
-        std::vector<double> irH;
-        std::vector<double> irQ;
+        double irXhat[DIMV];
+        double irF[DIMM];
+        double irFt[DIMM];
+        double irH[DIMV];
+        double irQ[DIMM];
         double irR;
-        std::vector<double> irP;
+        double irP[DIMM];
 
         double q_val_i; //process uncertainty scalar
         double r_val_i;
@@ -54,24 +55,19 @@ class Tracker {
         double p_val_m;
 
         /*mass*/
-        std::vector<double> mrXhat;
-        std::vector<double> mrF;
-        std::vector<double> mrFt;
-        std::vector<double> mrH;
-        std::vector<double> mrQ;
+        double mrXhat[DIMV];
+        double mrF[DIMM];
+        double mrFt[DIMM];
+        double mrH[DIMV];
+        double mrQ[DIMM];
         double mrR;
-        std::vector<double> mrP;
+        double mrP[DIMM];
 
         //methods
         double getLowerXbar();
 
         double getUpperXbar();
 
-        std::vector<double> measureDist(const std::vector<double> & mSubData,
-                const std::vector<double> & iSubData);
-
-        double findMin(const std::vector<double> & d,
-                unsigned int & centIdx);
     public:
 
         //Constructor
@@ -86,6 +82,15 @@ class Tracker {
         //Destructor
         ~Tracker();
 
+        //start a new trace, keeping the memory of the history arrays
+        void reset(const double & init_cent_m,
+                const double & init_cent_i,
+                const int & scan_num,
+                const int & cent_num,
+                const double & q_int, const double & q_mz,
+                const double & r_int, const double & r_mz,
+                const double & ct);
+
         void incrementMiss();
 
         int getCurrMissed();
@@ -102,14 +107,14 @@ class Tracker {
 
         double getS2();
 
-        std::list<int> getScanList();
+        const std::vector<int> & getScanList();
 
-        std::list<int> getCentroidList();
+        const std::vector<int> & getCentroidList();
 
-        void appendToTracker(const std::list<int> & sl,
-                const std::list<int> & cl,
-		const std::list<double> & ml,
-		const std::list<double> & il);
+        void appendToTracker(const std::vector<int> & sl,
+                const std::vector<int> & cl,
+		const std::vector<double> & ml,
+		const std::vector<double> & il);
 
         int getStartScanIdx();
 
@@ -123,9 +128,9 @@ class Tracker {
 
         double approxMassAccuracy();
 
-        std::list<double> getIntensityList();
+        const std::vector<double> & getIntensityList();
 
-        std::list<double> getMzList();
+        const std::vector<double> & getMzList();
 
         void displayContents();
 
@@ -136,6 +141,10 @@ class Tracker {
                 const int scanIdx,
                 const int centIdx);
 
+        void getPredWindow(double & left, double & right);
+
+        void offsetCentroids(const std::vector<int> & offset);
+
         int claimDataIdx(const std::vector<double> & mData,
                 const std::vector<double>  & iData,
                 std::vector<double> & predDist,
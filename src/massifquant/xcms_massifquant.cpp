@@ -21,13 +21,243 @@
 #include <Rinternals.h>
 #include <Rdefines.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 const int N_NAMES = 7;
 using namespace std;
 
+//Parallel mode: the m/z range is split into slabs which are tracked
+//independently. Trackers interact only through data points within their
+//prediction window, hence the result of a slab is identical to the serial
+//one as long as no tracker's window includes a data point of another slab.
+//If that happens the slab is merged with its neighbor and tracked again.
+struct mqSlab {
+    double mzFrom;
+    double mzTo;
+    TrMgr * mgr;
+    std::vector<int> offset; //index of the slab's first data point per scan
+    bool failed;
+};
+
+struct mqTrackerKey {
+    int scan;
+    int cent;
+    int slab;
+    int idx;
+};
+
+//order of initialization in the serial run
+static bool trackerBefore(const mqTrackerKey & a, const mqTrackerKey & b) {
+    if (a.scan != b.scan) return a.scan > b.scan;
+    return a.cent < b.cent;
+}
+
+struct mqPicKey {
+    int scan;
+    int point;
+    int rank;
+};
+
+//order of retirement in the serial run: by scan, first the trackers without
+//a data point, then those that lost a competition for a data point.
+static bool picBefore(const mqPicKey & a, const mqPicKey & b) {
+    if (a.scan != b.scan) return a.scan > b.scan;
+    if (a.point != b.point) return a.point < b.point;
+    return a.rank < b.rank;
+}
+
+static void trackSlab(mqSlab & slab, DataKeeper & dkeep, int scanrangeFrom,
+        int scanrangeTo, double iq, double mzq, double ir, double mzr) {
+    std::vector<double> mzScan;
+    std::vector<double> intenScan;
+    double below, above;
+    int nmz = dkeep.getTotalCentroidCount();
+    int totalScanNums = dkeep.getTotalScanNumbers();
+    slab.offset.assign(scanrangeTo + 1, 0);
+    slab.offset[scanrangeTo] = dkeep.getScanXcmsRange(scanrangeTo, nmz,
+            totalScanNums, slab.mzFrom, slab.mzTo, mzScan, intenScan,
+            below, above);
+    slab.mgr->setDataScan(mzScan, intenScan);
+    slab.mgr->initTrackers(iq, mzq, ir, mzr, scanrangeTo);
+    for (int k = scanrangeTo - 1; k >= scanrangeFrom; k--) {
+        slab.mgr->setCurrScanIdx(k);
+        slab.offset[k] = dkeep.getScanXcmsRange(k, nmz, totalScanNums,
+                slab.mzFrom, slab.mzTo, mzScan, intenScan, below, above);
+        slab.mgr->setScanBounds(below, above);
+        slab.mgr->predictScan(mzScan, intenScan);
+        slab.mgr->competeAct();
+        slab.mgr->manageMissed();
+        slab.mgr->manageTracked();
+        slab.mgr->initTrackers(iq, mzq, ir, mzr, k);
+    }
+    slab.mgr->removeOvertimers();
+}
+
+//split the m/z range into nslab slabs with about the same number of data
+//points, cutting at the largest gap between neighboring (sampled) m/z values.
+static std::vector<double> slabCuts(const double * pmz, int nmz, int nslab) {
+    std::vector<double> smp;
+    int step = nmz / 100000 + 1;
+    for (int i = 0; i < nmz; i += step) {
+        smp.push_back(pmz[i]);
+    }
+    sort(smp.begin(), smp.end());
+    std::vector<double> cuts;
+    int n = smp.size();
+    int w = n / (nslab * 10);
+    for (int j = 1; j < nslab; j++) {
+        int q = int((double) j * n / nslab);
+        int best = -1;
+        double gap = -1;
+        for (int i = max(q - w, 1); i <= min(q + w, n - 1); i++) {
+            if (smp[i] - smp[i - 1] > gap) {
+                gap = smp[i] - smp[i - 1];
+                best = i;
+            }
+        }
+        if (best < 0 || gap <= 0) { continue; }
+        double c = smp[best - 1] + (smp[best] - smp[best - 1]) / 2;
+        if (cuts.size() == 0 || c > cuts.back()) {
+            cuts.push_back(c);
+        }
+    }
+    return cuts;
+}
+
+//track the slabs in parallel and merge the results into busybody in the
+//order of the serial run.
+static void massifquantSlabs(TrMgr & busybody, DataKeeper & dkeep,
+        const double * pmz, int nmz, int scanrangeFrom, int scanrangeTo,
+        double iq, double mzq, double ir, double mzr, int nthreads,
+        double minIntensity, int minCentroids, double consecMissedLim,
+        double ppm, double criticalVal, int scanBack) {
+    std::vector<double> cuts = slabCuts(pmz, nmz, 2 * nthreads);
+    std::vector<mqSlab> slabs(cuts.size() + 1);
+    for (size_t i = 0; i < slabs.size(); i++) {
+        slabs[i].mzFrom = (i == 0) ? -HUGE_VAL : cuts[i - 1];
+        slabs[i].mzTo = (i == cuts.size()) ? HUGE_VAL : cuts[i];
+        slabs[i].mgr = NULL;
+        slabs[i].failed = false;
+    }
+    bool failed = false;
+    while (true) {
+        std::vector<int> run;
+        for (size_t i = 0; i < slabs.size(); i++) {
+            if (slabs[i].mgr == NULL) {
+                slabs[i].mgr = new TrMgr(scanrangeTo, minIntensity,
+                        minCentroids, consecMissedLim, ppm, criticalVal,
+                        scanBack);
+                run.push_back(i);
+            }
+        }
+        int nrun = run.size();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+#endif
+        for (int j = 0; j < nrun; j++) {
+            try {
+                trackSlab(slabs[run[j]], dkeep, scanrangeFrom, scanrangeTo,
+                        iq, mzq, ir, mzr);
+            }
+            catch (...) {
+                slabs[run[j]].failed = true;
+            }
+        }
+        //merge slabs whose trackers reached the neighboring slab
+        size_t n = slabs.size();
+        std::vector<bool> join(n, false); //join slab i with slab i - 1
+        bool leaked = false;
+        for (size_t i = 0; i < n; i++) {
+            failed = failed || slabs[i].failed;
+            if (slabs[i].mgr->leakedBelow() && i > 0) {
+                join[i] = true;
+                leaked = true;
+            }
+            if (slabs[i].mgr->leakedAbove() && i < n - 1) {
+                join[i + 1] = true;
+                leaked = true;
+            }
+        }
+        if (failed || !leaked) { break; }
+        std::vector<mqSlab> merged;
+        for (size_t i = 0; i < n; i++) {
+            if (!join[i]) {
+                merged.push_back(slabs[i]);
+                continue;
+            }
+            if (merged.back().mgr != NULL) {
+                delete merged.back().mgr;
+                merged.back().mgr = NULL;
+            }
+            delete slabs[i].mgr;
+            merged.back().mzTo = slabs[i].mzTo;
+        }
+        slabs = merged;
+    }
+    if (failed) {
+        for (size_t i = 0; i < slabs.size(); i++) {
+            delete slabs[i].mgr;
+        }
+        error("massifquant: tracking of the m/z slabs failed\n");
+    }
+
+    //trackers and pics in serial order
+    std::vector<mqTrackerKey> trKeys;
+    for (size_t s = 0; s < slabs.size(); s++) {
+        for (int i = 0; i < slabs[s].mgr->getInitCounts(); i++) {
+            mqTrackerKey key;
+            key.scan = slabs[s].mgr->getBirthScan(i);
+            key.cent = slabs[s].mgr->getBirthCent(i) +
+                slabs[s].offset.at(key.scan);
+            key.slab = s;
+            key.idx = i;
+            trKeys.push_back(key);
+        }
+    }
+    sort(trKeys.begin(), trKeys.end(), trackerBefore);
+    std::vector<std::vector<int> > rank(slabs.size());
+    for (size_t s = 0; s < slabs.size(); s++) {
+        rank[s].resize(slabs[s].mgr->getInitCounts());
+    }
+    std::vector<Tracker*> trks(trKeys.size());
+    for (size_t r = 0; r < trKeys.size(); r++) {
+        mqSlab & slab = slabs[trKeys[r].slab];
+        rank[trKeys[r].slab][trKeys[r].idx] = r;
+        trks[r] = slab.mgr->releaseTracker(trKeys[r].idx);
+        if (trks[r] != NULL) {
+            trks[r]->offsetCentroids(slab.offset);
+        }
+    }
+    std::vector<mqPicKey> picKeys;
+    for (size_t s = 0; s < slabs.size(); s++) {
+        std::vector<int> picIdx = slabs[s].mgr->getPicIdx();
+        for (size_t p = 0; p < picIdx.size(); p++) {
+            mqPicKey key;
+            key.scan = slabs[s].mgr->getPicScan(p);
+            key.point = slabs[s].mgr->getPicPoint(p);
+            if (key.point >= 0) {
+                key.point += slabs[s].offset.at(key.scan);
+            }
+            key.rank = rank[s][picIdx[p]];
+            picKeys.push_back(key);
+        }
+        delete slabs[s].mgr;
+    }
+    sort(picKeys.begin(), picKeys.end(), picBefore);
+    std::vector<int> pics(picKeys.size());
+    for (size_t p = 0; p < picKeys.size(); p++) {
+        pics[p] = picKeys[p].rank;
+    }
+    busybody.adoptTrackers(trks, pics);
+}
+
 extern "C" SEXP massifquant(SEXP mz, SEXP intensity, SEXP scanindex,
         SEXP scantime, SEXP mzrange, SEXP scanrange, SEXP lastscan,
         SEXP minIntensity, SEXP minCentroids, SEXP consecMissedLim,
-        SEXP ppm, SEXP criticalVal, SEXP segs, SEXP scanBack) {
+        SEXP ppm, SEXP criticalVal, SEXP segs, SEXP scanBack, SEXP columnar,
+        SEXP threads) {
 
     //the return data structure and its elemental components
     //jo SEXP peaklist,entrylist,list_names,vmz,vmzmin,vmzmax,vstcenter,vscmin,vscmax,vintensity,vintenmax, vlength;
@@ -68,36 +298,46 @@ extern "C" SEXP massifquant(SEXP mz, SEXP intensity, SEXP scanindex,
     TrMgr busybody(scanrangeTo, sqrt(REAL(minIntensity)[0]),
             INTEGER(minCentroids)[0], REAL(consecMissedLim)[0],
             REAL(ppm)[0], REAL(criticalVal)[0], INTEGER(scanBack)[0]);
-    dkeep.getScanXcms(scanrangeTo, nmz, totalScanNums, mzScan, intenScan);
-    busybody.setDataScan(mzScan, intenScan);
-    busybody.initTrackers(iq, mzq, ir, mzr, scanrangeTo);
-    //begin feature finding
-    //Rprintf("scanrangeTo: %d\n", scanrangeTo);
-    double progCount = 0;
-    //jo double maxScanNums = double(scanrangeTo);
-    double progThresh = 10;
-    for (int k = scanrangeTo - 1; k >= scanrangeFrom; k--) {
+    int nthreads = INTEGER(threads)[0];
+    if (nthreads > 1) {
+        massifquantSlabs(busybody, dkeep, REAL(mz), nmz, scanrangeFrom,
+                scanrangeTo, iq, mzq, ir, mzr, nthreads,
+                sqrt(REAL(minIntensity)[0]), INTEGER(minCentroids)[0],
+                REAL(consecMissedLim)[0], REAL(ppm)[0],
+                REAL(criticalVal)[0], INTEGER(scanBack)[0]);
+    }
+    else {
+        dkeep.getScanXcms(scanrangeTo, nmz, totalScanNums, mzScan, intenScan);
+        busybody.setDataScan(mzScan, intenScan);
+        busybody.initTrackers(iq, mzq, ir, mzr, scanrangeTo);
+        //begin feature finding
+        //Rprintf("scanrangeTo: %d\n", scanrangeTo);
+        double progCount = 0;
+        //jo double maxScanNums = double(scanrangeTo);
+        double progThresh = 10;
+        for (int k = scanrangeTo - 1; k >= scanrangeFrom; k--) {
+
+            //progress
+            double perc  = (progCount/scanrangeTo) * 100;
+            //Rprintf("perc: %f\t", perc);
+            if (perc > progThresh) {
+                Rprintf(" %d  ", int(perc));
+                progThresh += 10;
+            }
 
-        //progress
-        double perc  = (progCount/scanrangeTo) * 100;
-        //Rprintf("perc: %f\t", perc);
-        if (perc > progThresh) {
-            Rprintf(" %d  ", int(perc));
-            progThresh += 10;
+            busybody.setCurrScanIdx(k);
+            dkeep.getScanXcms(k, nmz, totalScanNums, mzScan, intenScan);
+            busybody.predictScan(mzScan, intenScan);
+            busybody.competeAct();
+            busybody.manageMissed();
+            busybody.manageTracked();
+            busybody.initTrackers(iq, mzq, ir, mzr, k);
+            progCount++;
         }
 
-        busybody.setCurrScanIdx(k);
-        dkeep.getScanXcms(k, nmz, totalScanNums, mzScan, intenScan);
-        busybody.predictScan(mzScan, intenScan);
-        busybody.competeAct();
-        busybody.manageMissed();
-        busybody.manageTracked();
-        busybody.initTrackers(iq, mzq, ir, mzr, k);
-        progCount++;
+        busybody.removeOvertimers();
     }
 
-    busybody.removeOvertimers();
-
     //option to include segmentation correction
     //string segsStr(segs);
     //if (segsStr.compare("segOn") == 0) {
@@ -116,6 +356,34 @@ extern "C" SEXP massifquant(SEXP mz, SEXP intensity, SEXP scanindex,
     for(int j = 0; j < N_NAMES; j++)
         SET_STRING_ELT(list_names, j,  mkChar(names[j]));
 
+    //columnar result: one vector per field instead of one list per feature
+    if (LOGICAL(columnar)[0]) {
+        int npic = busybody.getPicCounts();
+        PROTECT(peaklist = allocVector(VECSXP, N_NAMES));
+        SET_VECTOR_ELT(peaklist, 0, vmz = NEW_NUMERIC(npic));
+        SET_VECTOR_ELT(peaklist, 1, vmzmin = NEW_NUMERIC(npic));
+        SET_VECTOR_ELT(peaklist, 2, vmzmax = NEW_NUMERIC(npic));
+        SET_VECTOR_ELT(peaklist, 3, vscmin = NEW_INTEGER(npic));
+        SET_VECTOR_ELT(peaklist, 4, vscmax = NEW_INTEGER(npic));
+        SET_VECTOR_ELT(peaklist, 5, vlength = NEW_INTEGER(npic));
+        SET_VECTOR_ELT(peaklist, 6, vintensity = NEW_INTEGER(npic));
+        setAttrib(peaklist, R_NamesSymbol, list_names);
+
+        for (int i = 0; i < npic; i++) {
+            std::vector<double> featInfo = busybody.iterOverFeatures(i, pscantime);
+            NUMERIC_POINTER(vmz)[i]  = featInfo.at(0);
+            NUMERIC_POINTER(vmzmin)[i] = featInfo.at(1);
+            NUMERIC_POINTER(vmzmax)[i] = featInfo.at(2);
+
+            INTEGER_POINTER(vscmin)[i] = int(featInfo.at(4));
+            INTEGER_POINTER(vscmax)[i] = int(featInfo.at(5));
+            INTEGER_POINTER(vlength)[i] = int(featInfo.at(3));
+            INTEGER_POINTER(vintensity)[i] = int(featInfo.at(6));
+        }
+        UNPROTECT(2);//peaklist, list_names
+        return (peaklist);
+    }
+
     PROTECT(peaklist = allocVector(VECSXP, busybody.getPicCounts()));
     for (int i=0;i<busybody.getPicCounts();i++) {
 
@@ -1,164 +1,223 @@
+#include <stdlib.h>
+#include <math.h>
 #include <R.h>
 #include <Rdefines.h>
 
-/* Perform hierarchical clustering on x till variable cutoff (specified via eppm
- * and eabs) reached */
-void
-R_mzClust_hclust(double *x, int *num, double *d, int *g, double *eppm,
-	     double *eabs)
-{
-	/* number of data points, one row for each cluster in matrix */
-	int n = *num;
-	/* like n plus one int for cluster length/status, corresponds to matrix
-	 * columns */
-	int m = n + 2;
+/*
+ * Hierarchical clustering (complete linkage) of the sorted m/z values x till
+ * the variable cutoff (specified via eppm and eabs) is reached.
+ *
+ * Two clusters are merged if all their values are within eppm * mean + eabs
+ * of the mean of the merged cluster; otherwise both clusters are deactivated
+ * (i.e. not merged with any other cluster). Clusters are merged in the order
+ * of their (complete linkage) distance.
+ *
+ * For sorted values the active clusters never overlap and the complete linkage
+ * distance of two clusters is the difference between the largest value of
+ * the one and the smallest value of the other. The closest clusters are thus
+ * always adjacent (also for ties, that are resolved in favour of the first
+ * cluster) and only the distances of adjacent active clusters have to be kept
+ * in a heap: O(n log n) instead of O(n^3) for the full distance matrix.
+ */
 
-	/* pointer array for d */
-	double *d_idx[n - 1];
-	double means[n];
-	double mrange[2];
-	int overlimit = 0;
+/* distance between the active cluster left and its right neighbor */
+struct clustDist {
+	double d;
+	int left;
+	int version;
+};
 
-	int minclust[2] = {0,0};
-	double mindst = DBL_MAX;
+struct clustHeap {
+	struct clustDist *e;
+	int n;
+};
 
-	/*loop vars */
-	int i, j, z;
+static int clustDist_less(const struct clustDist *a,
+			  const struct clustDist *b)
+{
+	return a->d < b->d || (a->d == b->d && a->left < b->left);
+}
 
-	int * clust;
-	clust = (int *) malloc(n * m * sizeof(int));
+static void clustHeap_push(struct clustHeap *h, double d, int left,
+			   int version)
+{
+	int i = h->n++;
+	struct clustDist v = {d, left, version};
+	while (i > 0 && clustDist_less(&v, &h->e[(i - 1) / 2])) {
+		h->e[i] = h->e[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	h->e[i] = v;
+}
 
-	/* calculate indices for distance matrix */
-	j = n - 1;
-	d_idx[0] = d;
-	for (i = 1; i < n - 1; i++) {
-		d_idx[i] = d_idx[i - 1] + j;
-		j = j - 1;
+static struct clustDist clustHeap_pop(struct clustHeap *h)
+{
+	struct clustDist top = h->e[0], v = h->e[--h->n];
+	int i = 0, c;
+	while ((c = 2 * i + 1) < h->n) {
+		if (c + 1 < h->n && clustDist_less(&h->e[c + 1], &h->e[c]))
+			c++;
+		if (!clustDist_less(&h->e[c], &v))
+			break;
+		h->e[i] = h->e[c];
+		i = c;
 	}
+	h->e[i] = v;
+	return top;
+}
 
-	/* init means */
-	for (i = 0; i < n; i++) {
-		means[i] = x[i];
+static int find_rep(int *parent, int i)
+{
+	int r = i;
+	while (parent[r] != r)
+		r = parent[r];
+	while (parent[i] != r) {
+		int p = parent[i];
+		parent[i] = r;
+		i = p;
 	}
+	return r;
+}
 
-	/* init cluster matrix */
-	for (z = 0; z < n; z++) {
-		clust[z * m] = 1;
-		clust[z * m + 1] = z;
+/*
+ * x: the m/z values, sorted increasingly (NA values are not clustered).
+ * g: the (1-based) cluster of each value; clusters are numbered in the order
+ *    of their first value.
+ * Returns 0 on success and 1 if memory could not be allocated.
+ */
+static int mzClust_sorted(const double *x, int n, double eppm, double eabs,
+			  int *g)
+{
+	/* each cluster is identified by the index of its first value */
+	int *size, *next, *prev, *state, *version, *parent;
+	double *means, *maxv;
+	struct clustHeap heap;
+	int i, last = -1, res = 0;
+
+	size = (int *) malloc(sizeof(int) * (n + 1));
+	next = (int *) malloc(sizeof(int) * (n + 1));
+	prev = (int *) malloc(sizeof(int) * (n + 1));
+	state = (int *) malloc(sizeof(int) * (n + 1));
+	version = (int *) malloc(sizeof(int) * (n + 1));
+	parent = (int *) malloc(sizeof(int) * (n + 1));
+	means = (double *) malloc(sizeof(double) * (n + 1));
+	maxv = (double *) malloc(sizeof(double) * (n + 1));
+	/* each merge or deactivation adds at most 2 distances */
+	heap.e = (struct clustDist *) malloc(sizeof(struct clustDist) *
+					     (3 * (size_t)n + 1));
+	heap.n = 0;
+	if (size == NULL || next == NULL || prev == NULL || state == NULL ||
+	    version == NULL || parent == NULL || means == NULL ||
+	    maxv == NULL || heap.e == NULL) {
+		res = 1;
+		goto cleanup;
 	}
 
-	for (z = 0; z < n-1; z++) {
-		for (i = 0; i < n; i++) {
-			if (clust[i * m] <= 0)
-				continue;
-			for (j = i + 1; j < n; j++) {
-				if (clust[j * m] <= 0)
-					continue;
-				/*calculate index, e.g. x=5 and y=9 -> index=sum(1:5)+(9-5) */
-				if (*(d_idx[i] + (j - i - 1)) < mindst) {
-					mindst = *(d_idx[i] + (j - i - 1));
-					minclust[0] = i;
-					minclust[1] = j;
-				}
-			}
+	/* state: 1 active, -1 deactivated, 0 merged into another cluster */
+	for (i = 0; i < n; i++) {
+		size[i] = 1;
+		state[i] = 1;
+		version[i] = 0;
+		parent[i] = i;
+		means[i] = x[i];
+		maxv[i] = x[i];
+		next[i] = -1;
+		prev[i] = -1;
+		if (ISNAN(x[i]))
+			continue;
+		if (last >= 0) {
+			next[last] = i;
+			prev[i] = last;
+			clustHeap_push(&heap, fabs(x[i] - x[last]), last, 0);
 		}
-		/* mindst is DBL_MAX, no clusters left */
-		if (mindst == DBL_MAX)
-			break;
-		/* calculate intervall for variable cutoff */
-		means[minclust[0]] = (means[minclust[0]] *
-				      clust[minclust[0] * m] +
-				      means[minclust[1]] *
-				      clust[minclust[1] * m]) / (double)(clust[minclust[0] * m] + clust[minclust[1] * m]);
-		mrange[0] =
-		    means[minclust[0]] - means[minclust[0]] * *eppm -
-		    *eabs;
-		mrange[1] =
-		    means[minclust[0]] + means[minclust[0]] * *eppm +
-		    *eabs;
+		last = i;
+	}
 
-		/* find outliers */
-		for (i = 1; i <= clust[minclust[0] * m]; i++) {
-			if (x[clust[minclust[0] * m + i]] < mrange[0] ||
-			    x[clust[minclust[0] * m + i]] > mrange[1]) {
-				overlimit = 1;
-				break;
-			}
-		}
-		if (!overlimit)
-			for (i = 1; i <= clust[minclust[1] * m]; i++) {
-				if (x[clust[minclust[1] * m + i]] < mrange[0]
-				    || x[clust[minclust[1] * m + i]] >
-				    mrange[1]) {
-					overlimit = 1;
-					break;
-				}
+	while (heap.n > 0) {
+		struct clustDist top = clustHeap_pop(&heap);
+		int a = top.left, b, l, r, over;
+		double lo, hi;
+		if (state[a] != 1 || version[a] != top.version)
+			continue;
+		b = next[a];
+		l = prev[a];
+		r = next[b];
+		/* calculate interval for variable cutoff */
+		means[a] = (means[a] * size[a] + means[b] * size[b]) /
+			(double)(size[a] + size[b]);
+		lo = means[a] - means[a] * eppm - eabs;
+		hi = means[a] + means[a] * eppm + eabs;
+		/* find outliers; values of a are smaller than those of b */
+		over = x[a] < lo || maxv[a] > hi || x[b] < lo || maxv[b] > hi;
+		if (over) {
+			/* deactivate clusters */
+			state[a] = -1;
+			state[b] = -1;
+			if (r >= 0)
+				prev[r] = l;
+			if (l >= 0) {
+				next[l] = r;
+				version[l]++;
+				if (r >= 0)
+					clustHeap_push(&heap, fabs(maxv[r] - x[l]),
+						       l, version[l]);
 			}
-
-		/* deactivate clusters, if outliers found*/
-		if (overlimit) {
-			clust[minclust[0] * m] *= -1;
-			clust[minclust[1] * m] *= -1;
-			overlimit = 0;
 		} else {
 			/* merge clusters */
-			for (i = 1; i <= clust[minclust[1] * m]; i++) {
-				clust[minclust[0] * m +
-				      clust[minclust[0] * m] + i] =
-				    clust[minclust[1] * m + i];
+			size[a] += size[b];
+			maxv[a] = maxv[b];
+			state[b] = 0;
+			parent[b] = a;
+			next[a] = r;
+			version[a]++;
+			if (r >= 0) {
+				prev[r] = a;
+				clustHeap_push(&heap, fabs(maxv[r] - x[a]), a,
+					       version[a]);
 			}
-			/* update clusterlength */
-			clust[minclust[0] * m] += clust[minclust[1] * m];
-			/* kill 2nd cluster */
-			clust[minclust[1] * m] = 0;
-
-			/* update distance, distance between cluster a and
-			 * cluster {c[i],c[j]} is max(dist(c[i],a),dist(c[j],a)) */
-			for(i = 0; i<n; i++) {
-				if(clust[i * m] <= 0 || i == minclust[0])
-					continue;
-				if(i<minclust[0]) {
-					if(i<minclust[1]) {
-						if(*(d_idx[i]+(minclust[0]-i-1)) <
-								*(d_idx[i]+(minclust[1]-i-1)))
-						*(d_idx[i]+(minclust[0]-i-1)) =
-								*(d_idx[i]+(minclust[1]-i-1));
-					} else {
-						if(*(d_idx[i]+(minclust[0]-i-1)) <
-								*(d_idx[minclust[1]]+(i-minclust[1]-1)))
-						*(d_idx[i]+(minclust[0]-i-1)) =
-								*(d_idx[minclust[1]]+(i-minclust[1]-1));
-					}
-				} else {
-					if(i<minclust[1]) {
-						if(*(d_idx[minclust[0]]+(i-minclust[0]-1)) <
-								*(d_idx[i]+(minclust[1]-i-1)))
-						*(d_idx[minclust[0]]+(i-minclust[0]-1)) =
-								*(d_idx[i]+(minclust[1]-i-1));
-					} else {
-						if(*(d_idx[minclust[0]]+(i-minclust[0]-1)) <
-								*(d_idx[minclust[1]]+(i-minclust[1]-1)))
-						*(d_idx[minclust[0]]+(i-minclust[0]-1)) =
-								*(d_idx[minclust[1]]+(i-minclust[1]-1));
-					}
-				}
+			if (l >= 0) {
+				version[l]++;
+				clustHeap_push(&heap, fabs(maxv[a] - x[l]), l,
+					       version[l]);
 			}
-
-
 		}
-		mindst = DBL_MAX;
 	}
+
 	/* create output */
-	int gnum = 1;
-	int tmp;
-	for (i = 0; i < n; i++) {
-		tmp = abs(clust[i * m]);
-		if (tmp == 0)
-			continue;
-		for (j = 1; j <= tmp; j++) {
-			g[clust[i * m + j]] = gnum;
-		}
-		gnum++;
+	{
+		int gnum = 1;
+		for (i = 0; i < n; i++)
+			if (state[i] != 0)
+				g[i] = gnum++;
+		for (i = 0; i < n; i++)
+			g[i] = g[find_rep(parent, i)];
 	}
-	free(clust);
+
+cleanup:
+	free(size);
+	free(next);
+	free(prev);
+	free(state);
+	free(version);
+	free(parent);
+	free(means);
+	free(maxv);
+	free(heap.e);
+	return res;
+}
+
+SEXP R_mzClust_sorted(SEXP x, SEXP eppm, SEXP eabs)
+{
+	SEXP g;
+	int n = LENGTH(x);
+	PROTECT(x = coerceVector(x, REALSXP));
+	PROTECT(g = allocVector(INTSXP, n));
+	for (int i = 1; i < n; i++)
+		if (REAL(x)[i] < REAL(x)[i - 1])
+			error("'x' has to be sorted increasingly");
+	if (mzClust_sorted(REAL(x), n, asReal(eppm), asReal(eabs),
+			   INTEGER(g)))
+		error("R_mzClust_sorted: memory could not be allocated!");
+	UNPROTECT(2);
+	return g;
 }
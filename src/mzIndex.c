@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <math.h>
+#include "mzIndex.h"
+
+struct mzPos {
+  double mz;
+  size_t pos;
+  int scan;
+};
+
+// Order by m/z and, for identical m/z, by position (i.e. by scan and by the
+// order within the scan).
+static int compareMzPos(const void *a, const void *b) {
+  const struct mzPos *x = (const struct mzPos *) a;
+  const struct mzPos *y = (const struct mzPos *) b;
+  if (x->mz < y->mz) return(-1);
+  if (x->mz > y->mz) return(1);
+  if (x->pos < y->pos) return(-1);
+  return(x->pos > y->pos);
+}
+
+// m/z bin of value x; values outside of the m/z range of the index are put
+// into the first or last bin.
+static int mzBin(const struct mzIndex *idx, double x) {
+  double b;
+  if (!(x > idx->mzmin))
+    return(0);
+  b = (x - idx->mzmin) / idx->binSize;
+  if (b >= idx->nbin - 1)
+    return(idx->nbin - 1);
+  return((int) b);
+}
+
+static void mzIndex_zero(struct mzIndex *idx) {
+  idx->nscan = 0;
+  idx->blockSize = 1;
+  idx->nblock = 0;
+  idx->nbin = 1;
+  idx->mzmin = 0;
+  idx->mzmax = 0;
+  idx->binSize = 1;
+  idx->npeak = 0;
+  idx->blockStart = NULL;
+  idx->binStart = NULL;
+  idx->mz = NULL;
+  idx->intensity = NULL;
+  idx->scan = NULL;
+}
+
+// Builds the index for the nmz peaks (m/z and intensity) of nscan scans. The
+// peaks of scan s (1-based) are [scanindex[s - 1], scanindex[s]), those of the
+// last scan [scanindex[nscan - 1], nmz). Returns MZINDEX_OK on success; on
+// error the index does not have to be freed.
+int mzIndex_build(struct mzIndex *idx, const double *mz,
+		  const double *intensity, const int *scanindex, size_t nmz,
+		  int nscan, int blockSize, double binSize) {
+  size_t i, first, lo, hi, j, *cell;
+  int s, b, k, from, to;
+  double nbin;
+  struct mzPos *buf;
+
+  mzIndex_zero(idx);
+  if (nscan < 0 || blockSize < 1 || !(binSize > 0))
+    return(MZINDEX_ERR_ARGS);
+  for (s = 0; s < nscan; s++) {
+    if (scanindex[s] < 0 || (size_t) scanindex[s] > nmz ||
+	(s > 0 && scanindex[s] < scanindex[s - 1]))
+      return(MZINDEX_ERR_ARGS);
+  }
+  idx->nscan = nscan;
+  idx->blockSize = blockSize;
+  idx->nblock = (nscan + blockSize - 1) / blockSize;
+  first = nscan ? (size_t) scanindex[0] : nmz;
+  idx->npeak = nmz - first;
+  if (idx->npeak > 0) {
+    idx->mzmin = mz[first];
+    idx->mzmax = mz[first];
+    for (i = first; i < nmz; i++) {
+      if (mz[i] < idx->mzmin) idx->mzmin = mz[i];
+      if (mz[i] > idx->mzmax) idx->mzmax = mz[i];
+    }
+  }
+  // limit the size of the bin table
+  nbin = (idx->mzmax - idx->mzmin) / binSize + 1;
+  while ((double) idx->nblock * (nbin + 1) > MZINDEX_MAX_CELLS) {
+    binSize *= 2;
+    nbin = (idx->mzmax - idx->mzmin) / binSize + 1;
+  }
+  idx->binSize = binSize;
+  idx->nbin = (int) nbin;
+
+  idx->blockStart = (size_t *) malloc((idx->nblock + 1) * sizeof(size_t));
+  idx->binStart = (size_t *) malloc((size_t) idx->nblock * (idx->nbin + 1) *
+				    sizeof(size_t));
+  idx->mz = (double *) malloc((idx->npeak + 1) * sizeof(double));
+  idx->intensity = (double *) malloc((idx->npeak + 1) * sizeof(double));
+  idx->scan = (int *) malloc((idx->npeak + 1) * sizeof(int));
+  buf = (struct mzPos *) malloc((idx->npeak + 1) * sizeof(struct mzPos));
+  if (idx->blockStart == NULL || idx->binStart == NULL || idx->mz == NULL ||
+      idx->intensity == NULL || idx->scan == NULL || buf == NULL) {
+    free(buf);
+    mzIndex_free(idx);
+    return(MZINDEX_ERR_MEMORY);
+  }
+
+  for (b = 0; b < idx->nblock; b++) {
+    from = b * blockSize;
+    to = from + blockSize < nscan ? from + blockSize : nscan;
+    lo = scanindex[from];
+    hi = (to < nscan) ? (size_t) scanindex[to] : nmz;
+    idx->blockStart[b] = lo - first;
+    for (s = from; s < to; s++) {
+      j = (s + 1 < nscan) ? (size_t) scanindex[s + 1] : nmz;
+      for (i = scanindex[s]; i < j; i++) {
+	buf[i - first].mz = mz[i];
+	buf[i - first].pos = i;
+	buf[i - first].scan = s + 1;
+      }
+    }
+    qsort(buf + (lo - first), hi - lo, sizeof(struct mzPos), compareMzPos);
+    for (i = lo - first; i < hi - first; i++) {
+      idx->mz[i] = buf[i].mz;
+      idx->intensity[i] = intensity[buf[i].pos];
+      idx->scan[i] = buf[i].scan;
+    }
+    // offsets of the m/z bins
+    cell = idx->binStart + (size_t) b * (idx->nbin + 1);
+    j = lo - first;
+    for (k = 0; k < idx->nbin; k++) {
+      while (j < hi - first && mzBin(idx, idx->mz[j]) < k)
+	j++;
+      cell[k] = j;
+    }
+    cell[idx->nbin] = hi - first;
+  }
+  if (idx->nblock > 0)
+    idx->blockStart[idx->nblock] = idx->npeak;
+  free(buf);
+  return(MZINDEX_OK);
+}
+
+// Queries the peaks with an m/z in [mzmin, mzmax] of scans scmin to scmax
+// (1-based). For MZINDEX_SUM and MZINDEX_MAX the sum or maximum of their
+// intensities is stored in res[0] (0 if there are no such peaks), for
+// MZINDEX_EIC the sum per scan in res[0] to res[scmax - scmin]. The intensities
+// of a scan are summed in increasing m/z order, as in getEIC. Peaks with a
+// missing (NA or NaN) intensity are skipped. Returns the number of peaks in
+// the region (with an intensity).
+size_t mzIndex_query(const struct mzIndex *idx, double mzmin, double mzmax,
+		     int scmin, int scmax, int what, double *res) {
+  size_t lo, hi, mid, j, n = 0;
+  const size_t *cell;
+  int b, s, kf, kt, off = scmin;
+  double v;
+
+  if (what == MZINDEX_EIC) {
+    for (s = scmin; s <= scmax; s++)
+      res[s - off] = 0;
+  } else
+    res[0] = 0;
+  if (scmin < 1) scmin = 1;
+  if (scmax > idx->nscan) scmax = idx->nscan;
+  if (scmin > scmax || idx->npeak == 0 || !(mzmin <= mzmax) ||
+      mzmax < idx->mzmin || mzmin > idx->mzmax)
+    return(0);
+  kf = mzBin(idx, mzmin);
+  kt = mzBin(idx, mzmax);
+  for (b = (scmin - 1) / idx->blockSize; b <= (scmax - 1) / idx->blockSize;
+       b++) {
+    cell = idx->binStart + (size_t) b * (idx->nbin + 1);
+    lo = cell[kf];
+    hi = cell[kt + 1];
+    // first peak with m/z >= mzmin
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (idx->mz[mid] < mzmin)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    hi = cell[kt + 1];
+    for (j = lo; j < hi && idx->mz[j] <= mzmax; j++) {
+      s = idx->scan[j];
+      if (s < scmin || s > scmax)
+	continue;
+      v = idx->intensity[j];
+      if (isnan(v))
+	continue;
+      if (what == MZINDEX_EIC)
+	res[s - off] += v;
+      else if (what == MZINDEX_MAX) {
+	if (n == 0 || v > res[0])
+	  res[0] = v;
+      } else
+	res[0] += v;
+      n++;
+    }
+  }
+  return(n);
+}
+
+void mzIndex_free(struct mzIndex *idx) {
+  free(idx->blockStart);
+  free(idx->binStart);
+  free(idx->mz);
+  free(idx->intensity);
+  free(idx->scan);
+  mzIndex_zero(idx);
+}
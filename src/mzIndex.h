@@ -0,0 +1,68 @@
+/*
+ * Index of the peaks of one file for repeated (m/z range, scan range) queries.
+ *
+ * The scans are grouped into blocks of blockSize consecutive scans and the
+ * peaks of each block are stored sorted by m/z. For each block a table of
+ * offsets per m/z bin (of width binSize) allows to jump to the peaks of the
+ * queried m/z range, hence a query needs only one (short) binary search per
+ * block instead of one binary search per scan and the time is proportional
+ * to the number of blocks and peaks within the queried region.
+ *
+ * Plain C API without any calls to R. The index does not keep references to
+ * the input vectors and is read-only once built, i.e. it can be queried from
+ * several threads.
+ *
+ * Usage:
+ *   struct mzIndex idx;
+ *   if (mzIndex_build(&idx, mz, intensity, scanindex, nmz, nscan, 16, 1.0)
+ *       == MZINDEX_OK)
+ *     nhits = mzIndex_query(&idx, mzmin, mzmax, scmin, scmax, MZINDEX_SUM,
+ *                           &res);
+ *   mzIndex_free(&idx);
+ */
+#ifndef MZINDEX_H
+#define MZINDEX_H
+
+#include <stddef.h>
+
+// Status codes returned by mzIndex_build.
+#define MZINDEX_OK 0
+#define MZINDEX_ERR_MEMORY 1      // memory could not be allocated
+#define MZINDEX_ERR_ARGS 2        // invalid parameters
+
+// Maximal number of (block, m/z bin) cells; binSize is increased if needed.
+#define MZINDEX_MAX_CELLS 16777216
+
+// Type of query.
+#define MZINDEX_SUM 0             // sum of intensities in the region
+#define MZINDEX_MAX 1             // maximal intensity in the region
+#define MZINDEX_EIC 2             // sum of intensities per scan
+
+struct mzIndex {
+  int nscan;
+  int blockSize;
+  int nblock;
+  int nbin;
+  double mzmin;
+  double mzmax;
+  double binSize;
+  size_t npeak;
+  // peaks of block b are [blockStart[b], blockStart[b + 1]), sorted by m/z
+  size_t *blockStart;
+  // first peak of block b in m/z bin k: binStart[b * (nbin + 1) + k]
+  size_t *binStart;
+  double *mz;
+  double *intensity;
+  int *scan;                      // 1-based scan index of each peak
+};
+
+int mzIndex_build(struct mzIndex *idx, const double *mz,
+		  const double *intensity, const int *scanindex, size_t nmz,
+		  int nscan, int blockSize, double binSize);
+
+size_t mzIndex_query(const struct mzIndex *idx, double mzmin, double mzmax,
+		     int scmin, int scmax, int what, double *res);
+
+void mzIndex_free(struct mzIndex *idx);
+
+#endif
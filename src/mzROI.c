@@ -4,6 +4,11 @@
 #include <math.h>
 #include "R.h"
 #include "Rdefines.h"
+#include "mzROI_engine.h"
+#include "mzIndex.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #undef TRUE
 #define TRUE    1
@@ -12,422 +17,8 @@
 
 //#define DEBUG
 
-#define ROI_INIT_LENGTH  1000
-#define MZVAL_INIT_LENGTH 1000
-#define ROI_ALLOC_INC 1.5         // allocation increment
-#define MZVAL_ALLOC_INC 1.5       // allocation increment
 #define N_NAMES 7
 
-struct scanStruct
-{
-   double  mz;
-   double  intensity;
-};
-
-struct scanBuf
-{
-  struct scanStruct * thisScan;
-  double * nextScan;
-  unsigned int thisScanLength;
-  unsigned int nextScanLength;
-} scbuf;
-
-struct pickOptionsStruct
-{
-   unsigned int  minEntries;
-   unsigned int  minimumInt;
-   unsigned int  minimumIntValues;
-   float dev;
-} pickOptions;
-
-
-struct mzROIStruct {
-  double  mz;
-  double  mzmin;
-  double  mzmax;
-  unsigned int scmin;
-  unsigned int scmax;
-  unsigned int intensity;
-  unsigned int length;
-  unsigned int kI;
-  unsigned char deleteMe;
-};
-
-struct mzLengthStruct {
-  unsigned int mzval;
-  unsigned int mzvalTotal;
-  unsigned int mzROI;
-  unsigned int mzROITotal;
-} mzLength;
-
-
-struct mzROIStruct * checkmzROIBufSize(struct mzROIStruct *mzROI, const unsigned int newmzROILength, struct mzLengthStruct *mzLength){
-  unsigned int newLength=0;
-
-  if (newmzROILength > mzLength->mzROITotal) {
-    newLength= mzLength->mzROITotal * ROI_ALLOC_INC;
-
-    if (newmzROILength > newLength)
-        newLength= newmzROILength;
-
-#ifdef DEBUG
-    Rprintf("realloc mzROI \n");
-#endif
-
-    mzROI = (struct mzROIStruct *) realloc(mzROI, newLength * sizeof(struct mzROIStruct));
-    if (mzROI == NULL)
-        error("findmzROI/realloc: buffer memory could not be allocated ! (%d bytes)\n", newLength * sizeof(struct mzROIStruct) );
-
-    mzLength->mzROITotal = newLength;
-  }
-  return(mzROI);
-}
-
-
-struct mzROIStruct * checkmzvalBufSize(struct mzROIStruct *mzval, const unsigned int newmzvalLength, struct mzLengthStruct *mzLength) {
-  unsigned int newLength=0;
-
-  if (newmzvalLength > mzLength->mzvalTotal) {
-     newLength= mzLength->mzvalTotal * MZVAL_ALLOC_INC;
-
-    if (newmzvalLength >  newLength)
-       newLength= newmzvalLength;
-
-#ifdef DEBUG
-       Rprintf("realloc mzval \n");
-#endif
-
-    mzval = (struct mzROIStruct *) realloc(mzval, newLength * sizeof(struct mzROIStruct));
-    if (mzval == NULL)
-      error("findmzROI/realloc: buffer memory could not be allocated ! (%d bytes)\n", newLength * sizeof(struct mzROIStruct));
-
-    mzLength->mzvalTotal = newLength;
-  }
-  return(mzval);
-}
-
-int lower_bound(double val,struct mzROIStruct *mzval,int first, int length){
-int half,mid;  // mzval->mz[first]
-  while (length > 0) {
-    half = length >> 1;
-    mid = first;
-    mid += half;
-    if ( mzval[mid].mz < val){
-      first = mid;
-      first ++;
-      length = length - half -1;
-    }
-    else length = half;
-  }
-  return(first);
-}
-
-int upper_bound(double val,struct mzROIStruct *mzval,int first, int length){
-int half,mid;
-  while (length > 0) {
-    half = length >> 1;
-    mid = first;
-    mid += half;
-    if (val < mzval[mid].mz){
-      length = half;
-    }
-    else {
-      first = mid;
-      first ++;
-      length = length - half -1;
-    }
-  }
-  return(first);
-}
-
-int lowerBound(double val,double *mzval,int first, int length){
-int half,mid;
-  while (length > 0) {
-    half = length >> 1;
-    mid = first;
-    mid += half;
-    if ( mzval[mid] < val){
-      first = mid;
-      first ++;
-      length = length - half -1;
-    }
-    else length = half;
-  }
-  return(first);
-}
-
-int upperBound(double val,double *mzval,int first, int length){
-int half,mid;
-  while (length > 0) {
-    half = length >> 1;
-    mid = first;
-    mid += half;
-    if (val < mzval[mid]){
-      length = half;
-    }
-    else {
-      first = mid;
-      first ++;
-      length = length - half -1;
-    }
-  }
-  return(first);
-}
-
-// Passes the m/z of an input spectrum (fMass) and checks if that m/z is
-// close enough to an existing mzROI to enable inclusion (depending on the
-// user defined ppm: difference mean m/z of ROI to fMass <= ppm * fMass / 1e6)
-// otherwise a new mzROI is defined for fMass.
-struct mzROIStruct * insertpeak(const double fMass, const double fInten,
-				struct scanBuf * scanbuf, const int scan,
-				const int LastScan, struct mzROIStruct *mzval,
-				struct mzLengthStruct *mzLength,
-				struct pickOptionsStruct *pickOptions)
-{
-  int i,wasfound = FALSE;
-  double ddev = (pickOptions->dev * fMass);
-  int lpos = lower_bound( fMass - ddev,mzval,0,mzLength->mzval);
-  int hpos = upper_bound( fMass + ddev,mzval,lpos,mzLength->mzval - lpos);
-  
-  if (lpos >  mzLength->mzval-1)
-      lpos = mzLength->mzval -1;
-  if (hpos >  mzLength->mzval-1)
-      hpos = mzLength->mzval -1 ;
-
-  // loop through mz ROIs for which the m/z could be close to fMass
-  for (i = lpos; i <= hpos; i++)
-  {
-    // check difference between fMass and the mz of the current ROI
-    double ddiff = fabs(mzval[i].mz - fMass);
-
-    if (ddiff <= ddev)
-    { // match (smaller than defined ppm) -> extend this ROI
-          if ( (i > hpos) || (i<lpos) ) error("! scan: %d \n",scan);
-          wasfound = TRUE;
-          //recursive m/z mean update
-          mzval[i].mz = ((mzval[i].length * mzval[i].mz) + fMass) / (mzval[i].length + 1);
-          if (fMass < mzval[i].mzmin)
-              mzval[i].mzmin = fMass;
-          if (fMass > mzval[i].mzmax)
-              mzval[i].mzmax = fMass;
-          mzval[i].scmax = scan;
-          mzval[i].length++;
-          mzval[i].intensity+=fInten;
-          if (fInten >= pickOptions->minimumInt)
-              mzval[i].kI++;
-    }
-  } // for
-  
-  // if not found
-  if (wasfound == FALSE) {  // no, create new ROI for mz
-    
-    lpos=-1;hpos=-1;
-    int doInsert=FALSE;
-    if ((scan < LastScan) && (scanbuf->nextScanLength > 0)) {// check next scan
-      int lpos = lowerBound( fMass - ddev,scanbuf->nextScan,0,scanbuf->nextScanLength);
-      int hpos = upperBound( fMass + ddev,scanbuf->nextScan,lpos,scanbuf->nextScanLength - lpos);
-      if (lpos < scanbuf->nextScanLength) {
-          for (i=lpos; i <= hpos; i++) //
-	    {
-	      ddev = (pickOptions->dev *  scanbuf->nextScan[i]);
-	      double ddiff = fabs(fMass - scanbuf->nextScan[i]);
-	      
-	      if (ddiff <= ddev)
-		{
-		  doInsert=TRUE;
-		  break;
-		}
-	    }
-      }
-    } else
-      doInsert=TRUE;
-    
-    if (doInsert == TRUE) {
-      // get pos. for insert
-      int i = lower_bound(fMass,mzval,0,mzLength->mzval);
-      // check buffer size
-      mzval=checkmzvalBufSize(mzval, mzLength->mzval + 1, mzLength);
-      // elements to move
-      int n = mzLength->mzval - i;
-      // insert element
-      if (n>0)
-	memmove(mzval + i +1, mzval + i, n*sizeof(struct mzROIStruct));
-      
-      mzval[i].mz = fMass;
-      mzval[i].mzmin = fMass;
-      mzval[i].mzmax = fMass;
-      mzval[i].intensity = fInten;
-      mzval[i].scmin = scan;
-      mzval[i].scmax = scan;
-      mzval[i].length = 1;
-      if (fInten >= pickOptions->minimumInt)
-	mzval[i].kI = 1; else
-	mzval[i].kI = 0;
-      mzval[i].deleteMe = FALSE;
-      
-      mzLength->mzval++;
-    }
-  }
-  
-  return(mzval);
-}
-
-struct mzROIStruct * cleanup(const int ctScan, struct mzROIStruct *mzROI, struct mzROIStruct *mzval, struct mzLengthStruct *mzLength, int *scerr, struct pickOptionsStruct *pickOptions){
-int i,p,del=0;
-
- // check all peaks in mzval
- for (i=0; i < mzLength->mzval; i++) {
-    unsigned int lastscan=mzval[i].scmax;
-    unsigned int entries=mzval[i].length;
-
-    // finished (entries >= minEntries)  or just extended
-    if ((entries >= pickOptions->minEntries) || (lastscan == ctScan)) // good feature
-    { // is it finished ?
-      if ((entries >= pickOptions->minEntries) && (lastscan < ctScan)) { //it's is not extended anymore
-        if (mzval[i].kI >= pickOptions->minimumIntValues) {
-             // copy values to set of completed ROI's
-             p=mzLength->mzROI;
-             mzROI=checkmzROIBufSize(mzROI, p+1 , mzLength);
-             mzROI[p].mz = mzval[i].mz;
-             mzROI[p].mzmin = mzval[i].mzmin;
-             mzROI[p].mzmax = mzval[i].mzmax;
-             mzROI[p].scmin = mzval[i].scmin;
-             mzROI[p].scmax = mzval[i].scmax;
-             mzROI[p].length =  mzval[i].length;
-             mzROI[p].kI =  mzval[i].kI;
-             mzROI[p].intensity =  mzval[i].intensity;
-
-             mzLength->mzROI++;
-             mzval[i].deleteMe=TRUE;
-             del++;
-            }
-        else {
-             mzval[i].deleteMe=TRUE;
-             del++;
-             }
-      }
-      else {
-        //continue
-      }
-        if (entries > ctScan) {
-            #ifdef DEBUG
-                error("Warning : entries > ctScan (is this centroid data ?) i: %d m: %3.4f  %d entries, lastscan %d   (ctScan=%d)\n",i,mzval[i].mz,mzval[i].length,lastscan,ctScan);
-            #endif
-          (*scerr)++;
-        }
-    }
-    else
-    {
-        mzval[i].deleteMe=TRUE;
-        del++;
-    }
-
- } // for i
-
- if (del > 0) {
-    p=0;
-    struct mzROIStruct * tmp = (struct mzROIStruct *) calloc(mzLength->mzval - del,  sizeof(struct mzROIStruct));
-    if (tmp == NULL)
-      error("findmzROI/cleanup: buffer memory could not be allocated ! (%d bytes)\n", (mzLength->mzval - del) * sizeof(struct mzROIStruct));
-    for (i=0; i < mzLength->mzval; i++) {
-        if (mzval[i].deleteMe == FALSE) {
-            tmp[p].mz = mzval[i].mz;
-            tmp[p].mzmin = mzval[i].mzmin;
-            tmp[p].mzmax = mzval[i].mzmax;
-            tmp[p].scmin = mzval[i].scmin;
-            tmp[p].scmax = mzval[i].scmax;
-            tmp[p].length =  mzval[i].length;
-            tmp[p].kI =  mzval[i].kI;
-            tmp[p].intensity =  mzval[i].intensity;
-            tmp[p].deleteMe = FALSE;
-
-            p++;
-        }
-    }
-    for (i=0; i < p; i++) {
-        mzval[i].mz = tmp[i].mz;
-        mzval[i].mzmin =  tmp[i].mzmin;
-        mzval[i].mzmax =  tmp[i].mzmax;
-        mzval[i].scmin =  tmp[i].scmin;
-        mzval[i].scmax =  tmp[i].scmax;
-        mzval[i].length = tmp[i].length;
-        mzval[i].kI =     tmp[i].kI;
-        mzval[i].intensity = tmp[i].intensity;
-        mzval[i].deleteMe = FALSE;
-    }
-
-    mzLength->mzval = p;
-    free(tmp);
- }
-
- return(mzROI);
-}
-
-struct scanBuf * getScan(int scan, double *pmz, double *pintensity, int *pscanindex,int nmz, int lastScan, struct scanBuf *scanbuf) {
-    int idx,idx1,idx2,i=0,N=0;
-    idx1 =  pscanindex[scan -1] +1;
-
-    if (scanbuf->thisScan != NULL)
-        free(scanbuf->thisScan);
-
-    if (scan == lastScan)
-        idx2 =  nmz-1;  else
-             idx2 =  pscanindex[scan];
-
-    N=idx2 - idx1 + 1;
-    if (N > 0) {
-        scanbuf->thisScan= (struct scanStruct  *) calloc(N, sizeof(struct scanStruct));
-        // scanbuf->thisScan= (struct scanStruct  *) malloc(N * sizeof(struct scanStruct));
-        if (scanbuf->thisScan == NULL)
-            error("findmzROI/getThisScan: Memory could not be allocated (%d * %d) !\n",N , sizeof(struct scanStruct));
-
-        scanbuf->thisScanLength=N;
-
-        for (idx=idx1;idx <= idx2; idx++)
-        {
-          scanbuf->thisScan[i].mz       = pmz[idx-1];
-          scanbuf->thisScan[i].intensity = pintensity[idx-1];
-          i++;
-        }
-    } else
-    {
-        scanbuf->thisScan = NULL;
-        scanbuf->thisScanLength= 0;
-    }
-
-  //  also get  the m/z values of the following scan
-    if (scan < lastScan) {
-        scan++;
-        i=0;N=0;
-        idx1 =  pscanindex[scan -1] +1;
-        if ((scanbuf->nextScan != NULL))
-            free(scanbuf->nextScan);
-
-        if (scan == lastScan)
-            idx2 =  nmz-1;   else
-                idx2 =  pscanindex[scan];
-
-        N=idx2 - idx1 + 1;
-        if (N > 0) {
-            scanbuf->nextScan= (double *) calloc(N, sizeof(double));
-            if (scanbuf->nextScan == NULL)
-                error("findmzROI/getNextScan: Memory could not be allocated (%d * %d) !\n",N , sizeof(struct scanStruct));
-            scanbuf->nextScanLength=N;
-
-            for (idx=idx1;idx <= idx2; idx++)
-            {
-                scanbuf->nextScan[i]      = pmz[idx-1];
-                i++;
-            }
-        } else
-        {
-            scanbuf->nextScan = NULL;
-            scanbuf->nextScanLength= 0;
-        }
-    }
-  return(scanbuf);
-}
-
 double getScanEIC(int scan, double from, double to, double *pmz, double *pintensity, int *pscanindex,int nmz, int lastScan) {
   int idx,idx1,idx2;
   double sum=0.0;
@@ -545,105 +136,298 @@ SEXP getMZ(SEXP mz, SEXP intensity, SEXP scanindex, SEXP mzrange, SEXP scanrange
   return(res);
 }
 
-SEXP findmzROI(SEXP mz, SEXP intensity, SEXP scanindex, SEXP mzrange,
-	       SEXP scanrange, SEXP lastscan, SEXP dev, SEXP minEntries,
-	       SEXP prefilter, SEXP noise) {
-  //jo double *pmz, *pintensity, mzrangeFrom,mzrangeTo;
-  double *pmz, *pintensity;
-  int i,*pscanindex, scanrangeFrom, scanrangeTo, ctScan, nmz, lastScan, inoise;
-  int scerr = 0;  // count of peak insertion errors, due to missing/bad centroidisation
-  int perc, lp = -1;
-  SEXP peaklist,entrylist,list_names,vmz,vmzmin,vmzmax,vscmin,vscmax,vlength,vintensity;
+// First index >= from (and < end) with pmz[index] > val.
+static int firstGreater(double val, double *pmz, int from, int end) {
+  while ((from < end) && (pmz[from] <= val))
+    from++;
+  return(from);
+}
+
+// Extracts the EICs (summed intensities per scan) and the mean m/z traces of
+// several ROIs (mass ranges) in one pass. The ROIs are processed sorted by
+// their lower m/z. For each scan a cursor is kept which points to the first
+// peak with an m/z >= the lower m/z of the current ROI. Since the cursor can
+// only advance, each spectrum is traversed only once for all ROIs instead of
+// performing binary searches for each ROI and scan. The values are identical
+// to those from getEIC and getMZ (including the handling of the last scan).
+// mzmin, mzmax: m/z range of each ROI.
+// eicFrom, eicTo: scan range for the EIC of each ROI.
+// mzFrom, mzTo: scan range for the mean m/z trace of each ROI; if of length
+//               0 no m/z traces are extracted.
+// Returns a list with elements "intensity" and "mz" with a numeric vector for
+// each ROI (in the input order).
+SEXP getEICs(SEXP mz, SEXP intensity, SEXP scanindex, SEXP mzmin, SEXP mzmax,
+	     SEXP eicFrom, SEXP eicTo, SEXP mzFrom, SEXP mzTo, SEXP lastscan) {
+  double *pmz, *pintensity, *pmzmin, *pmzmax, *sortmz, *p_vint, *p_vmz;
+  double from, to, sum;
+  int *pscanindex, *peicFrom, *peicTo, *pmzFrom = NULL, *pmzTo = NULL;
+  int *order, *cursor;
+  int i, r, s, idx, idx2, start, end, lb, ub, len, pc;
+  int nmz, nroi, ilastScan, withMz, scFrom, scTo;
+  SEXP reslist, list_names, veics, vmzs, vint, vmz;
 
   pmz = REAL(mz);
   nmz = GET_LENGTH(mz);
   pintensity = REAL(intensity);
   pscanindex = INTEGER(scanindex);
-  lastScan = INTEGER(lastscan)[0];
-  inoise = INTEGER(noise)[0];
+  pmzmin = REAL(mzmin);
+  pmzmax = REAL(mzmax);
+  peicFrom = INTEGER(eicFrom);
+  peicTo = INTEGER(eicTo);
+  nroi = GET_LENGTH(mzmin);
+  withMz = GET_LENGTH(mzFrom) > 0;
+  if (withMz) {
+    pmzFrom = INTEGER(mzFrom);
+    pmzTo = INTEGER(mzTo);
+  }
+  ilastScan = INTEGER(lastscan)[0];
+  if ((GET_LENGTH(mzmax) != nroi) || (GET_LENGTH(eicFrom) != nroi) ||
+      (GET_LENGTH(eicTo) != nroi) ||
+      (withMz && ((GET_LENGTH(mzFrom) != nroi) || (GET_LENGTH(mzTo) != nroi))))
+    error("getEICs: lengths of the ROI ranges have to match\n");
+  for (r = 0; r < nroi; r++) {
+    if ((peicFrom[r] < 1) || (peicTo[r] > ilastScan) ||
+	(peicFrom[r] > peicTo[r]))
+      error("Error in scanrange \n");
+    if (withMz && ((pmzFrom[r] < 1) || (pmzTo[r] > ilastScan) ||
+		   (pmzFrom[r] > pmzTo[r])))
+      error("Error in scanrange \n");
+  }
 
-  pickOptions.dev = REAL(dev)[0];
-  pickOptions.minEntries = INTEGER(minEntries)[0];
-  pickOptions.minimumIntValues=INTEGER(prefilter)[0];
-  pickOptions.minimumInt=INTEGER(prefilter)[1];
+  // process ROIs ordered by mzmin
+  order = (int *) R_alloc(nroi, sizeof(int));
+  sortmz = (double *) R_alloc(nroi, sizeof(double));
+  for (r = 0; r < nroi; r++) {
+    order[r] = r;
+    sortmz[r] = pmzmin[r];
+  }
+  rsort_with_index(sortmz, order, nroi);
+  // cursor[s - 1]: first peak of scan s with m/z >= mzmin of the current ROI
+  cursor = (int *) R_alloc(ilastScan, sizeof(int));
+  for (s = 0; s < ilastScan; s++)
+    cursor[s] = pscanindex[s];
 
-  //jo mzrangeFrom = REAL(mzrange)[0];
-  //jo mzrangeTo =  REAL(mzrange)[1];
-  scanrangeFrom = INTEGER(scanrange)[0];
-  scanrangeTo = INTEGER(scanrange)[1];
+  char *names[2] = {"intensity", "mz"};
+  PROTECT(list_names = allocVector(STRSXP, 2));
+  for(i = 0; i < 2; i++)
+    SET_STRING_ELT(list_names, i,  mkChar(names[i]));
+  PROTECT(reslist = allocVector(VECSXP, 2));
+  PROTECT(veics = allocVector(VECSXP, nroi));
+  PROTECT(vmzs = allocVector(VECSXP, withMz ? nroi : 0));
+
+  for (i = 0; i < nroi; i++) {
+    r = order[i];
+    from = pmzmin[r];
+    to = pmzmax[r];
+    PROTECT(vint = NEW_NUMERIC(peicTo[r] - peicFrom[r] + 1));
+    p_vint = NUMERIC_POINTER(vint);
+    SET_VECTOR_ELT(veics, r, vint);
+    UNPROTECT(1);
+    scFrom = peicFrom[r];
+    scTo = peicTo[r];
+    p_vmz = NULL;
+    if (withMz) {
+      PROTECT(vmz = NEW_NUMERIC(pmzTo[r] - pmzFrom[r] + 1));
+      p_vmz = NUMERIC_POINTER(vmz);
+      SET_VECTOR_ELT(vmzs, r, vmz);
+      UNPROTECT(1);
+      if (pmzFrom[r] < scFrom) scFrom = pmzFrom[r];
+      if (pmzTo[r] > scTo) scTo = pmzTo[r];
+    }
+    for (s = scFrom; s <= scTo; s++) {
+      // peaks of the scan are [start, end)
+      start = pscanindex[s - 1];
+      end = (s == ilastScan) ? nmz : pscanindex[s];
+      while ((cursor[s - 1] < end) && (pmz[cursor[s - 1]] < from))
+	cursor[s - 1]++;
+      // getScanEIC ignores the last peak of the last scan
+      idx2 = (s == ilastScan) ? nmz - 1 : end;
+      if ((s >= peicFrom[r]) && (s <= peicTo[r])) {
+	// same range as lowerBound/upperBound in getScanEIC
+	len = idx2 - start - 1;
+	if (len <= 0) lb = start;
+	else lb = (cursor[s - 1] < start + len) ? cursor[s - 1] : start + len;
+	len = idx2 - lb;
+	ub = (len > 0) ? firstGreater(to, pmz, lb, lb + len) : lb;
+	sum = 0.0;
+	for (idx = lb; idx <= ub; idx++) {
+	  if (idx < 1) continue;
+	  if ((pmz[idx - 1] <= to) && (pmz[idx - 1] >= from))
+	    sum += pintensity[idx - 1];
+	}
+	p_vint[s - peicFrom[r]] = sum;
+      }
+      if (withMz && (s >= pmzFrom[r]) && (s <= pmzTo[r])) {
+	// same range as lowerBound/upperBound in getMZ
+	len = idx2 - start - 2;
+	if (len <= 0) lb = start;
+	else lb = (cursor[s - 1] < start + len) ? cursor[s - 1] : start + len;
+	len = idx2 - lb - 1;
+	ub = (len > 0) ? firstGreater(to, pmz, lb, lb + len) : lb;
+	pc = 0;
+	p_vmz[s - pmzFrom[r]] = 0;
+	for (idx = lb; idx <= ub && idx < nmz; idx++) {
+	  if ((pmz[idx] <= to) && (pmz[idx] >= from)) {
+	    if (pc == 0)
+	      p_vmz[s - pmzFrom[r]] = pmz[idx];
+	    else
+	      p_vmz[s - pmzFrom[r]] = ((pc * p_vmz[s - pmzFrom[r]]) + pmz[idx]) / (pc + 1);
+	    pc++;
+	  }
+	}
+      }
+    }
+  }
 
-  struct mzROIStruct * mzROI = (struct mzROIStruct *) calloc(ROI_INIT_LENGTH,  sizeof(struct mzROIStruct));
-  if (mzROI == NULL)
-      error("findmzROI/calloc: buffer memory could not be allocated ! (%d bytes)\n",ROI_INIT_LENGTH  * sizeof(struct mzROIStruct) );
+  SET_VECTOR_ELT(reslist, 0, veics);
+  SET_VECTOR_ELT(reslist, 1, vmzs);
+  setAttrib(reslist, R_NamesSymbol, list_names);
 
-  struct mzROIStruct * mzval = (struct mzROIStruct *) calloc(MZVAL_INIT_LENGTH,  sizeof(struct mzROIStruct));
-  if (mzval == NULL)
-      error("findmzROI/calloc: buffer memory could not be allocated ! (%d bytes)\n",MZVAL_INIT_LENGTH  * sizeof(struct mzROIStruct) );
+  UNPROTECT(4);
+  return(reslist);
+}
 
-  mzLength.mzvalTotal = MZVAL_INIT_LENGTH;
-  mzLength.mzROITotal = ROI_INIT_LENGTH;
-  mzLength.mzval = 0;
-  mzLength.mzROI = 0;
+static void mzIndex_finalize(SEXP ptr) {
+  struct mzIndex *idx = (struct mzIndex *) R_ExternalPtrAddr(ptr);
+  if (idx != NULL) {
+    mzIndex_free(idx);
+    free(idx);
+    R_ClearExternalPtr(ptr);
+  }
+}
 
-  struct scanBuf * scanbuf = &scbuf;
-  scanbuf->thisScan = NULL;
-  scanbuf->nextScan = NULL;
-  scanbuf->thisScanLength = 0;
-  scanbuf->nextScanLength = 0;
+static struct mzIndex *mzIndex_get(SEXP ptr) {
+  struct mzIndex *idx = NULL;
+  if (TYPEOF(ptr) == EXTPTRSXP)
+    idx = (struct mzIndex *) R_ExternalPtrAddr(ptr);
+  if (idx == NULL)
+    error("queryMzIndex: invalid index; indices can not be serialized and have to be re-created with .mz_index\n");
+  return(idx);
+}
 
-  char *names[N_NAMES] = {"mz", "mzmin", "mzmax", "scmin", "scmax", "length", "intensity"};
-  PROTECT(list_names = allocVector(STRSXP, N_NAMES));
-  for(i = 0; i < N_NAMES; i++)
-    SET_STRING_ELT(list_names, i,  mkChar(names[i]));
+// Builds the index (struct mzIndex) for the peaks of one file and returns it
+// as an external pointer, freed by the garbage collector.
+SEXP buildMzIndex(SEXP mz, SEXP intensity, SEXP scanindex, SEXP blockSize,
+		  SEXP binSize) {
+  struct mzIndex *idx;
+  SEXP res;
+  int status;
+
+  if (GET_LENGTH(intensity) != GET_LENGTH(mz))
+    error("buildMzIndex: lengths of 'mz' and 'intensity' differ\n");
+  idx = (struct mzIndex *) malloc(sizeof(struct mzIndex));
+  if (idx == NULL)
+    error("buildMzIndex: memory could not be allocated!\n");
+  status = mzIndex_build(idx, REAL(mz), REAL(intensity), INTEGER(scanindex),
+			 GET_LENGTH(mz), GET_LENGTH(scanindex),
+			 INTEGER(blockSize)[0], REAL(binSize)[0]);
+  if (status != MZINDEX_OK) {
+    free(idx);
+    if (status == MZINDEX_ERR_MEMORY)
+      error("buildMzIndex: memory could not be allocated!\n");
+    error("buildMzIndex: invalid 'scanindex', 'blockSize' or 'binSize'\n");
+  }
+  PROTECT(res = R_MakeExternalPtr(idx, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(res, mzIndex_finalize, TRUE);
+  UNPROTECT(1);
+  return(res);
+}
 
-  Rprintf(" %% finished: ");
-  // loop through scans/spectra
-  for (ctScan=scanrangeFrom;ctScan<=scanrangeTo;ctScan++)
-  {
-     perc = (int) (ctScan* 100)/scanrangeTo;
-     if ((perc % 10) == 0 && (perc != lp))
-     {
-       Rprintf("%d ",perc);
-       lp = perc;
-     }
-    scanbuf=getScan(ctScan, pmz, pintensity, pscanindex,nmz,lastScan, scanbuf);
-
-    if (scanbuf->thisScanLength > 0)
-    {
-        #ifdef DEBUG
-         Rprintf("ScanLength %d ",scanbuf->thisScanLength);
-         Rprintf("Scan Nr. %d of %d (%d %%) %d peaks -- working at %d m/z ROI's, %d ROI's completed.\n", ctScan, scanrangeTo,  (int)100.0*ctScan/scanrangeTo,scanbuf->thisScanLength,mzLength.mzval,mzLength.mzROI);
-        #endif
-
-      int p;
-      double fMass,lastMass=-1;
-      double fInten;
-
-      // loop through m/z values of the current scan.
-      for (p=0;p < scanbuf->thisScanLength;p++)
-        {
-          fMass  = scanbuf->thisScan[p].mz;
-          fInten = scanbuf->thisScan[p].intensity;
+// Queries an index created by buildMzIndex for several regions (m/z range and
+// scan range). what: 0 sum, 1 maximum (NA if there are no peaks in the
+// region) of the intensities in each region (returns a numeric vector), 2
+// sum of intensities per scan (returns a list with one numeric vector per
+// region, i.e. the EIC).
+SEXP queryMzIndex(SEXP index, SEXP mzmin, SEXP mzmax, SEXP scmin, SEXP scmax,
+		  SEXP what) {
+  struct mzIndex *idx = mzIndex_get(index);
+  double *pmzmin = REAL(mzmin), *pmzmax = REAL(mzmax), *pres = NULL;
+  int *pscmin = INTEGER(scmin), *pscmax = INTEGER(scmax);
+  int r, n = GET_LENGTH(mzmin), type = INTEGER(what)[0];
+  size_t nhits;
+  SEXP res, vint;
+
+  if ((GET_LENGTH(mzmax) != n) || (GET_LENGTH(scmin) != n) ||
+      (GET_LENGTH(scmax) != n))
+    error("queryMzIndex: lengths of the ranges have to match\n");
+  for (r = 0; r < n; r++) {
+    if ((pscmin[r] < 1) || (pscmax[r] > idx->nscan) || (pscmin[r] > pscmax[r]))
+      error("Error in scanrange \n");
+  }
+  if (type == MZINDEX_EIC) {
+    PROTECT(res = allocVector(VECSXP, n));
+    for (r = 0; r < n; r++) {
+      PROTECT(vint = NEW_NUMERIC(pscmax[r] - pscmin[r] + 1));
+      mzIndex_query(idx, pmzmin[r], pmzmax[r], pscmin[r], pscmax[r], type,
+		    NUMERIC_POINTER(vint));
+      SET_VECTOR_ELT(res, r, vint);
+      UNPROTECT(1);
+    }
+  } else {
+    PROTECT(res = NEW_NUMERIC(n));
+    pres = NUMERIC_POINTER(res);
+    for (r = 0; r < n; r++) {
+      nhits = mzIndex_query(idx, pmzmin[r], pmzmax[r], pscmin[r], pscmax[r],
+			    type, &pres[r]);
+      if (type == MZINDEX_MAX && nhits == 0)
+	pres[r] = NA_REAL;
+    }
+  }
+  UNPROTECT(1);
+  return(res);
+}
 
-          if (fMass < lastMass)
-            error("m/z sort assumption violated ! (scan %d, p %d, current %2.4f (I=%2.2f), last %2.4f) \n",ctScan,p,fMass,fInten,lastMass);
-          lastMass = fMass;
+// Reports the progress of the ROI detection.
+void mzROI_progress(int perc, void *data) {
+  (void) data;
+  Rprintf("%d ",perc);
+  R_FlushConsole();
+}
 
-          if (fInten > inoise)
-            mzval = insertpeak(fMass, fInten, scanbuf, ctScan, scanrangeTo,
-			       mzval, &mzLength, &pickOptions);
+// Throws an R error for a failed ROI detection and frees the context.
+void mzROI_error(struct mzROIContext *ctx, int file) {
+  struct mzROIContext err = *ctx;
+  mzROI_free(ctx);
+  if (file > 0)
+    Rprintf("findmzROI: failed for file %d\n", file);
+  switch (err.status) {
+  case MZROI_ERR_UNSORTED:
+    error("m/z sort assumption violated ! (scan %d, p %d, current %2.4f (I=%2.2f), last %2.4f) \n", err.errScan, err.errPeak, err.errMass, err.errInten, err.errLastMass);
+  case MZROI_ERR_MEMORY:
+    error("findmzROI: buffer memory could not be allocated !\n");
+  default:
+    error("findmzROI: unsupported ROI index type %d\n", err.roiIndex);
+  }
+}
 
-        }
-    }
-    mzROI=cleanup(ctScan,mzROI,mzval,&mzLength,&scerr,&pickOptions);
-    R_FlushConsole();
-  } //for ctScan
+// Adds the number of allocations as attribute "allocations" to res.
+void mzROI_set_allocations(SEXP res, struct mzROIContext *ctx) {
+  SEXP allocs,alloc_names;
+
+  PROTECT(allocs = NEW_INTEGER(2));
+  PROTECT(alloc_names = allocVector(STRSXP, 2));
+  INTEGER_POINTER(allocs)[0] = ctx->alloc.total;
+  INTEGER_POINTER(allocs)[1] = ctx->alloc.scans;
+  SET_STRING_ELT(alloc_names, 0, mkChar("total"));
+  SET_STRING_ELT(alloc_names, 1, mkChar("scans"));
+  setAttrib(allocs, R_NamesSymbol, alloc_names);
+  setAttrib(res, install("allocations"), allocs);
+  UNPROTECT(2);
+}
 
-  mzROI=cleanup(ctScan+1,mzROI,mzval,&mzLength,&scerr,&pickOptions);
+// Creates the R list of ROIs (one list per ROI) from the completed ROIs.
+SEXP mzROI_result_list(struct mzROIContext *ctx) {
+  int i;
+  SEXP peaklist,entrylist,list_names,vmz,vmzmin,vmzmax,vscmin,vscmax,vlength,vintensity;
+  struct mzROIStruct *mzROI = ctx->mzROI;
+
+  char *names[N_NAMES] = {"mz", "mzmin", "mzmax", "scmin", "scmax", "length", "intensity"};
+  PROTECT(list_names = allocVector(STRSXP, N_NAMES));
+  for(i = 0; i < N_NAMES; i++)
+    SET_STRING_ELT(list_names, i,  mkChar(names[i]));
 
-  PROTECT(peaklist = allocVector(VECSXP, mzLength.mzROI));
-  int total = 0;
-  for (i=0;i<mzLength.mzROI;i++) {
+  PROTECT(peaklist = allocVector(VECSXP, ctx->mzLength.mzROI));
+  for (i=0;i<ctx->mzLength.mzROI;i++) {
       PROTECT(entrylist = allocVector(VECSXP, N_NAMES));
 
       PROTECT(vmz = NEW_NUMERIC(1));
@@ -676,24 +460,213 @@ SEXP findmzROI(SEXP mz, SEXP intensity, SEXP scanindex, SEXP mzrange,
 
       SET_VECTOR_ELT(peaklist, i, entrylist);
       UNPROTECT(N_NAMES + 1); //entrylist + values
-      total++;
   }
 
-  if (scerr > 0) Rprintf("Warning: There were %d peak data insertion problems. \n Please try lowering the \"ppm\" parameter.\n", scerr);
-
-  Rprintf("\n %d m/z ROI's.\n", total);
+  mzROI_set_allocations(peaklist, ctx);
 
   UNPROTECT(2); // peaklist,list_names
+  return(peaklist);
+}
+
+// Creates a named list with one vector per field (mz, mzmin, mzmax, scmin,
+// scmax, length, intensity) from the completed ROIs. Requires only N_NAMES + 2
+// allocations independently of the number of ROIs.
+SEXP mzROI_result_columns(struct mzROIContext *ctx) {
+  int i, n = ctx->mzLength.mzROI;
+  SEXP res,list_names,vmz,vmzmin,vmzmax,vscmin,vscmax,vlength,vintensity;
+  double *pmz,*pmzmin,*pmzmax;
+  int *pscmin,*pscmax,*plength,*pintensity;
+  struct mzROIStruct *mzROI = ctx->mzROI;
+
+  char *names[N_NAMES] = {"mz", "mzmin", "mzmax", "scmin", "scmax", "length", "intensity"};
+  PROTECT(list_names = allocVector(STRSXP, N_NAMES));
+  for(i = 0; i < N_NAMES; i++)
+    SET_STRING_ELT(list_names, i,  mkChar(names[i]));
+
+  PROTECT(res = allocVector(VECSXP, N_NAMES));
+  SET_VECTOR_ELT(res, 0, vmz = NEW_NUMERIC(n));
+  SET_VECTOR_ELT(res, 1, vmzmin = NEW_NUMERIC(n));
+  SET_VECTOR_ELT(res, 2, vmzmax = NEW_NUMERIC(n));
+  SET_VECTOR_ELT(res, 3, vscmin = NEW_INTEGER(n));
+  SET_VECTOR_ELT(res, 4, vscmax = NEW_INTEGER(n));
+  SET_VECTOR_ELT(res, 5, vlength = NEW_INTEGER(n));
+  SET_VECTOR_ELT(res, 6, vintensity = NEW_INTEGER(n));
+  setAttrib(res, R_NamesSymbol, list_names);
+
+  pmz = NUMERIC_POINTER(vmz);
+  pmzmin = NUMERIC_POINTER(vmzmin);
+  pmzmax = NUMERIC_POINTER(vmzmax);
+  pscmin = INTEGER_POINTER(vscmin);
+  pscmax = INTEGER_POINTER(vscmax);
+  plength = INTEGER_POINTER(vlength);
+  pintensity = INTEGER_POINTER(vintensity);
+  for (i = 0; i < n; i++) {
+    pmz[i] = mzROI[i].mz;
+    pmzmin[i] = mzROI[i].mzmin;
+    pmzmax[i] = mzROI[i].mzmax;
+    pscmin[i] = mzROI[i].scmin;
+    pscmax[i] = mzROI[i].scmax;
+    plength[i] = mzROI[i].length;
+    pintensity[i] = mzROI[i].intensity;
+  }
+
+  mzROI_set_allocations(res, ctx);
+
+  UNPROTECT(2); // res,list_names
+  return(res);
+}
+
+SEXP mzROI_result(struct mzROIContext *ctx, int columnar) {
+  if (columnar)
+    return(mzROI_result_columns(ctx));
+  return(mzROI_result_list(ctx));
+}
+
+SEXP findmzROI(SEXP mz, SEXP intensity, SEXP scanindex, SEXP mzrange,
+	       SEXP scanrange, SEXP lastscan, SEXP dev, SEXP minEntries,
+	       SEXP prefilter, SEXP noise, SEXP roiIndex, SEXP columnar) {
+  struct mzROIContext ctx;
+  SEXP peaklist;
+
+  mzROI_init(&ctx, REAL(dev)[0], INTEGER(minEntries)[0],
+	     INTEGER(prefilter)[0], INTEGER(prefilter)[1],
+	     INTEGER(noise)[0], INTEGER(roiIndex)[0]);
+  ctx.progress = mzROI_progress;
+
+  //jo mzrangeFrom = REAL(mzrange)[0];
+  //jo mzrangeTo =  REAL(mzrange)[1];
+  Rprintf(" %% finished: ");
+  if (mzROI_find(&ctx, REAL(mz), REAL(intensity), INTEGER(scanindex),
+		 GET_LENGTH(mz), INTEGER(scanrange)[0],
+		 INTEGER(scanrange)[1], INTEGER(lastscan)[0]) != MZROI_OK)
+    mzROI_error(&ctx, 0);
 
- // free(ptpeakbuf);
+  PROTECT(peaklist = mzROI_result(&ctx, LOGICAL(columnar)[0]));
 
-  if (scanbuf->thisScan != NULL)
-    free(scanbuf->thisScan);
-  if (scanbuf->thisScan != NULL)
-    free(scanbuf->nextScan);
+  if (ctx.scerr > 0) Rprintf("Warning: There were %d peak data insertion problems. \n Please try lowering the \"ppm\" parameter.\n", ctx.scerr);
 
-  free(mzval);
-  free(mzROI);
+  Rprintf("\n %d m/z ROI's.\n", ctx.mzLength.mzROI);
+
+  mzROI_free(&ctx);
+  UNPROTECT(1);
 
   return(peaklist);
 }
+
+// The ROI detection contexts of findmzROI_multi, freed by the finalizer of
+// the external pointer if an R error occurs while creating the results.
+struct mzROIContexts {
+  int n;
+  struct mzROIContext *ctx;
+};
+
+static void mzROIContexts_free(SEXP ptr) {
+  struct mzROIContexts *ctxs = (struct mzROIContexts *) R_ExternalPtrAddr(ptr);
+  int i;
+  if (ctxs == NULL)
+    return;
+  for (i = 0; i < ctxs->n; i++)
+    mzROI_free(&ctxs->ctx[i]);
+  free(ctxs->ctx);
+  free(ctxs);
+  R_ClearExternalPtr(ptr);
+}
+
+// Runs the ROI detection on all spectra of several files in parallel threads.
+// mz, intensity and scanindex are lists with the values for each file. Returns
+// a list with the ROIs for each file (same as findmzROI).
+SEXP findmzROI_multi(SEXP mz, SEXP intensity, SEXP scanindex, SEXP dev,
+		     SEXP minEntries, SEXP prefilter, SEXP noise,
+		     SEXP roiIndex, SEXP nthreads, SEXP columnar) {
+  int i, nfiles = LENGTH(mz), failed = -1;
+  SEXP res, ptr;
+  struct mzROIContexts *ctxs;
+  struct mzROIContext *ctx, err;
+  double **pmz, **pintensity;
+  int **pscanindex, *nmz, *nscan;
+  double pdev;
+  int pminEntries, pminimumIntValues, pminimumInt, pnoise, proiIndex;
+  int pnthreads, pcolumnar;
+
+  if ((LENGTH(intensity) != nfiles) || (LENGTH(scanindex) != nfiles))
+    error("findmzROI_multi: lengths of 'mz', 'intensity' and 'scanindex' have to match\n");
+  pmz = (double **) R_alloc(nfiles, sizeof(double *));
+  pintensity = (double **) R_alloc(nfiles, sizeof(double *));
+  pscanindex = (int **) R_alloc(nfiles, sizeof(int *));
+  nmz = (int *) R_alloc(nfiles, sizeof(int));
+  nscan = (int *) R_alloc(nfiles, sizeof(int));
+  // get all pointers and parameters while in the main thread
+  for (i = 0; i < nfiles; i++) {
+    pmz[i] = REAL(VECTOR_ELT(mz, i));
+    pintensity[i] = REAL(VECTOR_ELT(intensity, i));
+    pscanindex[i] = INTEGER(VECTOR_ELT(scanindex, i));
+    nmz[i] = LENGTH(VECTOR_ELT(mz, i));
+    nscan[i] = LENGTH(VECTOR_ELT(scanindex, i));
+    if (LENGTH(VECTOR_ELT(intensity, i)) != nmz[i])
+      error("findmzROI_multi: lengths of 'mz' and 'intensity' differ for file %d\n", i + 1);
+  }
+  pdev = REAL(dev)[0];
+  pminEntries = INTEGER(minEntries)[0];
+  pminimumIntValues = INTEGER(prefilter)[0];
+  pminimumInt = INTEGER(prefilter)[1];
+  pnoise = INTEGER(noise)[0];
+  proiIndex = INTEGER(roiIndex)[0];
+  pnthreads = INTEGER(nthreads)[0];
+  pcolumnar = LOGICAL(columnar)[0];
+  if (pnthreads < 1 || pnthreads == NA_INTEGER)
+    pnthreads = 1;
+
+  ctxs = (struct mzROIContexts *) malloc(sizeof(struct mzROIContexts));
+  if (ctxs == NULL)
+    error("findmzROI: buffer memory could not be allocated !\n");
+  ctxs->n = nfiles;
+  ctxs->ctx = (struct mzROIContext *) calloc(nfiles > 0 ? nfiles : 1,
+					     sizeof(struct mzROIContext));
+  if (ctxs->ctx == NULL) {
+    free(ctxs);
+    error("findmzROI: buffer memory could not be allocated !\n");
+  }
+  ctx = ctxs->ctx;
+  PROTECT(ptr = R_MakeExternalPtr(ctxs, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, mzROIContexts_free, TRUE);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(pnthreads)
+#endif
+  for (i = 0; i < nfiles; i++) {
+    if (mzROI_init(&ctx[i], pdev, pminEntries, pminimumIntValues,
+		   pminimumInt, pnoise, proiIndex) == MZROI_OK &&
+	nscan[i] > 0)
+      mzROI_find(&ctx[i], pmz[i], pintensity[i], pscanindex[i], nmz[i],
+		 1, nscan[i], nscan[i]);
+  }
+
+  for (i = 0; i < nfiles; i++) {
+    if (ctx[i].status != MZROI_OK) {
+      failed = i;
+      break;
+    }
+  }
+  if (failed >= 0) {
+    // keep the failed context for the error message, mzROI_error frees it
+    err = ctx[failed];
+    for (i = 0; i < nfiles; i++)
+      if (i != failed)
+	mzROI_free(&ctx[i]);
+    free(ctx);
+    free(ctxs);
+    R_ClearExternalPtr(ptr);
+    UNPROTECT(1);
+    mzROI_error(&err, failed + 1);
+  }
+
+  // the contexts are freed by the finalizer if creating a result fails
+  PROTECT(res = allocVector(VECSXP, nfiles));
+  for (i = 0; i < nfiles; i++) {
+    SET_VECTOR_ELT(res, i, mzROI_result(&ctx[i], pcolumnar));
+    mzROI_free(&ctx[i]);
+  }
+  mzROIContexts_free(ptr);
+  UNPROTECT(2);
+  return(res);
+}
@@ -0,0 +1,755 @@
+/*
+ * ROI detection for centWave. See mzROI_engine.h for the API. Nothing in
+ * here calls R, all errors are reported with the status of the context.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mzROI_engine.h"
+
+#undef TRUE
+#define TRUE    1
+#undef FALSE
+#define FALSE    0
+
+void * mzROI_realloc(struct mzROIContext *ctx, void *buf, size_t size) {
+  void *res = realloc(buf, size);
+  if (res == NULL)
+    ctx->status = MZROI_ERR_MEMORY;
+  ctx->alloc.total++;
+  return(res);
+}
+
+void * mzROI_calloc(struct mzROIContext *ctx, size_t n, size_t size) {
+  void *res = calloc(n, size);
+  if (res == NULL)
+    ctx->status = MZROI_ERR_MEMORY;
+  ctx->alloc.total++;
+  return(res);
+}
+
+int checkmzROIBufSize(struct mzROIContext *ctx, const unsigned int newmzROILength){
+  unsigned int newLength=0;
+  struct mzLengthStruct *mzLength = &ctx->mzLength;
+
+  if (newmzROILength > mzLength->mzROITotal) {
+    newLength= mzLength->mzROITotal * ROI_ALLOC_INC;
+
+    if (newmzROILength > newLength)
+        newLength= newmzROILength;
+
+    struct mzROIStruct *mzROI = (struct mzROIStruct *) mzROI_realloc(ctx, ctx->mzROI, newLength * sizeof(struct mzROIStruct));
+    if (mzROI == NULL)
+      return(ctx->status);
+    ctx->mzROI = mzROI;
+    mzLength->mzROITotal = newLength;
+  }
+  return(MZROI_OK);
+}
+
+int checkmzvalBufSize(struct mzROIContext *ctx, const unsigned int newmzvalLength) {
+  unsigned int newLength=0;
+  struct mzLengthStruct *mzLength = &ctx->mzLength;
+
+  if (newmzvalLength > mzLength->mzvalTotal) {
+     newLength= mzLength->mzvalTotal * MZVAL_ALLOC_INC;
+
+    if (newmzvalLength >  newLength)
+       newLength= newmzvalLength;
+
+    struct mzROIStruct *mzval = (struct mzROIStruct *) mzROI_realloc(ctx, ctx->mzval, newLength * sizeof(struct mzROIStruct));
+    if (mzval == NULL)
+      return(ctx->status);
+    ctx->mzval = mzval;
+    mzLength->mzvalTotal = newLength;
+  }
+  return(MZROI_OK);
+}
+
+int lower_bound(double val,struct mzROIStruct *mzval,int first, int length){
+int half,mid;  // mzval->mz[first]
+  while (length > 0) {
+    half = length >> 1;
+    mid = first;
+    mid += half;
+    if ( mzval[mid].mz < val){
+      first = mid;
+      first ++;
+      length = length - half -1;
+    }
+    else length = half;
+  }
+  return(first);
+}
+
+int upper_bound(double val,struct mzROIStruct *mzval,int first, int length){
+int half,mid;
+  while (length > 0) {
+    half = length >> 1;
+    mid = first;
+    mid += half;
+    if (val < mzval[mid].mz){
+      length = half;
+    }
+    else {
+      first = mid;
+      first ++;
+      length = length - half -1;
+    }
+  }
+  return(first);
+}
+
+int lowerBound(double val,double *mzval,int first, int length){
+int half,mid;
+  while (length > 0) {
+    half = length >> 1;
+    mid = first;
+    mid += half;
+    if ( mzval[mid] < val){
+      first = mid;
+      first ++;
+      length = length - half -1;
+    }
+    else length = half;
+  }
+  return(first);
+}
+
+int upperBound(double val,double *mzval,int first, int length){
+int half,mid;
+  while (length > 0) {
+    half = length >> 1;
+    mid = first;
+    mid += half;
+    if (val < mzval[mid]){
+      length = half;
+    }
+    else {
+      first = mid;
+      first ++;
+      length = length - half -1;
+    }
+  }
+  return(first);
+}
+
+int initmzROIBlocks(struct mzROIContext *ctx) {
+  struct mzROIBlocks *mzblocks = &ctx->mzblocks;
+  mzblocks->nblockTotal = ROI_BLOCK_INIT_LENGTH;
+  mzblocks->block = (struct mzROIStruct **) mzROI_calloc(ctx, mzblocks->nblockTotal, sizeof(struct mzROIStruct *));
+  mzblocks->blockLength = (unsigned int *) mzROI_calloc(ctx, mzblocks->nblockTotal, sizeof(unsigned int));
+  mzblocks->blockStart = (unsigned int *) mzROI_calloc(ctx, mzblocks->nblockTotal, sizeof(unsigned int));
+  mzblocks->pool = (struct mzROIStruct **) mzROI_calloc(ctx, mzblocks->nblockTotal, sizeof(struct mzROIStruct *));
+  mzblocks->npool = 0;
+  mzblocks->nblock = 0;
+  mzblocks->length = 0;
+  memset(&mzblocks->stale, 0, sizeof(struct mzROIStruct));
+  return(ctx->status);
+}
+
+void freemzROIBlocks(struct mzROIBlocks *mzblocks) {
+  unsigned int j;
+  if (mzblocks->block != NULL)
+    for (j = 0; j < mzblocks->nblock; j++)
+      free(mzblocks->block[j]);
+  if (mzblocks->pool != NULL)
+    for (j = 0; j < mzblocks->npool; j++)
+      free(mzblocks->pool[j]);
+  free(mzblocks->pool);
+  free(mzblocks->block);
+  free(mzblocks->blockLength);
+  free(mzblocks->blockStart);
+  memset(mzblocks, 0, sizeof(struct mzROIBlocks));
+}
+
+// Returns the index of the block containing the ROI at (logical) position pos.
+unsigned int mzROIBlockIndex(struct mzROIBlocks *mzblocks, unsigned int pos) {
+  unsigned int first = 0, length = mzblocks->nblock, half, mid;
+  // last block with blockStart <= pos
+  while (length > 0) {
+    half = length >> 1;
+    mid = first + half;
+    if (mzblocks->blockStart[mid] <= pos) {
+      first = mid + 1;
+      length = length - half - 1;
+    }
+    else length = half;
+  }
+  return(first - 1);
+}
+
+// Returns the ROI at (logical) position pos.
+struct mzROIStruct * mzROIBlocksAt(struct mzROIBlocks *mzblocks, unsigned int pos) {
+  if (mzblocks->length == 0)
+    return(&mzblocks->stale);
+  unsigned int j = mzROIBlockIndex(mzblocks, pos);
+  return(mzblocks->block[j] + (pos - mzblocks->blockStart[j]));
+}
+
+// Same as lower_bound, but on the blocked ROIs. Probes the same positions
+// as lower_bound does on the flat array.
+int blocks_lower_bound(double val, struct mzROIBlocks *mzblocks, int first, int length){
+int half,mid;
+  while (length > 0) {
+    half = length >> 1;
+    mid = first;
+    mid += half;
+    if (mzROIBlocksAt(mzblocks, mid)->mz < val){
+      first = mid;
+      first ++;
+      length = length - half -1;
+    }
+    else length = half;
+  }
+  return(first);
+}
+
+int blocks_upper_bound(double val, struct mzROIBlocks *mzblocks, int first, int length){
+int half,mid;
+  while (length > 0) {
+    half = length >> 1;
+    mid = first;
+    mid += half;
+    if (val < mzROIBlocksAt(mzblocks, mid)->mz){
+      length = half;
+    }
+    else {
+      first = mid;
+      first ++;
+      length = length - half -1;
+    }
+  }
+  return(first);
+}
+
+// Adds a new, empty, block at block position j.
+int addmzROIBlock(struct mzROIContext *ctx, unsigned int j) {
+  struct mzROIBlocks *mzblocks = &ctx->mzblocks;
+  if (mzblocks->nblock + 1 > mzblocks->nblockTotal) {
+    unsigned int newLength = mzblocks->nblockTotal * ROI_ALLOC_INC;
+    void *tmp;
+    if ((tmp = mzROI_realloc(ctx, mzblocks->block, newLength * sizeof(struct mzROIStruct *))) == NULL)
+      return(ctx->status);
+    mzblocks->block = (struct mzROIStruct **) tmp;
+    if ((tmp = mzROI_realloc(ctx, mzblocks->blockLength, newLength * sizeof(unsigned int))) == NULL)
+      return(ctx->status);
+    mzblocks->blockLength = (unsigned int *) tmp;
+    if ((tmp = mzROI_realloc(ctx, mzblocks->blockStart, newLength * sizeof(unsigned int))) == NULL)
+      return(ctx->status);
+    mzblocks->blockStart = (unsigned int *) tmp;
+    if ((tmp = mzROI_realloc(ctx, mzblocks->pool, newLength * sizeof(struct mzROIStruct *))) == NULL)
+      return(ctx->status);
+    mzblocks->pool = (struct mzROIStruct **) tmp;
+    mzblocks->nblockTotal = newLength;
+  }
+  struct mzROIStruct *blk;
+  if (mzblocks->npool > 0) {
+    mzblocks->npool--;
+    blk = mzblocks->pool[mzblocks->npool];
+  } else {
+    blk = (struct mzROIStruct *) mzROI_calloc(ctx, ROI_BLOCK_SIZE, sizeof(struct mzROIStruct));
+    if (blk == NULL)
+      return(ctx->status);
+  }
+  int n = mzblocks->nblock - j;
+  if (n > 0) {
+    memmove(mzblocks->block + j + 1, mzblocks->block + j, n * sizeof(struct mzROIStruct *));
+    memmove(mzblocks->blockLength + j + 1, mzblocks->blockLength + j, n * sizeof(unsigned int));
+    memmove(mzblocks->blockStart + j + 1, mzblocks->blockStart + j, n * sizeof(unsigned int));
+  }
+  mzblocks->block[j] = blk;
+  mzblocks->blockLength[j] = 0;
+  mzblocks->nblock++;
+  return(MZROI_OK);
+}
+
+// Inserts a new ROI at (logical) position pos and returns it.
+struct mzROIStruct * insertmzROIBlocks(struct mzROIContext *ctx, unsigned int pos) {
+  struct mzROIBlocks *mzblocks = &ctx->mzblocks;
+  unsigned int j, off, k;
+  if (mzblocks->nblock == 0) {
+    if (addmzROIBlock(ctx, 0) != MZROI_OK)
+      return(NULL);
+    mzblocks->blockStart[0] = 0;
+  }
+  if (pos >= mzblocks->length) {
+    j = mzblocks->nblock - 1;
+    off = mzblocks->blockLength[j];
+  } else {
+    j = mzROIBlockIndex(mzblocks, pos);
+    off = pos - mzblocks->blockStart[j];
+  }
+  // split a full block in two halves
+  if (mzblocks->blockLength[j] == ROI_BLOCK_SIZE) {
+    unsigned int half = ROI_BLOCK_SIZE / 2;
+    if (addmzROIBlock(ctx, j + 1) != MZROI_OK)
+      return(NULL);
+    memcpy(mzblocks->block[j + 1], mzblocks->block[j] + half, half * sizeof(struct mzROIStruct));
+    mzblocks->blockLength[j + 1] = half;
+    mzblocks->blockLength[j] = half;
+    mzblocks->blockStart[j + 1] = mzblocks->blockStart[j] + half;
+    if (off > half) {
+      j++;
+      off -= half;
+    }
+  }
+  int n = mzblocks->blockLength[j] - off;
+  if (n > 0)
+    memmove(mzblocks->block[j] + off + 1, mzblocks->block[j] + off, n * sizeof(struct mzROIStruct));
+  mzblocks->blockLength[j]++;
+  for (k = j + 1; k < mzblocks->nblock; k++)
+    mzblocks->blockStart[k]++;
+  mzblocks->length++;
+  return(mzblocks->block[j] + off);
+}
+
+// Adds the peak (fMass, fInten) from scan to an existing ROI.
+void extendROI(struct mzROIStruct *roi, const double fMass, const double fInten,
+	       const int scan, struct pickOptionsStruct *pickOptions)
+{
+  //recursive m/z mean update
+  roi->mz = ((roi->length * roi->mz) + fMass) / (roi->length + 1);
+  if (fMass < roi->mzmin)
+    roi->mzmin = fMass;
+  if (fMass > roi->mzmax)
+    roi->mzmax = fMass;
+  roi->scmax = scan;
+  roi->length++;
+  roi->intensity+=fInten;
+  if (fInten >= pickOptions->minimumInt)
+    roi->kI++;
+}
+
+// Initializes a new ROI with the peak (fMass, fInten) from scan.
+void initROI(struct mzROIStruct *roi, const double fMass, const double fInten,
+	     const int scan, struct pickOptionsStruct *pickOptions)
+{
+  roi->mz = fMass;
+  roi->mzmin = fMass;
+  roi->mzmax = fMass;
+  roi->intensity = fInten;
+  roi->scmin = scan;
+  roi->scmax = scan;
+  roi->length = 1;
+  if (fInten >= pickOptions->minimumInt)
+    roi->kI = 1; else
+    roi->kI = 0;
+  roi->deleteMe = FALSE;
+}
+
+// Checks whether a new ROI should be created for fMass, i.e. if the next scan
+// contains a m/z close enough to fMass (or if scan is the last scan).
+int startROI(const double fMass, struct scanBuf * scanbuf, const int scan,
+	     const int LastScan, struct pickOptionsStruct *pickOptions)
+{
+  int i, doInsert=FALSE;
+  double ddev = (pickOptions->dev * fMass);
+  if ((scan < LastScan) && (scanbuf->nextScanLength > 0)) {// check next scan
+    int lpos = lowerBound( fMass - ddev,scanbuf->nextScan,0,scanbuf->nextScanLength);
+    int hpos = upperBound( fMass + ddev,scanbuf->nextScan,lpos,scanbuf->nextScanLength - lpos);
+    if (hpos > scanbuf->nextScanLength - 1)
+      hpos = scanbuf->nextScanLength - 1;
+    if (lpos < scanbuf->nextScanLength) {
+      for (i=lpos; i <= hpos; i++) //
+	{
+	  ddev = (pickOptions->dev *  scanbuf->nextScan[i]);
+	  double ddiff = fabs(fMass - scanbuf->nextScan[i]);
+
+	  if (ddiff <= ddev)
+	    {
+	      doInsert=TRUE;
+	      break;
+	    }
+	}
+    }
+  } else
+    doInsert=TRUE;
+  return(doInsert);
+}
+
+// Passes the m/z of an input spectrum (fMass) and checks if that m/z is
+// close enough to an existing mzROI to enable inclusion (depending on the
+// user defined ppm: difference mean m/z of ROI to fMass <= ppm * fMass / 1e6)
+// otherwise a new mzROI is defined for fMass.
+int insertpeak(struct mzROIContext *ctx, const double fMass,
+	       const double fInten, const int scan, const int LastScan)
+{
+  int i,wasfound = FALSE;
+  struct mzLengthStruct *mzLength = &ctx->mzLength;
+  struct pickOptionsStruct *pickOptions = &ctx->pickOptions;
+  struct mzROIStruct *mzval = ctx->mzval;
+  double ddev = (pickOptions->dev * fMass);
+  int lpos = lower_bound( fMass - ddev,mzval,0,mzLength->mzval);
+  int hpos = upper_bound( fMass + ddev,mzval,lpos,mzLength->mzval - lpos);
+
+  if (lpos >  mzLength->mzval-1)
+      lpos = mzLength->mzval -1;
+  if (hpos >  mzLength->mzval-1)
+      hpos = mzLength->mzval -1 ;
+
+  // loop through mz ROIs for which the m/z could be close to fMass
+  for (i = lpos; i <= hpos; i++)
+  {
+    // check difference between fMass and the mz of the current ROI
+    double ddiff = fabs(mzval[i].mz - fMass);
+
+    if (ddiff <= ddev)
+    { // match (smaller than defined ppm) -> extend this ROI
+          wasfound = TRUE;
+          extendROI(&mzval[i], fMass, fInten, scan, pickOptions);
+    }
+  } // for
+
+  // if not found
+  if (wasfound == FALSE) {  // no, create new ROI for mz
+    if (startROI(fMass, &ctx->scanbuf, scan, LastScan, pickOptions) == TRUE) {
+      // get pos. for insert
+      int i = lower_bound(fMass,mzval,0,mzLength->mzval);
+      // check buffer size
+      if (checkmzvalBufSize(ctx, mzLength->mzval + 1) != MZROI_OK)
+	return(ctx->status);
+      mzval = ctx->mzval;
+      // elements to move
+      int n = mzLength->mzval - i;
+      // insert element
+      if (n>0)
+	memmove(mzval + i +1, mzval + i, n*sizeof(struct mzROIStruct));
+
+      initROI(&mzval[i], fMass, fInten, scan, pickOptions);
+
+      mzLength->mzval++;
+    }
+  }
+
+  return(MZROI_OK);
+}
+
+// Same as insertpeak, but for the open ROIs stored in blocks.
+int insertpeak_blocked(struct mzROIContext *ctx, const double fMass,
+		       const double fInten, const int scan, const int LastScan)
+{
+  int i,wasfound = FALSE;
+  struct mzROIBlocks *mzblocks = &ctx->mzblocks;
+  struct pickOptionsStruct *pickOptions = &ctx->pickOptions;
+  unsigned int length = mzblocks->length;
+  double ddev = (pickOptions->dev * fMass);
+  int lpos = blocks_lower_bound( fMass - ddev,mzblocks,0,length);
+  int hpos = blocks_upper_bound( fMass + ddev,mzblocks,lpos,length - lpos);
+
+  if (lpos >  length-1)
+      lpos = length -1;
+  if (hpos >  length-1)
+      hpos = length -1 ;
+
+  if (lpos <= hpos) {
+    struct mzROIStruct *roi = mzROIBlocksAt(mzblocks, lpos);
+    unsigned int j = 0, off = 0;
+    if (length > 0) {
+      j = mzROIBlockIndex(mzblocks, lpos);
+      off = lpos - mzblocks->blockStart[j];
+    }
+    // loop through mz ROIs for which the m/z could be close to fMass
+    for (i = lpos; i <= hpos; i++)
+    {
+      if (length > 0) {
+	if (off == mzblocks->blockLength[j]) {
+	  j++;
+	  off = 0;
+	}
+	roi = mzblocks->block[j] + off;
+	off++;
+      }
+      if (fabs(roi->mz - fMass) <= ddev)
+      { // match (smaller than defined ppm) -> extend this ROI
+	wasfound = TRUE;
+	extendROI(roi, fMass, fInten, scan, pickOptions);
+      }
+    }
+  }
+
+  if (wasfound == FALSE) {  // no, create new ROI for mz
+    if (startROI(fMass, &ctx->scanbuf, scan, LastScan, pickOptions) == TRUE) {
+      int i = blocks_lower_bound(fMass,mzblocks,0,length);
+      struct mzROIStruct *roi = insertmzROIBlocks(ctx, i);
+      if (roi == NULL)
+	return(ctx->status);
+      initROI(roi, fMass, fInten, scan, pickOptions);
+    }
+  }
+  return(MZROI_OK);
+}
+
+// Checks if the open ROI is finished (adding it to the completed ROIs if it
+// contains enough intensities above the prefilter) or should be discarded.
+// In both cases the ROI gets flagged with deleteMe.
+int closeROI(struct mzROIContext *ctx, const int ctScan, struct mzROIStruct *roi){
+int p;
+    struct pickOptionsStruct *pickOptions = &ctx->pickOptions;
+    unsigned int lastscan=roi->scmax;
+    unsigned int entries=roi->length;
+
+    // finished (entries >= minEntries)  or just extended
+    if ((entries >= pickOptions->minEntries) || (lastscan == ctScan)) // good feature
+    { // is it finished ?
+      if ((entries >= pickOptions->minEntries) && (lastscan < ctScan)) { //it's is not extended anymore
+        if (roi->kI >= pickOptions->minimumIntValues) {
+             // copy values to set of completed ROI's
+             p=ctx->mzLength.mzROI;
+             if (checkmzROIBufSize(ctx, p+1) != MZROI_OK)
+               return(ctx->status);
+             struct mzROIStruct *mzROI = ctx->mzROI;
+             mzROI[p].mz = roi->mz;
+             mzROI[p].mzmin = roi->mzmin;
+             mzROI[p].mzmax = roi->mzmax;
+             mzROI[p].scmin = roi->scmin;
+             mzROI[p].scmax = roi->scmax;
+             mzROI[p].length =  roi->length;
+             mzROI[p].kI =  roi->kI;
+             mzROI[p].intensity =  roi->intensity;
+
+             ctx->mzLength.mzROI++;
+             roi->deleteMe=TRUE;
+            }
+        else {
+             roi->deleteMe=TRUE;
+             }
+      }
+      else {
+        //continue
+      }
+        if (entries > ctScan)
+          ctx->scerr++;
+    }
+    else
+    {
+        roi->deleteMe=TRUE;
+    }
+ return(MZROI_OK);
+}
+
+int cleanup(struct mzROIContext *ctx, const int ctScan){
+int i,p,del=0;
+ struct mzLengthStruct *mzLength = &ctx->mzLength;
+ struct mzROIStruct *mzval = ctx->mzval;
+
+ // check all peaks in mzval
+ for (i=0; i < mzLength->mzval; i++) {
+    if (closeROI(ctx, ctScan, &mzval[i]) != MZROI_OK)
+      return(ctx->status);
+    if (mzval[i].deleteMe == TRUE)
+      del++;
+ } // for i
+
+ // remove the deleted ROIs, keeping the order of the remaining ones
+ if (del > 0) {
+    p=0;
+    for (i=0; i < mzLength->mzval; i++) {
+        if (mzval[i].deleteMe == FALSE) {
+            if (p < i)
+                mzval[p] = mzval[i];
+            p++;
+        }
+    }
+    mzLength->mzval = p;
+ }
+
+ return(MZROI_OK);
+}
+
+// Same as cleanup, but for the open ROIs stored in blocks. The remaining ROIs
+// of each block are moved to the front of the block and adjacent blocks are
+// merged if they fit into a single block.
+int cleanup_blocked(struct mzROIContext *ctx, const int ctScan){
+unsigned int i,j,p,nb=0,start=0;
+ struct mzROIBlocks *mzblocks = &ctx->mzblocks;
+
+ if (mzblocks->length == 0)
+   return(MZROI_OK);
+ for (j=0; j < mzblocks->nblock; j++) {
+   struct mzROIStruct *blk = mzblocks->block[j];
+   for (i=0; i < mzblocks->blockLength[j]; i++)
+     if (closeROI(ctx, ctScan, &blk[i]) != MZROI_OK)
+       return(ctx->status);
+ }
+ // keep the first ROI in case all are removed (see mzROIBlocks)
+ memcpy(&mzblocks->stale, mzblocks->block[0], sizeof(struct mzROIStruct));
+
+ for (j=0; j < mzblocks->nblock; j++) {
+   struct mzROIStruct *blk = mzblocks->block[j];
+   p=0;
+   for (i=0; i < mzblocks->blockLength[j]; i++) {
+     if (blk[i].deleteMe == FALSE) {
+       if (p < i)
+	 blk[p] = blk[i];
+       p++;
+     }
+   }
+   if (p == 0) {
+     mzblocks->pool[mzblocks->npool++] = blk;
+     continue;
+   }
+   if ((nb > 0) && (mzblocks->blockLength[nb - 1] + p <= ROI_BLOCK_SIZE)) {
+     memcpy(mzblocks->block[nb - 1] + mzblocks->blockLength[nb - 1], blk, p * sizeof(struct mzROIStruct));
+     mzblocks->blockLength[nb - 1] += p;
+     mzblocks->pool[mzblocks->npool++] = blk;
+   } else {
+     mzblocks->block[nb] = blk;
+     mzblocks->blockLength[nb] = p;
+     mzblocks->blockStart[nb] = start;
+     nb++;
+   }
+   start += p;
+ }
+ mzblocks->nblock = nb;
+ mzblocks->length = start;
+
+ return(MZROI_OK);
+}
+
+void getScan(int scan, double *pmz, double *pintensity, int *pscanindex,int nmz, int lastScan, struct scanBuf *scanbuf) {
+    int idx1,idx2,N=0;
+    idx1 =  pscanindex[scan -1] +1;
+
+    if (scan == lastScan)
+        idx2 =  nmz-1;  else
+             idx2 =  pscanindex[scan];
+
+    N=idx2 - idx1 + 1;
+    if (N > 0) {
+        scanbuf->thisScanMz = pmz + idx1 - 1;
+        scanbuf->thisScanIntensity = pintensity + idx1 - 1;
+        scanbuf->thisScanLength=N;
+    } else
+    {
+        scanbuf->thisScanMz = NULL;
+        scanbuf->thisScanIntensity = NULL;
+        scanbuf->thisScanLength= 0;
+    }
+
+  //  also get  the m/z values of the following scan
+    if (scan < lastScan) {
+        scan++;
+        idx1 =  pscanindex[scan -1] +1;
+
+        if (scan == lastScan)
+            idx2 =  nmz-1;   else
+                idx2 =  pscanindex[scan];
+
+        N=idx2 - idx1 + 1;
+        if (N > 0) {
+            scanbuf->nextScan = pmz + idx1 - 1;
+            scanbuf->nextScanLength=N;
+        } else
+        {
+            scanbuf->nextScan = NULL;
+            scanbuf->nextScanLength= 0;
+        }
+    }
+}
+
+int mzROI_init(struct mzROIContext *ctx, double dev, unsigned int minEntries,
+	       unsigned int minimumIntValues, unsigned int minimumInt,
+	       int noise, int roiIndex) {
+  memset(ctx, 0, sizeof(struct mzROIContext));
+  if ((roiIndex != ROI_INDEX_ARRAY) && (roiIndex != ROI_INDEX_BLOCKED)) {
+    ctx->status = MZROI_ERR_ARGS;
+    return(ctx->status);
+  }
+  ctx->pickOptions.dev = dev;
+  ctx->pickOptions.minEntries = minEntries;
+  ctx->pickOptions.minimumIntValues = minimumIntValues;
+  ctx->pickOptions.minimumInt = minimumInt;
+  ctx->noise = noise;
+  ctx->roiIndex = roiIndex;
+
+  ctx->mzROI = (struct mzROIStruct *) mzROI_calloc(ctx, ROI_INIT_LENGTH, sizeof(struct mzROIStruct));
+  ctx->mzval = (struct mzROIStruct *) mzROI_calloc(ctx, MZVAL_INIT_LENGTH, sizeof(struct mzROIStruct));
+  ctx->mzLength.mzvalTotal = MZVAL_INIT_LENGTH;
+  ctx->mzLength.mzROITotal = ROI_INIT_LENGTH;
+  if (roiIndex == ROI_INDEX_BLOCKED)
+    initmzROIBlocks(ctx);
+  return(ctx->status);
+}
+
+int mzROI_find(struct mzROIContext *ctx, double *pmz, double *pintensity,
+	       int *pscanindex, int nmz, int scanrangeFrom, int scanrangeTo,
+	       int lastScan) {
+  int ctScan, perc, lp = -1, blocked;
+  unsigned int allocBefore = ctx->alloc.total;
+  struct scanBuf *scanbuf = &ctx->scanbuf;
+
+  if (ctx->status != MZROI_OK)
+    return(ctx->status);
+  blocked = (ctx->roiIndex == ROI_INDEX_BLOCKED);
+  // loop through scans/spectra
+  for (ctScan=scanrangeFrom;ctScan<=scanrangeTo;ctScan++)
+  {
+    if (ctx->progress != NULL) {
+      perc = (int) (ctScan* 100)/scanrangeTo;
+      if ((perc % 10) == 0 && (perc != lp))
+      {
+	ctx->progress(perc, ctx->progressData);
+	lp = perc;
+      }
+    }
+    getScan(ctScan, pmz, pintensity, pscanindex, nmz, lastScan, scanbuf);
+
+    if (scanbuf->thisScanLength > 0)
+    {
+      int p;
+      double fMass,lastMass=-1;
+      double fInten;
+
+      // loop through m/z values of the current scan.
+      for (p=0;p < scanbuf->thisScanLength;p++)
+        {
+          fMass  = scanbuf->thisScanMz[p];
+          fInten = scanbuf->thisScanIntensity[p];
+
+          if (fMass < lastMass) {
+	    ctx->status = MZROI_ERR_UNSORTED;
+	    ctx->errScan = ctScan;
+	    ctx->errPeak = p;
+	    ctx->errMass = fMass;
+	    ctx->errInten = fInten;
+	    ctx->errLastMass = lastMass;
+	    return(ctx->status);
+	  }
+          lastMass = fMass;
+
+          if (fInten > ctx->noise) {
+	    if (blocked)
+	      insertpeak_blocked(ctx, fMass, fInten, ctScan, scanrangeTo);
+	    else
+	      insertpeak(ctx, fMass, fInten, ctScan, scanrangeTo);
+	    if (ctx->status != MZROI_OK)
+	      return(ctx->status);
+	  }
+        }
+    }
+    if (blocked)
+      cleanup_blocked(ctx, ctScan);
+    else
+      cleanup(ctx, ctScan);
+    if (ctx->status != MZROI_OK)
+      return(ctx->status);
+  } //for ctScan
+
+  if (blocked)
+    cleanup_blocked(ctx, ctScan+1);
+  else
+    cleanup(ctx, ctScan+1);
+  ctx->alloc.scans = ctx->alloc.total - allocBefore;
+
+  return(ctx->status);
+}
+
+void mzROI_free(struct mzROIContext *ctx) {
+  if (ctx->roiIndex == ROI_INDEX_BLOCKED)
+    freemzROIBlocks(&ctx->mzblocks);
+  free(ctx->mzval);
+  free(ctx->mzROI);
+  ctx->mzval = NULL;
+  ctx->mzROI = NULL;
+}
@@ -0,0 +1,141 @@
+/*
+ * Detection of regions of interest (ROIs, mass traces) for centWave.
+ *
+ * Plain C API without any calls to R. All state of a ROI detection run is
+ * kept in a struct mzROIContext, hence ROI detection can be run on different
+ * files in parallel threads, each using its own context.
+ *
+ * Usage:
+ *   struct mzROIContext ctx;
+ *   mzROI_init(&ctx, dev, minEntries, minimumIntValues, minimumInt, noise,
+ *              roiIndex);
+ *   if (mzROI_find(&ctx, mz, intensity, scanindex, nmz, scanrangeFrom,
+ *                  scanrangeTo, lastScan) == MZROI_OK)
+ *     ... use ctx.mzROI[0 .. ctx.mzLength.mzROI - 1] ...
+ *   mzROI_free(&ctx);
+ */
+#ifndef MZROI_ENGINE_H
+#define MZROI_ENGINE_H
+
+#define ROI_INIT_LENGTH  1000
+#define MZVAL_INIT_LENGTH 1000
+#define ROI_ALLOC_INC 1.5         // allocation increment
+#define MZVAL_ALLOC_INC 1.5       // allocation increment
+#define ROI_BLOCK_SIZE 512        // max number of open ROIs per block
+#define ROI_BLOCK_INIT_LENGTH 64
+
+// Container used for the open ROIs (mass traces) during ROI detection.
+#define ROI_INDEX_ARRAY 0         // single sorted array (original)
+#define ROI_INDEX_BLOCKED 1       // sorted array split into blocks
+
+// Status codes returned by mzROI_init and mzROI_find.
+#define MZROI_OK 0
+#define MZROI_ERR_MEMORY 1        // memory could not be allocated
+#define MZROI_ERR_UNSORTED 2      // m/z values of a spectrum are not sorted
+#define MZROI_ERR_ARGS 3          // invalid parameters
+
+// The m/z and intensity values of the current scan and the m/z values of the
+// next scan. These point directly into the mz and intensity vectors.
+struct scanBuf
+{
+  double * thisScanMz;
+  double * thisScanIntensity;
+  double * nextScan;
+  unsigned int thisScanLength;
+  unsigned int nextScanLength;
+};
+
+struct pickOptionsStruct
+{
+   unsigned int  minEntries;
+   unsigned int  minimumInt;
+   unsigned int  minimumIntValues;
+   float dev;
+};
+
+struct mzROIStruct {
+  double  mz;
+  double  mzmin;
+  double  mzmax;
+  unsigned int scmin;
+  unsigned int scmax;
+  unsigned int intensity;
+  unsigned int length;
+  unsigned int kI;
+  unsigned char deleteMe;
+};
+
+struct mzLengthStruct {
+  unsigned int mzval;
+  unsigned int mzvalTotal;
+  unsigned int mzROI;
+  unsigned int mzROITotal;
+};
+
+// Number of heap (re)allocations performed by mzROI_find, in total and within
+// the loop over the scans. Buffers are only re-allocated if they have to grow.
+struct mzAllocStruct {
+  unsigned int total;
+  unsigned int scans;
+};
+
+// The open ROIs sorted by m/z, stored as an unrolled list of blocks of at most
+// ROI_BLOCK_SIZE elements. The logical order of the ROIs is the same as in
+// the flat mzval array, but adding a new ROI moves only the elements of one
+// block instead of all ROIs with a larger m/z.
+struct mzROIBlocks {
+  struct mzROIStruct **block;
+  unsigned int *blockLength;
+  unsigned int *blockStart;   // index of the first ROI of each block
+  unsigned int nblock;
+  unsigned int nblockTotal;
+  unsigned int length;        // total number of open ROIs
+  // With no open ROIs the flat array still reads (and eventually updates)
+  // its first element, i.e. the last ROI that was at that position. We keep
+  // a copy of it here to report identical ROIs with both containers.
+  struct mzROIStruct stale;
+  // Blocks no longer in use, kept for re-use.
+  struct mzROIStruct **pool;
+  unsigned int npool;
+};
+
+// Called with the percentage of processed scans (in steps of 10).
+typedef void (*mzROIProgressFun)(int perc, void *data);
+
+struct mzROIContext {
+  struct pickOptionsStruct pickOptions;
+  int noise;
+  int roiIndex;
+  struct scanBuf scanbuf;
+  struct mzROIStruct *mzval;        // open ROIs (ROI_INDEX_ARRAY)
+  struct mzROIBlocks mzblocks;      // open ROIs (ROI_INDEX_BLOCKED)
+  struct mzROIStruct *mzROI;        // completed ROIs
+  struct mzLengthStruct mzLength;
+  struct mzAllocStruct alloc;
+  int scerr;  // count of peak insertion errors, due to missing/bad centroidisation
+  int status;
+  // details for MZROI_ERR_UNSORTED
+  int errScan;
+  int errPeak;
+  double errMass;
+  double errInten;
+  double errLastMass;
+  // optional progress reporting
+  mzROIProgressFun progress;
+  void *progressData;
+};
+
+int mzROI_init(struct mzROIContext *ctx, double dev, unsigned int minEntries,
+	       unsigned int minimumIntValues, unsigned int minimumInt,
+	       int noise, int roiIndex);
+
+int mzROI_find(struct mzROIContext *ctx, double *pmz, double *pintensity,
+	       int *pscanindex, int nmz, int scanrangeFrom, int scanrangeTo,
+	       int lastScan);
+
+void mzROI_free(struct mzROIContext *ctx);
+
+int lowerBound(double val,double *mzval,int first, int length);
+int upperBound(double val,double *mzval,int first, int length);
+
+#endif
@@ -5,6 +5,8 @@
 #include "vec.h"
 #include "mat.h"
 
+class AlignRef;
+
 extern "C"{
 using namespace VEC;
 
@@ -45,6 +47,14 @@ class LMat {
 
         void set_from_xcms(int valuescantime, double *pscantime, int mzrange,
 			   double *mz, double *intensity);
+        // as above, but the matrix is a view on the single precision values
+        // in intensity (no copy, intensity has to outlive the LMat)
+        void set_from_xcms(int valuescantime, double *pscantime, int mzrange,
+			   double *mz, float *intensity);
+        // scans first to last of ref with pad_before and pad_after m/z
+        // bins of zeros; mz are the m/z values of all bins
+        void set_from_reference(const AlignRef &ref, int first, int last,
+                                int pad_before, int pad_after, double *mz);
         void print_xcms();
 
         // selfTimes and equivTimes are the anchor points for the warping
@@ -0,0 +1,215 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "xcms_alignref.h"
+
+// Layout of the data (in memory and in the file): a header of 24 bytes
+// (magic, version, nscan, nbin, unused), the scan times and the double
+// precision row sums followed by the single precision row sums, sums of
+// squares and the matrix.
+static const char ALIGNREF_MAGIC[8] = {'X', 'C', 'M', 'S', 'O', 'R', 'E', 'F'};
+static const int ALIGNREF_VERSION = 1;
+static const size_t ALIGNREF_HEADER = 24;
+
+AlignRef::AlignRef() {
+  nscan = 0;
+  nbin = 0;
+  scantime = NULL;
+  dsum = NULL;
+  fsum = NULL;
+  fsumsq = NULL;
+  mat = NULL;
+  _map = NULL;
+  _map_len = 0;
+}
+
+AlignRef::~AlignRef() {
+  _unmap();
+}
+
+size_t AlignRef::_size(int nscan, int nbin) {
+  return ALIGNREF_HEADER + 2 * sizeof(double) * nscan +
+    sizeof(float) * ((size_t)2 * nscan + (size_t)nscan * nbin);
+}
+
+void AlignRef::_set_pointers(const char *base) {
+  int hdr[4];
+  memcpy(hdr, base + sizeof(ALIGNREF_MAGIC), sizeof(hdr));
+  nscan = hdr[1];
+  nbin = hdr[2];
+  const char *p = base + ALIGNREF_HEADER;
+  scantime = (const double *)p;
+  p += sizeof(double) * nscan;
+  dsum = (const double *)p;
+  p += sizeof(double) * nscan;
+  fsum = (const float *)p;
+  p += sizeof(float) * nscan;
+  fsumsq = (const float *)p;
+  p += sizeof(float) * nscan;
+  mat = (const float *)p;
+}
+
+void AlignRef::_unmap() {
+#ifndef _WIN32
+  if (_map != NULL)
+    munmap(_map, _map_len);
+#endif
+  _map = NULL;
+  _map_len = 0;
+}
+
+void AlignRef::_alloc(int nscan_, const double *scantime_, int nbin_) {
+  _unmap();
+  size_t len = _size(nscan_, nbin_);
+  _buf.assign((len + sizeof(double) - 1) / sizeof(double), 0);
+  char *base = (char *)&_buf[0];
+  int hdr[4] = {ALIGNREF_VERSION, nscan_, nbin_, 0};
+  memcpy(base, ALIGNREF_MAGIC, sizeof(ALIGNREF_MAGIC));
+  memcpy(base + sizeof(ALIGNREF_MAGIC), hdr, sizeof(hdr));
+  _set_pointers(base);
+  memcpy((double *)scantime, scantime_, sizeof(double) * nscan);
+}
+
+void AlignRef::_row_sums() {
+  double *ds = (double *)dsum;
+  float *fs = (float *)fsum;
+  float *fsq = (float *)fsumsq;
+  for (int s = 0; s < nscan; ++s) {
+    const float *row = mat + (size_t)s * nbin;
+    // same order of summation as centerRows, MatF::sum and sumXSquared
+    double d = 0;
+    float f = 0, fq = 0;
+    for (int i = 0; i < nbin; ++i) {
+      d += row[i];
+      f += row[i];
+      fq += row[i] * row[i];
+    }
+    ds[s] = d;
+    fs[s] = f;
+    fsq[s] = fq;
+  }
+}
+
+void AlignRef::set_from_xcms(int nscan_, const double *scantime_, int nbin_,
+			     const double *intensity) {
+  _alloc(nscan_, scantime_, nbin_);
+  float *m = (float *)mat;
+  for (size_t i = 0; i < (size_t)nscan * nbin; ++i)
+    m[i] = intensity[i];
+  _row_sums();
+}
+
+void AlignRef::set_from_xcms(int nscan_, const double *scantime_, int nbin_,
+			     const float *intensity) {
+  _alloc(nscan_, scantime_, nbin_);
+  memcpy((float *)mat, intensity, sizeof(float) * nscan * nbin);
+  _row_sums();
+}
+
+void AlignRef::set_from_sparse(int nscan_, const double *scantime_, int nbin_,
+			       const int *p, const int *bin,
+			       const double *intensity) {
+  // the matrix is initialized with zeros
+  _alloc(nscan_, scantime_, nbin_);
+  float *m = (float *)mat;
+  for (int s = 0; s < nscan; ++s) {
+    float *row = m + (size_t)s * nbin;
+    for (int k = p[s]; k < p[s + 1]; ++k)
+      row[bin[k]] = intensity[k];
+  }
+  _row_sums();
+}
+
+int AlignRef::save(const char *file) const {
+  if (mat == NULL)
+    return 1;
+  FILE *fp = fopen(file, "wb");
+  if (fp == NULL)
+    return 1;
+  const char *base = (const char *)scantime - ALIGNREF_HEADER;
+  size_t len = _size(nscan, nbin);
+  size_t written = fwrite(base, 1, len, fp);
+  if (fclose(fp) != 0 || written != len)
+    return 1;
+  return 0;
+}
+
+int AlignRef::load(const char *file) {
+  _unmap();
+  _buf.clear();
+  mat = NULL;
+  char head[ALIGNREF_HEADER];
+  int hdr[4];
+  FILE *fp = fopen(file, "rb");
+  if (fp == NULL)
+    return 1;
+  size_t nread = fread(head, 1, ALIGNREF_HEADER, fp);
+  memcpy(hdr, head + sizeof(ALIGNREF_MAGIC), sizeof(hdr));
+  if (nread != ALIGNREF_HEADER ||
+      memcmp(head, ALIGNREF_MAGIC, sizeof(ALIGNREF_MAGIC)) ||
+      hdr[0] != ALIGNREF_VERSION || hdr[1] < 0 || hdr[2] < 0) {
+    fclose(fp);
+    return 1;
+  }
+  size_t len = _size(hdr[1], hdr[2]);
+#ifdef _WIN32
+  // read the full file into memory
+  _buf.assign((len + sizeof(double) - 1) / sizeof(double), 0);
+  memcpy(&_buf[0], head, ALIGNREF_HEADER);
+  nread = fread((char *)&_buf[0] + ALIGNREF_HEADER, 1, len - ALIGNREF_HEADER,
+		fp);
+  fclose(fp);
+  if (nread != len - ALIGNREF_HEADER) {
+    _buf.clear();
+    return 1;
+  }
+  _set_pointers((const char *)&_buf[0]);
+#else
+  fclose(fp);
+  int fd = open(file, O_RDONLY);
+  if (fd < 0)
+    return 1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < len) {
+    close(fd);
+    return 1;
+  }
+  void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 1;
+  _map = map;
+  _map_len = len;
+  _set_pointers((const char *)map);
+#endif
+  return 0;
+}
+
+void AlignRef::rows(int first, int last, int pad_before, int pad_after,
+		    MatF &out) const {
+  int n = last - first + 1;
+  if (pad_before == 0 && pad_after == 0) {
+    // a view on the rows, no copy
+    out.set(n, nbin, (float *)mat + (size_t)first * nbin);
+    return;
+  }
+  int cols = pad_before + nbin + pad_after;
+  float *dat = new float[(size_t)n * cols];
+  for (int s = 0; s < n; ++s) {
+    float *row = dat + (size_t)s * cols;
+    std::fill(row, row + pad_before, 0.f);
+    memcpy(row + pad_before, mat + (size_t)(first + s) * nbin,
+	   sizeof(float) * nbin);
+    std::fill(row + pad_before + nbin, row + cols, 0.f);
+  }
+  MatF tmp(n, cols, dat);
+  out.take(tmp);
+}
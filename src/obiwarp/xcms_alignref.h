@@ -0,0 +1,67 @@
+#ifndef _ALIGNREF_H
+#define _ALIGNREF_H
+
+#include <vector>
+#include <cstddef>
+
+#include "mat.h"
+
+using namespace VEC;
+
+// Profile matrix of the center sample of the obiwarp alignment (one row per
+// scan, one column per m/z bin) in single precision, together with the row
+// statistics of the score functions. It is created once and used read-only
+// for the alignments of all other samples, i.e. it can be shared between
+// threads. The data is either held in memory or mapped read-only from a file
+// written with save(), which allows to share it between processes.
+//
+// Zero columns added to the matrix (to match the m/z range of the other
+// sample) do not change the row sums, hence the statistics are valid for the
+// padded matrices returned by rows().
+class AlignRef {
+    public:
+        int nscan;
+        int nbin;
+        const double *scantime;
+        const double *dsum;     // row sums in double precision (centerRows)
+        const float *fsum;      // row sums (score_pearsons_r_opt)
+        const float *fsumsq;    // row sums of squares (score_pearsons_r_opt)
+        const float *mat;       // nscan x nbin, row-major
+
+        AlignRef();
+        ~AlignRef();
+        // intensity is the profile matrix as returned by profMat (nbin rows
+        // and nscan columns, column-major)
+        void set_from_xcms(int nscan, const double *scantime, int nbin,
+                           const double *intensity);
+        // the same from a single precision profile matrix
+        void set_from_xcms(int nscan, const double *scantime, int nbin,
+                           const float *intensity);
+        // the same from a sparse profile matrix (compressed columns, see
+        // profile_matrix_sparse): the values of scan s are intensity[k] in
+        // the bins bin[k] for k from p[s] to p[s + 1] - 1
+        void set_from_sparse(int nscan, const double *scantime, int nbin,
+                             const int *p, const int *bin,
+                             const double *intensity);
+        // Writes the data to / maps the data from a file; return 0 on success.
+        int save(const char *file) const;
+        int load(const char *file);
+        // Rows first to last (0-based) of the matrix with pad_before and
+        // pad_after columns of zeros added to each row; without padding out
+        // is a (shallow) view on the rows.
+        void rows(int first, int last, int pad_before, int pad_after,
+                  MatF &out) const;
+
+    private:
+        std::vector<double> _buf;   // data held in memory
+        void *_map;                 // or mapped from a file
+        size_t _map_len;
+
+        static size_t _size(int nscan, int nbin);
+        void _alloc(int nscan, const double *scantime, int nbin);
+        void _row_sums();
+        void _set_pointers(const char *base);
+        void _unmap();
+};
+
+#endif
@@ -1,6 +1,8 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 #include<math.h>
 
 #include "xcms_dynprog.h"
@@ -193,7 +195,8 @@ void DynProg::best_anchors(VecI &mBijShort, VecI &nBijShort, VecF &sBijShort,
 
   // Check that the num_internal_anchors+2
   if (num_internal_anchors+2 > trueLength) {
-    Rprintf("changing %d num_internal_anchors to %d ", num_internal_anchors, trueLength -2);
+    if (verbose)
+      Rprintf("changing %d num_internal_anchors to %d ", num_internal_anchors, trueLength -2);
     num_internal_anchors = trueLength - 2;
   }
 
@@ -539,7 +542,7 @@ void DynProg::score_product(MatF &mCoords, MatF &nCoords, MatF &scores) {
   int s_mlen = mCoords.rows();// s_cols = length_n
   int s_nlen = nCoords.rows();// s_rows = length_m  // Both rows and cols derived from # rows
   int cols = mCoords.cols();
-  if(cols != nCoords.cols()) Rf_error("assertion failled in obiwarp\n");
+  if(cols != nCoords.cols()) throw DynProgError("assertion failled");
   MatF tmp(s_mlen, s_nlen);
   for (int m = 0; m < s_mlen; ++m) {
     for (int n = 0; n < s_nlen; ++n) {
@@ -561,7 +564,7 @@ void DynProg::score_covariance(MatF &mCoords, MatF &nCoords, MatF &scores) {
   int s_mlen = mCoords.rows();// s_cols = length_n
   int s_nlen = nCoords.rows();// s_rows = length_m  // Both rows and cols derived from # rows
   int cols = mCoords.cols();
-  if(cols != nCoords.cols()) Rf_error("assertion failled in obiwarp\n");
+  if(cols != nCoords.cols()) throw DynProgError("assertion failled");
 
   MatF tmp(s_mlen, s_nlen);
 
@@ -592,7 +595,7 @@ void DynProg::score_pearsons_r(MatF &mCoords, MatF &nCoords, MatF &scores) {
   int s_nlen = nCoords.rows();// s_cols = length_n
   int s_mlen = mCoords.rows();// s_rows = length_m  // Both rows and cols derived from # rows
   int cols = mCoords.cols();
-  if(cols != nCoords.cols()) Rf_error("assertion failled in obiwarp\n");
+  if(cols != nCoords.cols()) throw DynProgError("assertion failled");
   MatF tmp(s_mlen, s_nlen);
 
   float *bot_x = new float[s_nlen];
@@ -631,12 +634,41 @@ void DynProg::score_pearsons_r(MatF &mCoords, MatF &nCoords, MatF &scores) {
   scores.take(tmp);
 }
 
+// Row sums and sum(x^2) - sum(x)^2 / cols of the rows of coords for the
+// cached pearson correlations of score_pearsons_r_opt; uses the precomputed
+// row sums and sums of squares psum and psumsq if provided.
+static void corOptSums(MatF &coords, float *sum, float *bot,
+		       const float *psum = NULL, const float *psumsq = NULL) {
+  int cols = coords.cols();
+  for (int i = 0; i < coords.rows(); ++i) {
+    sum[i] = psum ? psum[i] : coords.sum(i);
+    float sumsq = psumsq ? psumsq[i] : sumXSquared(coords,i);
+    //         sum(x^2)                  -    ((sum_x)^2/num_elements
+    bot[i] = ( sumsq ) - ( ((sum[i])*sum[i])/cols);
+  }
+}
+
+// Pearson correlation of row m of mCoords with row n of nCoords from the
+// cached sums (undef if one of the rows has zero variance).
+static inline float corOptCell(MatF &mCoords, int m, MatF &nCoords, int n,
+			       const float *sum_y, const float *bot_y,
+			       const float *sum_x, const float *bot_x,
+			       int cols, float undef) {
+  //        sum(X * Y) -
+  double top = sumOfProducts(mCoords, m, nCoords, n) -
+    ((sum_x[n] * sum_y[m])/cols);
+  //  (sum(x)      * sum(y))/num_elements
+  double bot = sqrt(bot_x[n] * bot_y[m]);
+  if (bot == 0) { return undef; }  // no undefined
+  return (float)(top/bot);
+}
+
 void DynProg::score_pearsons_r_opt(MatF &mCoords, MatF &nCoords, MatF &scores) {
   //Strategy is to cache the redundant values
   int s_nlen = nCoords.rows();// s_cols = length_n
   int s_mlen = mCoords.rows();// s_rows = length_m  // Both rows and cols derived from # rows
   int cols = mCoords.cols();
-  if(cols != nCoords.cols()) Rf_error("assertion failled in obiwarp\n");
+  if(cols != nCoords.cols()) throw DynProgError("assertion failled");
 
   MatF tmp(s_mlen, s_nlen);
   const int dfd = 10;
@@ -648,17 +680,8 @@ void DynProg::score_pearsons_r_opt(MatF &mCoords, MatF &nCoords, MatF &scores) {
   float *sum_x = new float[s_nlen];
   float *sum_y = new float[s_mlen];
 
-  int i;
-  for (i = 0; i < s_nlen; ++i) {
-    sum_x[i] = nCoords.sum(i);
-    //         sum(x^2)                  -    ((sum_x)^2/num_elements
-    bot_x[i] = ( sumXSquared(nCoords,i) ) - ( ((sum_x[i])*sum_x[i])/cols);
-  }
-  for (i = 0; i < s_mlen; ++i) {
-    sum_y[i] = mCoords.sum(i);
-    //         sum(y^2)                  -    ((sum_y)^2/num_elements
-    bot_y[i] = ( sumXSquared(mCoords,i) ) - ( ((sum_y[i])*sum_y[i])/cols );
-  }
+  corOptSums(nCoords, sum_x, bot_x);
+  corOptSums(mCoords, sum_y, bot_y, m_sum, m_sumsq);
 
   //fill the matrix with infinity
   for (int m = 0; m < s_mlen; ++m) {
@@ -670,34 +693,28 @@ void DynProg::score_pearsons_r_opt(MatF &mCoords, MatF &nCoords, MatF &scores) {
   int diff = s_mlen-s_nlen;
   // CALCULATE REQUIRED PAIR calculations
   if (diff <= 0){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16) num_threads(threads) if(threads > 1)
+#endif
     for (int m = 0; m < s_mlen; ++m) {
       for (int n = m-s_nlen/dfd; n < s_nlen/dfd+m-2*diff; ++n) {
 	if(n<0||n>=s_nlen)
 	  continue;
-
-	//        sum(X * Y) -
-	double top = sumOfProducts(mCoords, m, nCoords, n) -
-	  ((sum_x[n] * sum_y[m])/cols);
-	//  (sum(x)      * sum(y))/num_elements
-	double bot = sqrt(bot_x[n] * bot_y[m]);
-	if (bot == 0) { tmp(m,n) = INFINITY; }  // no undefined
-	else { tmp(m,n) = (float)(top/bot); }
+	tmp(m,n) = corOptCell(mCoords, m, nCoords, n, sum_y, bot_y, sum_x,
+			      bot_x, cols, INFINITY);
       }
     }
   }
   else
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16) num_threads(threads) if(threads > 1)
+#endif
     for (int m = 0; m < s_mlen; ++m) {
       for (int n = m-s_nlen/dfd; n < s_nlen/dfd+m+2*diff; ++n) {
 	if(n<0||n>=s_nlen)
 	  continue;
-
-	//        sum(X * Y) -
-	double top = sumOfProducts(mCoords, m, nCoords, n) -
-	  ((sum_x[n] * sum_y[m])/cols);
-	//  (sum(x)      * sum(y))/num_elements
-	double bot = sqrt(bot_x[n] * bot_y[m]);
-	if (bot == 0) { tmp(m,n) = 0; }  // no undefined
-	else { tmp(m,n) = (float)(top/bot); }
+	tmp(m,n) = corOptCell(mCoords, m, nCoords, n, sum_y, bot_y, sum_x,
+			      bot_x, cols, 0);
       }
     }
 
@@ -711,7 +728,7 @@ void DynProg::score_euclidean(MatF &mCoords, MatF &nCoords, MatF &scores) {
   int s_nlen = nCoords.rows();// s_rows = length_m  // Both rows and cols derived from # rows
   int cols = mCoords.cols();
 
-  if(cols != nCoords.cols()) Rf_error("assertion failled in obiwarp\n");
+  if(cols != nCoords.cols()) throw DynProgError("assertion failled");
 
   MatF tmp(s_mlen, s_nlen);
   for (int m = 0; m < s_mlen; ++m) {
@@ -728,12 +745,250 @@ void DynProg::score_euclidean(MatF &mCoords, MatF &nCoords, MatF &scores) {
 }
 
 
+/************************************************************
+ * CACHE-BLOCKED SCORE KERNELS
+ ************************************************************/
+// All pairwise scores C(m,n) = sum_i op(A(m,i), B(n,i)) of the rows of A
+// (ma x cols) and B (nb x cols), computed in blocks of BLK_COLS columns and
+// BLK_ROWS rows of B (which stay in the cache) for 2 x 2 rows at a time.
+// Each dot product is accumulated in BLK_LANES independent partial sums,
+// which the compiler maps to SIMD registers. Blocks of BLK_MROWS rows of A
+// are processed in parallel threads; the result does not depend on the
+// number of threads.
+const int BLK_COLS = 256;
+const int BLK_ROWS = 64;
+const int BLK_MROWS = 32;
+const int BLK_LANES = 8;
+
+struct ProductOp {
+  static inline float apply(float a, float b) { return a * b; }
+};
+
+struct SqDiffOp {
+  static inline float apply(float a, float b) { float d = a - b; return d * d; }
+};
+
+template <class Op>
+static inline float laneSum(const float *acc, const float *a, const float *b,
+			    int k, int len) {
+  float sum = 0;
+  for (int l = 0; l < BLK_LANES; ++l) {
+    sum += acc[l];
+  }
+  for (; k < len; ++k) {
+    sum += Op::apply(a[k], b[k]);
+  }
+  return sum;
+}
+
+// C[0,0], C[0,1], C[1,0], C[1,1] += scores of rows a0, a1 with rows b0, b1
+template <class Op>
+static void blockKernel2x2(const float *a0, const float *a1,
+			   const float *b0, const float *b1, int len,
+			   float *c0, float *c1) {
+  float acc00[BLK_LANES] = {0}, acc01[BLK_LANES] = {0};
+  float acc10[BLK_LANES] = {0}, acc11[BLK_LANES] = {0};
+  int k = 0;
+  for (; k + BLK_LANES <= len; k += BLK_LANES) {
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for (int l = 0; l < BLK_LANES; ++l) {
+      acc00[l] += Op::apply(a0[k + l], b0[k + l]);
+      acc01[l] += Op::apply(a0[k + l], b1[k + l]);
+      acc10[l] += Op::apply(a1[k + l], b0[k + l]);
+      acc11[l] += Op::apply(a1[k + l], b1[k + l]);
+    }
+  }
+  c0[0] += laneSum<Op>(acc00, a0, b0, k, len);
+  c0[1] += laneSum<Op>(acc01, a0, b1, k, len);
+  c1[0] += laneSum<Op>(acc10, a1, b0, k, len);
+  c1[1] += laneSum<Op>(acc11, a1, b1, k, len);
+}
+
+// c += score of row a with row b
+template <class Op>
+static void blockKernel1x1(const float *a, const float *b, int len, float *c) {
+  float acc[BLK_LANES] = {0};
+  int k = 0;
+  for (; k + BLK_LANES <= len; k += BLK_LANES) {
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for (int l = 0; l < BLK_LANES; ++l) {
+      acc[l] += Op::apply(a[k + l], b[k + l]);
+    }
+  }
+  *c += laneSum<Op>(acc, a, b, k, len);
+}
+
+// C rows m0 to m1 - 1 of blockedScores
+template <class Op>
+static void blockedScoreRows(const float *A, int m0, int m1, const float *B,
+			     int nb, int cols, float *C) {
+  std::fill(C + (size_t)m0 * nb, C + (size_t)m1 * nb, 0.f);
+  for (int k0 = 0; k0 < cols; k0 += BLK_COLS) {
+    int len = min(BLK_COLS, cols - k0);
+    for (int n0 = 0; n0 < nb; n0 += BLK_ROWS) {
+      int n1 = min(n0 + BLK_ROWS, nb);
+      int m = m0;
+      for (; m + 1 < m1; m += 2) {
+	const float *a0 = A + (size_t)m * cols + k0;
+	const float *a1 = a0 + cols;
+	float *c0 = C + (size_t)m * nb;
+	float *c1 = c0 + nb;
+	int n = n0;
+	for (; n + 1 < n1; n += 2) {
+	  const float *b0 = B + (size_t)n * cols + k0;
+	  blockKernel2x2<Op>(a0, a1, b0, b0 + cols, len, c0 + n, c1 + n);
+	}
+	if (n < n1) {
+	  const float *b0 = B + (size_t)n * cols + k0;
+	  blockKernel1x1<Op>(a0, b0, len, c0 + n);
+	  blockKernel1x1<Op>(a1, b0, len, c1 + n);
+	}
+      }
+      if (m < m1) {
+	const float *a0 = A + (size_t)m * cols + k0;
+	for (int n = n0; n < n1; ++n) {
+	  blockKernel1x1<Op>(a0, B + (size_t)n * cols + k0, len,
+			     C + (size_t)m * nb + n);
+	}
+      }
+    }
+  }
+}
+
+// C (ma x nb, row-major) = pairwise scores of the rows of A and B
+template <class Op>
+static void blockedScores(const float *A, int ma, const float *B, int nb,
+			  int cols, float *C, int threads) {
+  int nmblock = (ma + BLK_MROWS - 1) / BLK_MROWS;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(threads) if(threads > 1)
+#endif
+  for (int mb = 0; mb < nmblock; ++mb) {
+    blockedScoreRows<Op>(A, mb * BLK_MROWS, min(ma, (mb + 1) * BLK_MROWS),
+			 B, nb, cols, C);
+  }
+}
+
+// Subtracts the mean from each row of mat (rows x cols) and, if normalize is
+// set, divides it by its norm (rows with zero variance are set to 0). The
+// precomputed row sums are used if sums is provided.
+static void centerRows(MatF &mat, std::vector<float> &out, int normalize,
+		       const double *sums = NULL) {
+  int rows = mat.rows();
+  int cols = mat.cols();
+  out.resize((size_t)rows * cols);
+  for (int r = 0; r < rows; ++r) {
+    const float *x = mat.pointer(r);
+    float *y = &out[(size_t)r * cols];
+    double mean = 0;
+    if (sums) {
+      mean = sums[r];
+    } else {
+      for (int i = 0; i < cols; ++i) {
+	mean += x[i];
+      }
+    }
+    mean /= cols;
+    double ss = 0;
+    for (int i = 0; i < cols; ++i) {
+      double d = x[i] - mean;
+      ss += d * d;
+    }
+    double scale = 1;
+    if (normalize) {
+      scale = (ss > 0) ? 1 / sqrt(ss) : 0;
+    }
+    for (int i = 0; i < cols; ++i) {
+      y[i] = (float)((x[i] - mean) * scale);
+    }
+  }
+}
+
+void DynProg::score_product_blocked(MatF &mCoords, MatF &nCoords, MatF &scores) {
+  int s_mlen = mCoords.rows();
+  int s_nlen = nCoords.rows();
+  int cols = mCoords.cols();
+  if(cols != nCoords.cols()) throw DynProgError("assertion failled");
+  MatF tmp(s_mlen, s_nlen);
+  blockedScores<ProductOp>(mCoords.pointer(), s_mlen, nCoords.pointer(), s_nlen,
+			   cols, tmp.pointer(), threads);
+  scores.take(tmp);
+}
+
+void DynProg::score_covariance_blocked(MatF &mCoords, MatF &nCoords, MatF &scores) {
+  // sum((y - mean(y)) * x) / cols, i.e. only the rows of mCoords are centered
+  int s_mlen = mCoords.rows();
+  int s_nlen = nCoords.rows();
+  int cols = mCoords.cols();
+  if(cols != nCoords.cols()) throw DynProgError("assertion failled");
+  MatF tmp(s_mlen, s_nlen);
+  std::vector<float> mCentered;
+  const float *mrows = m_rows;
+  if (!mrows) {
+    centerRows(mCoords, mCentered, 0, m_dsum);
+    mrows = &mCentered[0];
+  }
+  blockedScores<ProductOp>(mrows, s_mlen, nCoords.pointer(), s_nlen,
+			   cols, tmp.pointer(), threads);
+  tmp /= (float)cols;
+  scores.take(tmp);
+}
+
+void DynProg::score_pearsons_r_blocked(MatF &mCoords, MatF &nCoords, MatF &scores) {
+  // the correlation of centered rows of unit norm is their dot product
+  int s_mlen = mCoords.rows();
+  int s_nlen = nCoords.rows();
+  int cols = mCoords.cols();
+  if(cols != nCoords.cols()) throw DynProgError("assertion failled");
+  MatF tmp(s_mlen, s_nlen);
+  std::vector<float> mNormed, nNormed;
+  const float *mrows = m_rows;
+  if (!mrows) {
+    centerRows(mCoords, mNormed, 1, m_dsum);
+    mrows = &mNormed[0];
+  }
+  centerRows(nCoords, nNormed, 1);
+  blockedScores<ProductOp>(mrows, s_mlen, &nNormed[0], s_nlen,
+			   cols, tmp.pointer(), threads);
+  scores.take(tmp);
+}
+
+void DynProg::prepare_rows(MatF &mCoords, const char *type,
+			   std::vector<float> &out) {
+  if (!strcmp(type, "cov"))
+    centerRows(mCoords, out, 0, m_dsum);
+  else if (!strcmp(type, "cor"))
+    centerRows(mCoords, out, 1, m_dsum);
+  else
+    out.clear();
+}
+
+void DynProg::score_euclidean_blocked(MatF &mCoords, MatF &nCoords, MatF &scores) {
+  int s_mlen = mCoords.rows();
+  int s_nlen = nCoords.rows();
+  int cols = mCoords.cols();
+  if(cols != nCoords.cols()) throw DynProgError("assertion failled");
+  MatF tmp(s_mlen, s_nlen);
+  blockedScores<SqDiffOp>(mCoords.pointer(), s_mlen, nCoords.pointer(), s_nlen,
+			  cols, tmp.pointer(), threads);
+  float *t = tmp.pointer();
+  for (size_t i = 0; i < (size_t)s_mlen * s_nlen; ++i) {
+    t[i] = sqrt(t[i]);
+  }
+  scores.take(tmp);
+}
+
+
 void DynProg::score_mutual_info(MatF &mCoords, MatF &nCoords, MatF &scores, int num_bins) {
   //Strategy is to cache the redundant values
   int s_mlen = mCoords.rows();// s_rows = length_m  // Both rows and cols derived from # rows
   int s_nlen = nCoords.rows();// s_cols = length_n
   int cols = nCoords.cols();
-  if(cols != nCoords.cols()) Rf_error("assertion failled in obiwarp\n");
+  if(cols != nCoords.cols()) throw DynProgError("assertion failled");
 
   MatF tmpmat(s_mlen, s_mlen);
 
@@ -754,7 +1009,7 @@ void DynProg::score_mutual_info(MatF &mCoords, MatF &nCoords, MatF &scores, int
   MatI binIndNCoords(nCoords.rows(), nCoords.cols());
   MatI binIndMCoords(mCoords.rows(), mCoords.cols());
 
-  if(nCoords.cols() != mCoords.cols()) Rf_error("assertion failled in obiwarp\n");
+  if(nCoords.cols() != mCoords.cols()) throw DynProgError("assertion failled");
 
   int i;
   for (i = 0; i < nCoords.rows() ; ++i) {
@@ -772,17 +1027,21 @@ void DynProg::score_mutual_info(MatF &mCoords, MatF &nCoords, MatF &scores, int
 
 void DynProg::score(MatF &mCoords, MatF &nCoords, MatF &scores, const char *type, int mi_num_bins) {
   if (!strcmp(type,"prd")) {
-    score_product(mCoords,nCoords,scores);
+    if (blocked) score_product_blocked(mCoords,nCoords,scores);
+    else score_product(mCoords,nCoords,scores);
   }
   else if (!strcmp(type,"cov")) {
-    score_covariance(mCoords,nCoords,scores);
+    if (blocked) score_covariance_blocked(mCoords,nCoords,scores);
+    else score_covariance(mCoords,nCoords,scores);
   }
   else if (!strcmp(type,"cor")) {
-    score_pearsons_r(mCoords,nCoords,scores);
+    if (blocked) score_pearsons_r_blocked(mCoords,nCoords,scores);
+    else score_pearsons_r(mCoords,nCoords,scores);
   } else if (!strcmp(type,"cor_opt")) {
     score_pearsons_r_opt(mCoords,nCoords,scores);
   } else if (!strcmp(type,"euc")) {
-    score_euclidean(mCoords,nCoords,scores);
+    if (blocked) score_euclidean_blocked(mCoords,nCoords,scores);
+    else score_euclidean(mCoords,nCoords,scores);
   }
   else if (!strcmp(type,"mutual_info")) {
     score_mutual_info(mCoords,nCoords,scores,mi_num_bins);
@@ -793,6 +1052,97 @@ void DynProg::score(MatF &mCoords, MatF &nCoords, MatF &scores, const char *type
   }
 }
 
+// Scores of the cells of the band of C, computed with blockedScoreRows on
+// the (dense) blocks of BLK_MROWS rows of A and the columns of the band in
+// these rows.
+template <class Op>
+static void blockedBandScores(const float *A, const float *B, int cols,
+			      BandMatF &C, int threads) {
+  const Band &band = *C.band;
+  int nmblock = (band.rows + BLK_MROWS - 1) / BLK_MROWS;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(threads) if(threads > 1)
+#endif
+  {
+    std::vector<float> tmp;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (int mb = 0; mb < nmblock; ++mb) {
+      int m0 = mb * BLK_MROWS;
+      int m1 = min(band.rows, m0 + BLK_MROWS);
+      int n0 = band.lo[m0];
+      int nb = band.hi[m1 - 1] - n0 + 1;
+      tmp.resize((size_t)(m1 - m0) * nb);
+      blockedScoreRows<Op>(A + (size_t)m0 * cols, 0, m1 - m0,
+			   B + (size_t)n0 * cols, nb, cols, &tmp[0]);
+      for (int m = m0; m < m1; ++m) {
+	const float *row = &tmp[0] + (size_t)(m - m0) * nb - n0;
+	std::copy(row + band.lo[m], row + band.hi[m] + 1, &C(m, band.lo[m]));
+      }
+    }
+  }
+}
+
+void DynProg::score_band(MatF &mCoords, MatF &nCoords, BandMatF &scores,
+			 const char *type) {
+  const Band &band = *scores.band;
+  int cols = mCoords.cols();
+  if (cols != nCoords.cols() || band.rows != mCoords.rows() ||
+      band.cols != nCoords.rows())
+    throw DynProgError("assertion failled");
+  std::vector<float> mTmp, nTmp;
+  if (!strcmp(type, "cor_opt")) {
+    // cells outside of the diagonal band of score_pearsons_r_opt are 0
+    int s_mlen = band.rows, s_nlen = band.cols;
+    const int dfd = 10;
+    int diff = s_mlen - s_nlen;
+    float undef = diff <= 0 ? INFINITY : 0;
+    int span = s_nlen / dfd + 2 * (diff < 0 ? -diff : diff);
+    mTmp.resize(2 * s_mlen);
+    nTmp.resize(2 * s_nlen);
+    corOptSums(nCoords, &nTmp[0], &nTmp[s_nlen]);
+    corOptSums(mCoords, &mTmp[0], &mTmp[s_mlen], m_sum, m_sumsq);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16) num_threads(threads) if(threads > 1)
+#endif
+    for (int m = 0; m < s_mlen; ++m) {
+      for (int n = band.lo[m]; n <= band.hi[m]; ++n) {
+	if (n >= m - s_nlen / dfd && n < m + span)
+	  scores(m, n) = corOptCell(mCoords, m, nCoords, n, &mTmp[0],
+				    &mTmp[s_mlen], &nTmp[0], &nTmp[s_nlen],
+				    cols, undef);
+	else
+	  scores(m, n) = 0;
+      }
+    }
+  } else if (!strcmp(type, "prd")) {
+    blockedBandScores<ProductOp>(mCoords.pointer(), nCoords.pointer(), cols,
+				 scores, threads);
+  } else if (!strcmp(type, "cov")) {
+    if (!m_rows)
+      centerRows(mCoords, mTmp, 0, m_dsum);
+    blockedBandScores<ProductOp>(m_rows ? m_rows : &mTmp[0],
+				 nCoords.pointer(), cols, scores, threads);
+    for (size_t i = 0; i < scores.vals.size(); ++i)
+      scores.vals[i] /= (float)cols;
+  } else if (!strcmp(type, "cor")) {
+    if (!m_rows)
+      centerRows(mCoords, mTmp, 1, m_dsum);
+    centerRows(nCoords, nTmp, 1);
+    blockedBandScores<ProductOp>(m_rows ? m_rows : &mTmp[0], &nTmp[0], cols,
+				 scores, threads);
+  } else if (!strcmp(type, "euc")) {
+    blockedBandScores<SqDiffOp>(mCoords.pointer(), nCoords.pointer(), cols,
+				scores, threads);
+    for (size_t i = 0; i < scores.vals.size(); ++i)
+      scores.vals[i] = sqrt(scores.vals[i]);
+  } else {
+    Rprintf("Unrecognized score type for a banded alignment!: %s\n", type);
+    R_ShowMessage("Serious error in obiwarp.");
+  }
+}
+
 
 void DynProg::expandFlag(MatI &flagged, int flag, int numSteps, MatI &expanded) {
   int m_length = flagged.rows();
@@ -833,7 +1183,7 @@ void DynProg::expandFlag(MatI &flagged, int flag, int numSteps, MatI &expanded)
 }
 
 void entropyXY(MatI &binIndX, MatI &binIndY, VecF &entropyX, VecF &entropyY, MatF &scores, int numBins) {
-  if(binIndX.cols() != binIndY.cols()) Rf_error("assertion failled in obiwarp\n");
+  if(binIndX.cols() != binIndY.cols()) throw DynProgError("assertion failled");
   for (int m = 0; m < binIndY.rows(); ++m) {
     for (int n = 0; n < binIndX.rows(); ++n) {
       MatI counts(numBins, numBins,0);
@@ -949,6 +1299,59 @@ void DynProg::linear_less_before(float m, float b, int veclen, VecF &lessbefore)
   lessbefore.take(veclen, tmparr);
 }
 
+// Fills the cells [m0, m1) x [n0, n1) of the additive score matrix, the
+// gap length and the traceback matrix (see find_path); the cells above and
+// left of the tile have to be filled already.
+void DynProg::_fill_tile(MatF &smat, VecF &gap_penalty, MatF &tmp_asmat,
+			 MatI &tmp_tb, MatI &tmp_gapmat, int minimize,
+			 float diag_factor, float gap_factor,
+			 int m0, int m1, int n0, int n1) {
+  if (minimize) {  // complete the asmat with MINIMIZE!
+    for (int m = m0; m < m1; ++m) {
+      for (int n = n0; n < n1; ++n) {
+	float best_val; int best_pos;
+	float smat_at_ind = smat(m,n);
+	// MINIMIZE:
+	float smat_at_ind_times_gap_factor = smat_at_ind * gap_factor;
+
+	DynProg::_min(
+		      (smat_at_ind * diag_factor) + tmp_asmat(m-1,n-1),
+		      smat_at_ind_times_gap_factor + tmp_asmat(m-1,n) - gap_penalty[tmp_gapmat(m-1,n)],
+		      smat_at_ind_times_gap_factor + tmp_asmat(m,n-1) - gap_penalty[tmp_gapmat(m,n-1)],
+		      best_val, best_pos
+		      );
+	// SET the gap_length_matrix
+	if (best_pos == 1) { tmp_gapmat(m,n) = tmp_gapmat(m-1,n) + 1; }
+	else if (best_pos == 2) { tmp_gapmat(m,n) = tmp_gapmat(m,n-1) + 1; }
+	else { tmp_gapmat(m,n) = 0; }
+	tmp_tb(m,n) = best_pos; tmp_asmat(m,n) = best_val;
+      }
+    }
+  }
+  else { // complete the asmat with MAXIMIZE!
+    for (int m = m0; m < m1; ++m) {
+      for (int n = n0; n < n1; ++n) {
+	float best_val; int best_pos;
+	float smat_at_ind = smat(m,n);
+	// MAXIMIZE:
+	float smat_at_ind_times_gap_factor = smat_at_ind * gap_factor;
+
+	DynProg::_max(
+		      ( smat_at_ind * diag_factor ) + tmp_asmat(m-1,n-1),
+		      smat_at_ind_times_gap_factor + tmp_asmat(m-1,n) - gap_penalty[tmp_gapmat(m-1,n)],
+		      smat_at_ind_times_gap_factor + tmp_asmat(m,n-1) - gap_penalty[tmp_gapmat(m,n-1)],
+		      best_val, best_pos
+		      );
+	// SET the gap_length_matrix
+	if (best_pos == 1) { tmp_gapmat(m,n) = tmp_gapmat(m-1,n) + 1; }
+	else if (best_pos == 2) { tmp_gapmat(m,n) = tmp_gapmat(m,n-1) + 1; }
+	else { tmp_gapmat(m,n) = 0; }
+	tmp_tb(m,n) = best_pos; tmp_asmat(m,n) = best_val;
+      }
+    }
+  }
+}
+
 // gap penalty is ZERO indexed (i.e. the _first_ gap penalty is
 // accessed at gap_penalty[0]
 void DynProg::find_path(MatF& smat, VecF &gap_penalty, int minimize,
@@ -1061,49 +1464,23 @@ void DynProg::find_path(MatF& smat, VecF &gap_penalty, int minimize,
       }
     }
   }
-  // COMPLETE the tmp_asmat:
-  if (minimize) {  // complete the asmat with MINIMIZE!
-    for (int m = 1; m < length_m; ++m) {
-      for (int n = 1; n < length_n; ++n) {
-	float best_val; int best_pos;
-	float smat_at_ind = smat(m,n);
-	// MINIMIZE:
-	float smat_at_ind_times_gap_factor = smat_at_ind * gap_factor;
-
-	DynProg::_min(
-		      (smat_at_ind * diag_factor) + tmp_asmat(m-1,n-1),
-		      smat_at_ind_times_gap_factor + tmp_asmat(m-1,n) - gap_penalty[tmp_gapmat(m-1,n)],
-		      smat_at_ind_times_gap_factor + tmp_asmat(m,n-1) - gap_penalty[tmp_gapmat(m,n-1)],
-		      best_val, best_pos
-		      );
-	// SET the gap_length_matrix
-	if (best_pos == 1) { tmp_gapmat(m,n) = tmp_gapmat(m-1,n) + 1; }
-	else if (best_pos == 2) { tmp_gapmat(m,n) = tmp_gapmat(m,n-1) + 1; }
-	else { tmp_gapmat(m,n) = 0; }
-	tmp_tb(m,n) = best_pos; tmp_asmat(m,n) = best_val;
-      }
-    }
-  }
-  else { // complete the asmat with MAXIMIZE!
-    for (int m = 1; m < length_m; ++m) {
-      for (int n = 1; n < length_n; ++n) {
-	float best_val; int best_pos;
-	float smat_at_ind = smat(m,n);
-	// MAXIMIZE:
-	float smat_at_ind_times_gap_factor = smat_at_ind * gap_factor;
-
-	DynProg::_max(
-		      ( smat_at_ind * diag_factor ) + tmp_asmat(m-1,n-1),
-		      smat_at_ind_times_gap_factor + tmp_asmat(m-1,n) - gap_penalty[tmp_gapmat(m-1,n)],
-		      smat_at_ind_times_gap_factor + tmp_asmat(m,n-1) - gap_penalty[tmp_gapmat(m,n-1)],
-		      best_val, best_pos
-		      );
-	// SET the gap_length_matrix
-	if (best_pos == 1) { tmp_gapmat(m,n) = tmp_gapmat(m-1,n) + 1; }
-	else if (best_pos == 2) { tmp_gapmat(m,n) = tmp_gapmat(m,n-1) + 1; }
-	else { tmp_gapmat(m,n) = 0; }
-	tmp_tb(m,n) = best_pos; tmp_asmat(m,n) = best_val;
-      }
+  // COMPLETE the tmp_asmat in tiles of DP_TILE x DP_TILE cells: the tiles
+  // on an anti-diagonal depend only on tiles of the previous anti-diagonals
+  // and are filled in parallel threads (same result for any number of them)
+  int ntile_m = (length_m - 1 + DP_TILE - 1) / DP_TILE;
+  int ntile_n = (length_n - 1 + DP_TILE - 1) / DP_TILE;
+  for (int d = 0; d < ntile_m + ntile_n - 1; ++d) {
+    int tile_from = max(0, d - ntile_n + 1);
+    int tile_to = min(d, ntile_m - 1);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(threads) if(threads > 1 && tile_to > tile_from)
+#endif
+    for (int t = tile_from; t <= tile_to; ++t) {
+      int m0 = 1 + t * DP_TILE;
+      int n0 = 1 + (d - t) * DP_TILE;
+      _fill_tile(smat, gap_penalty, tmp_asmat, tmp_tb, tmp_gapmat, minimize,
+		 diag_factor, gap_factor, m0, min(m0 + DP_TILE, length_m),
+		 n0, min(n0 + DP_TILE, length_n));
     }
   }
   //  ************************************************************
@@ -1141,3 +1518,263 @@ void DynProg::find_path(MatF& smat, VecF &gap_penalty, int minimize,
   _tbpath.take(tmp_tbpath);
   _gapmat.take(tmp_gapmat);
 }
+
+/************************************************************
+ * BANDED DYNAMIC PROGRAM
+ ************************************************************/
+void Band::set_from_times(const double *mtm, int rows_, const double *ntm,
+			  int cols_, double max_dev) {
+  rows = rows_;
+  cols = cols_;
+  lo.resize(rows);
+  hi.resize(rows);
+  start.resize(rows);
+  if (rows == 0 || cols == 0) {
+    rows = 0;
+    return;
+  }
+  int l = 0, h = -1;
+  for (int m = 0; m < rows; ++m) {
+    while (l < cols && ntm[l] < mtm[m] - max_dev) ++l;
+    while (h + 1 < cols && ntm[h + 1] <= mtm[m] + max_dev) ++h;
+    lo[m] = min(l, cols - 1);
+    hi[m] = max(h, lo[m]);
+  }
+  _connect();
+}
+
+void Band::set_from_path(const VecI &mpath, const VecI &npath, int factor,
+			 int radius, int rows_, int cols_) {
+  rows = rows_;
+  cols = cols_;
+  lo.resize(rows);
+  hi.resize(rows);
+  start.resize(rows);
+  if (rows == 0 || cols == 0) {
+    rows = 0;
+    return;
+  }
+  // columns of the path in each coarse row; rows without any (before the
+  // start or after the end of a local alignment) take the last column of the
+  // previous row (or the first of the next)
+  int crows = (rows + factor - 1) / factor;
+  std::vector<int> clo(crows, -1), chi(crows, -1);
+  for (int i = 0; i < mpath.len(); ++i) {
+    int M = mpath[i], N = npath[i];
+    if (M < 0 || M >= crows) continue;
+    if (chi[M] < 0 || N < clo[M]) clo[M] = N;
+    if (N > chi[M]) chi[M] = N;
+  }
+  int prev = -1;
+  for (int M = 0; M < crows; ++M) {
+    if (chi[M] < 0) {
+      clo[M] = chi[M] = prev;
+    } else
+      prev = chi[M];
+  }
+  int next = 0;
+  for (int M = crows - 1; M >= 0; --M) {
+    if (chi[M] < 0) {
+      clo[M] = chi[M] = next;
+    } else if (clo[M] >= 0)
+      next = clo[M];
+  }
+  for (int m = 0; m < rows; ++m) {
+    int M = m / factor;
+    lo[m] = min(max(0, (clo[M] - radius) * factor), cols - 1);
+    hi[m] = max(min(cols - 1, (chi[M] + radius + 1) * factor - 1), lo[m]);
+  }
+  _connect();
+}
+
+void Band::_connect() {
+  // the band has to contain both corners and a path between them
+  lo[0] = 0;
+  hi[rows - 1] = cols - 1;
+  for (int m = rows - 1; m > 0; --m) {
+    if (hi[m - 1] < lo[m] - 1) hi[m - 1] = lo[m] - 1;
+  }
+  size_t off = 0;
+  for (int m = 0; m < rows; ++m) {
+    start[m] = off;
+    off += hi[m] - lo[m] + 1;
+  }
+}
+
+// _fill_tile for the cells of the band within the tile; moves from cells
+// outside of the band are not allowed.
+void DynProg::_fill_band_tile(BandMatF &smat, VecF &gap_penalty,
+			      BandMatF &asmat, BandMatC &tb, BandMatI &gapmat,
+			      int minimize, float diag_factor,
+			      float gap_factor, int m0, int m1, int n0,
+			      int n1) {
+  const Band &band = *smat.band;
+  const float worst = minimize ? INFINITY : -INFINITY;
+  for (int m = m0; m < m1; ++m) {
+    int nt = min(n1, band.hi[m] + 1);
+    for (int n = max(n0, band.lo[m]); n < nt; ++n) {
+      float best_val; int best_pos;
+      float smat_at_ind = smat(m,n);
+      float smat_at_ind_times_gap_factor = smat_at_ind * gap_factor;
+      float diag = worst, top = worst, left = worst;
+      if (band.has(m-1,n-1))
+	diag = (smat_at_ind * diag_factor) + asmat(m-1,n-1);
+      if (band.has(m-1,n))
+	top = smat_at_ind_times_gap_factor + asmat(m-1,n) - gap_penalty[gapmat(m-1,n)];
+      if (n > band.lo[m])
+	left = smat_at_ind_times_gap_factor + asmat(m,n-1) - gap_penalty[gapmat(m,n-1)];
+      if (minimize)
+	DynProg::_min(diag, top, left, best_val, best_pos);
+      else
+	DynProg::_max(diag, top, left, best_val, best_pos);
+      // SET the gap_length_matrix; with NaN scores the move may come from
+      // outside of the band (the traceback fails then)
+      if (best_pos == 1 && band.has(m-1,n)) { gapmat(m,n) = gapmat(m-1,n) + 1; }
+      else if (best_pos == 2 && n > band.lo[m]) { gapmat(m,n) = gapmat(m,n-1) + 1; }
+      else { gapmat(m,n) = 0; }
+      tb(m,n) = best_pos; asmat(m,n) = best_val;
+    }
+  }
+}
+
+void DynProg::find_path_band(BandMatF &smat, VecF &gap_penalty, int minimize,
+			     float diag_factor, float gap_factor, int local,
+			     float init_penalty) {
+  const Band &band = *smat.band;
+  int length_m = band.rows;
+  int length_n = band.cols;
+
+  if (gap_penalty.len() == 0) {
+    double sum = 0;
+    for (size_t i = 0; i < smat.vals.size(); ++i) sum += smat.vals[i];
+    linear_less_before(DEFAULT_GAP_PENALTY_SLOPE,
+		       (float)(sum / smat.vals.size()), length_m + length_n,
+		       gap_penalty);
+    if (minimize) {
+      gap_penalty *= -1.f;
+    }
+  }
+
+  BandMatF asmat;
+  BandMatC tb;
+  BandMatI gapmat;
+  asmat.set_band(band);
+  tb.set_band(band);
+  gapmat.set_band(band);
+
+  asmat(0,0) = smat(0,0);
+  gapmat(0,0) = 0;
+  tb(0,0) = 0;
+  // the left side of the band are the first rows, the top side the first
+  // columns of row 0
+  int left_m = 1;
+  while (left_m < length_m && band.lo[left_m] == 0) ++left_m;
+  for (int m = 1; m < left_m; ++m) {
+    float top = (smat(m,0) * gap_factor) + asmat(m-1,0) - gap_penalty[gapmat(m-1,0)];
+    float diag = (smat(m,0) * diag_factor) - init_penalty;  // drop in from left side
+    if (!local || (minimize ? !(diag <= top) : !(diag >= top))) {
+      gapmat(m,0) = gapmat(m-1,0) + 1;
+      asmat(m,0) = top; tb(m,0) = 1;  // path is from above
+    } else {
+      gapmat(m,0) = 0;
+      asmat(m,0) = diag; tb(m,0) = 0;
+    }
+  }
+  for (int n = 1; n <= band.hi[0]; ++n) {
+    float left = (smat(0,n) * gap_factor) + asmat(0,n-1) - gap_penalty[gapmat(0,n-1)];
+    float diag = (smat(0,n) * diag_factor) - init_penalty;  // drop in from top
+    if (!local || (minimize ? !(diag <= left) : !(diag >= left))) {
+      gapmat(0,n) = gapmat(0,n-1) + 1;
+      asmat(0,n) = left; tb(0,n) = 2;  // path is from left
+    } else {
+      gapmat(0,n) = 0;
+      asmat(0,n) = diag; tb(0,n) = 0;
+    }
+  }
+
+  // COMPLETE the asmat in tiles as in find_path, skipping tiles outside of
+  // the band
+  int ntile_m = (length_m - 1 + DP_TILE - 1) / DP_TILE;
+  int ntile_n = (length_n - 1 + DP_TILE - 1) / DP_TILE;
+  for (int d = 0; d < ntile_m + ntile_n - 1; ++d) {
+    int tile_from = max(0, d - ntile_n + 1);
+    int tile_to = min(d, ntile_m - 1);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(threads) if(threads > 1 && tile_to > tile_from)
+#endif
+    for (int t = tile_from; t <= tile_to; ++t) {
+      int m0 = 1 + t * DP_TILE;
+      int m1 = min(m0 + DP_TILE, length_m);
+      int n0 = 1 + (d - t) * DP_TILE;
+      int n1 = min(n0 + DP_TILE, length_n);
+      if (n0 > band.hi[m1 - 1] || n1 <= band.lo[m0])
+	continue;
+      _fill_band_tile(smat, gap_penalty, asmat, tb, gapmat, minimize,
+		      diag_factor, gap_factor, m0, m1, n0, n1);
+    }
+  }
+
+  int optimal_m = length_m - 1;
+  int optimal_n = length_n - 1;
+  if (local) {
+    // best cell on the right and bottom sides, as _global_max/_global_min
+    int right_m = length_m - 1;
+    while (right_m > 0 && band.hi[right_m - 1] == length_n - 1) --right_m;
+    float best_right = asmat(right_m, length_n - 1);
+    int m_index = right_m;
+    for (int m = right_m; m < length_m; ++m) {
+      float v = asmat(m, length_n - 1);
+      if (minimize ? v <= best_right : v >= best_right) {
+	best_right = v; m_index = m;
+      }
+    }
+    int bottom_n = band.lo[length_m - 1];
+    float best_bottom = asmat(length_m - 1, bottom_n);
+    int n_index = bottom_n;
+    for (int n = bottom_n; n < length_n; ++n) {
+      float v = asmat(length_m - 1, n);
+      if (minimize ? v <= best_bottom : v >= best_bottom) {
+	best_bottom = v; n_index = n;
+      }
+    }
+    if (minimize ? best_right < best_bottom : best_right > best_bottom)
+      optimal_m = m_index;
+    else
+      optimal_n = n_index;
+  }
+
+  if (minimize) {
+    gap_penalty *= -1.f;
+  }
+
+  // traceback, as _traceback
+  std::vector<int> m_eqr, n_eqr;
+  std::vector<float> score_pathr;
+  int m = optimal_m, n = optimal_n;
+  while (m != -1 && n != -1) {
+    m_eqr.push_back(m);
+    n_eqr.push_back(n);
+    score_pathr.push_back(smat(m,n));
+    int val = tb(m,n);
+    if (val == 0) { m -= 1; n -= 1; }  // Diag
+    else if (val == 1) { m -= 1; }     // UP
+    else { n -= 1; }                   // Left
+    // only with NaN scores
+    if (m != -1 && n != -1 && !band.has(m, n))
+      throw DynProgError("the alignment path left the band");
+  }
+  int cnt = m_eqr.size();
+  int *tmpEquiv_m = new int[cnt];
+  int *tmpEquiv_n = new int[cnt];
+  float *tmpScores = new float[cnt];
+  for (int i = 0; i < cnt; ++i) {
+    tmpEquiv_m[i] = m_eqr[cnt - 1 - i];
+    tmpEquiv_n[i] = n_eqr[cnt - 1 - i];
+    tmpScores[i] = score_pathr[cnt - 1 - i];
+  }
+  _mCoords.take(cnt, tmpEquiv_m);
+  _nCoords.take(cnt, tmpEquiv_n);
+  _sCoords.take(cnt, tmpScores);
+  _bestScore = asmat(_mCoords[cnt - 1], _nCoords[cnt - 1]);
+  _smat = NULL;
+}
@@ -2,6 +2,8 @@
 #define _DYNPROG_H
 
 #include "math.h"
+#include <vector>
+#include <cstddef>
 
 #include "vec.h"
 #include "mat.h"
@@ -9,6 +11,69 @@
 using namespace VEC;
 
 
+// side length of the tiles in which the dynamic program is computed
+const int DP_TILE = 128;
+
+// Thrown instead of raising an R error, the alignments of R_obiwarp_batch
+// run in parallel threads which must not call the R API.
+struct DynProgError {
+    const char *msg;
+    DynProgError(const char *m) : msg(m) {}
+};
+
+// Band of a rows x cols matrix: row m contains the columns lo[m] to hi[m].
+// lo and hi are non-decreasing, the band contains (0,0) and
+// (rows - 1, cols - 1) and the columns of consecutive rows overlap or are
+// adjacent, hence each cell of the band can be reached from (0,0).
+class Band {
+    public:
+        int rows;
+        int cols;
+        std::vector<int> lo;
+        std::vector<int> hi;
+        std::vector<size_t> start;  // offset of (m, lo[m]) in the storage
+
+        Band() { rows = 0; cols = 0; }
+        // cells (m,n) with |mtm[m] - ntm[n]| <= max_dev (times increasing)
+        void set_from_times(const double *mtm, int rows, const double *ntm,
+                            int cols, double max_dev);
+        // cells within radius cells (at the coarse resolution) of the path
+        // (mpath, npath) through the matrix with factor rows and columns
+        // aggregated into one (multiresolution alignment)
+        void set_from_path(const VecI &mpath, const VecI &npath, int factor,
+                           int radius, int rows, int cols);
+        size_t size() const {
+            return rows ? start[rows - 1] + (hi[rows - 1] - lo[rows - 1] + 1) : 0;
+        }
+        bool has(int m, int n) const {
+            return m >= 0 && n >= lo[m] && n <= hi[m];
+        }
+        size_t index(int m, int n) const { return start[m] + (n - lo[m]); }
+
+    private:
+        // adds the corners and connects the rows, sets start
+        void _connect();
+};
+
+// Values of the cells of a Band.
+template <class T>
+class BandMat {
+    public:
+        const Band *band;
+        std::vector<T> vals;
+
+        BandMat() { band = NULL; }
+        void set_band(const Band &b, T val = T()) {
+            band = &b;
+            vals.assign(b.size(), val);
+        }
+        T &operator()(int m, int n) { return vals[band->index(m, n)]; }
+        T operator()(int m, int n) const { return vals[band->index(m, n)]; }
+};
+typedef BandMat<float> BandMatF;
+typedef BandMat<int> BandMatI;
+typedef BandMat<unsigned char> BandMatC;
+
 class DynProg {
     private:
         float DEFAULT_GAP_PENALTY_SLOPE;
@@ -26,13 +91,38 @@ class DynProg {
         float _bestScore; // the scores at each m,n coordinate!
         float _prob;
 
-        DynProg() { DEFAULT_GAP_PENALTY_SLOPE = 2.f; }
+        // use the cache-blocked kernels for the prd, cov, cor and euc scores
+        int blocked;
+        // number of threads for the score matrix and the dynamic program
+        int threads;
+        // optional precomputed row sums (float and double precision) and
+        // row sums of squares of mCoords (e.g. of a shared AlignRef); they
+        // have to match the rows passed to the score functions
+        const float *m_sum;
+        const float *m_sumsq;
+        const double *m_dsum;
+        // optional rows of mCoords as used by the cov and cor scores (see
+        // prepare_rows), e.g. shared between the alignments of a batch
+        const float *m_rows;
+        // print messages (has to be 0 if not called from the main thread)
+        int verbose;
+
+        DynProg() { DEFAULT_GAP_PENALTY_SLOPE = 2.f; blocked = 1; threads = 1;
+                    m_sum = NULL; m_sumsq = NULL; m_dsum = NULL;
+                    m_rows = NULL; verbose = 1; }
 
         // If gap_penalty array len = 0, then a linear gap penalty based on the
         // average matrix score will be used
         // neither diag or gap factor can be 0.0 for minimization
         void find_path(MatF &smat, VecF &gap_penalty, int minimize=0, float diag_factor=2.f,
 		       float gap_factor=1.f, int local=0, float init_penalty=0.0f);
+        // find_path on the cells of a band only; sets the path (_mCoords,
+        // _nCoords, _sCoords) and _bestScore but not the full matrices
+        // (_asmat, _tb, _tbpath, _gapmat). Gives the same path as find_path
+        // if the band covers the path (in particular for a full band).
+        void find_path_band(BandMatF &smat, VecF &gap_penalty, int minimize=0,
+                float diag_factor=2.f, float gap_factor=1.f, int local=0,
+                float init_penalty=0.0f);
         // If gap_penalty array len = 0, then a linear gap penalty based on the
         // average matrix score will be used
         // a gap is introduced without adding in the score of the matrix
@@ -55,6 +145,14 @@ class DynProg {
         void path_accuracy_details(VecF &mWarpMapFt, VecF &nWarpMapFt, VecF &mVals, VecF &nVals, VecF &sq_res_yeqx, VecF &abs_diff, int linear_interp=0);
         void path_accuracy(VecF &mWarpMapFt, VecF &nWarpMapFt, VecF &mVals, VecF &nVals, float &sum_sq_res_yeqx, float &avg_sq_res_yeqx, float &sum_abs_diff, float &avg_abs_diff, int linear_interp=0);
         void path_accuracy(VecF &m_tm, VecF &n_tm, VecI &mWarpMap, VecI &nWarpMap, VecF &mVals, VecF &nVals, float &sum_sq_res_yeqx, float &avg_sq_res_yeqx, float &sum_abs_diff, float &avg_abs_diff, int linear_interp=0);
+        void _fill_tile(MatF &smat, VecF &gap_penalty, MatF &tmp_asmat,
+                MatI &tmp_tb, MatI &tmp_gapmat, int minimize,
+                float diag_factor, float gap_factor,
+                int m0, int m1, int n0, int n1);
+        void _fill_band_tile(BandMatF &smat, VecF &gap_penalty,
+                BandMatF &asmat, BandMatC &tb, BandMatI &gapmat,
+                int minimize, float diag_factor, float gap_factor,
+                int m0, int m1, int n0, int n1);
         void _max(float diag, float top, float left, float &val, int &pos);
         void _min(float diag, float top, float left, float &val, int &pos);
         float _global_max(MatF& asmat, int& m_index, int& n_index);
@@ -86,8 +184,22 @@ class DynProg {
 
         void score_mutual_info(MatF &mCoords, MatF &nCoords, MatF &scores, int num_bins=2);
         void score_euclidean(MatF &mCoords, MatF &nCoords, MatF &scores);
+        // cache-blocked versions of the above, same results up to rounding;
+        // cor and cov use rows centered (and normalized) in double precision
+        void score_product_blocked(MatF &mCoords, MatF &nCoords, MatF &scores);
+        void score_covariance_blocked(MatF &mCoords, MatF &nCoords, MatF &scores);
+        void score_pearsons_r_blocked(MatF &mCoords, MatF &nCoords, MatF &scores);
+        void score_euclidean_blocked(MatF &mCoords, MatF &nCoords, MatF &scores);
+        // rows of mCoords centered (cov) or centered and normalized (cor) as
+        // used by the blocked and banded scores (empty for other types); can
+        // be set as m_rows for all alignments against mCoords
+        void prepare_rows(MatF &mCoords, const char *type,
+                          std::vector<float> &out);
         // convenience method for scoring
         void score(MatF &mCoords, MatF &nCoords, MatF &scores, const char *type, int mi_num_bins=2);
+        // scores of the cells of the band of scores only (the band has to be
+        // set); same values as score() with the blocked kernels
+        void score_band(MatF &mCoords, MatF &nCoords, BandMatF &scores, const char *type);
 
 //   DynProg::expandFlag(mat1, 2, 1)
 //
@@ -4,6 +4,7 @@
 #include "stdio.h"
 
 #include "lmat.h"
+#include "xcms_alignref.h"
 #include "assert.h"
 #include "math.h"
 #include "vec.h"
@@ -52,16 +53,61 @@ extern "C" {
     _mz = new VecF(_mz_vals, mz_tmp);
 
     // Read the matrix:
-    int rows_by_cols = _tm_vals * _mz_vals;
+    size_t rows_by_cols = (size_t)_tm_vals * _mz_vals;
     float *mat_tmp = new float[rows_by_cols];
 
-    for(int i=0; i < rows_by_cols; i++) {
+    for(size_t i=0; i < rows_by_cols; i++) {
       mat_tmp[i] = intensity[i];
     }
 
     _mat = new MatF(_tm_vals, _mz_vals, mat_tmp);
   }
 
+  void LMat::set_from_xcms(int valuescantime, double *pscantime, int mzrange, double *mz, float *intensity) {
+    delete _mz;
+    delete _tm;
+    delete _mat;
+
+    _tm_vals = valuescantime;
+    float *tm_tmp = new float[_tm_vals];
+    for(int i=0; i < _tm_vals; i++) {
+      tm_tmp[i] = pscantime[i];
+    }
+    _tm = new VecF(_tm_vals, tm_tmp);
+
+    _mz_vals = mzrange;
+    float *mz_tmp = new float[_mz_vals];
+    for(int i=0; i < _mz_vals; i++) {
+      mz_tmp[i] = mz[i];
+    }
+    _mz = new VecF(_mz_vals, mz_tmp);
+
+    // shallow: the memory is not released by the MatF
+    _mat = new MatF(_tm_vals, _mz_vals, intensity, 1);
+  }
+
+  void LMat::set_from_reference(const AlignRef &ref, int first, int last,
+				int pad_before, int pad_after, double *mz) {
+    delete _mz;
+    delete _tm;
+
+    _tm_vals = last - first + 1;
+    float *tm_tmp = new float[_tm_vals];
+    for(int i=0; i < _tm_vals; i++) {
+      tm_tmp[i] = ref.scantime[first + i];
+    }
+    _tm = new VecF(_tm_vals, tm_tmp);
+
+    _mz_vals = pad_before + ref.nbin + pad_after;
+    float *mz_tmp = new float[_mz_vals];
+    for(int i=0; i < _mz_vals; i++) {
+      mz_tmp[i] = mz[i];
+    }
+    _mz = new VecF(_mz_vals, mz_tmp);
+
+    ref.rows(first, last, pad_before, pad_after, *_mat);
+  }
+
   void LMat::print_xcms() {
     float *mztmp = (float*)(*_mz);
     float *tmtmp = (float*)(*_tm);
@@ -153,33 +153,160 @@ int ComparIntIndex(void *numptr, const void *i1, const void *i2) {
     return num[*(int*)i1] - num[*(int*)i2];
 }
 
-void RectUnique(const double *m, const int *order, const int *nrow,
-                const int *ncol, const double *xdiff, const double *ydiff,
-                int *keep) {
+/*
+ * RectUnique: the rectangles (rows of m with columns xmin, xmax, ymin, ymax)
+ * are processed in the given order; a rectangle is kept if it does not
+ * overlap (with tolerances xdiff and ydiff) any rectangle kept before.
+ *
+ * The rectangles are sorted by xmin. The kept rectangles are then activated
+ * in a segment tree over this order, each node storing the largest xmax and
+ * ymax and the smallest ymin of its active rectangles. The rectangles that
+ * could overlap a rectangle are a prefix of the order (xmin not larger than
+ * its xmax + xdiff) and only nodes whose bounds could overlap it are
+ * searched. The tests are the same (monotone) expressions as the pairwise
+ * comparison, so the result is identical.
+ */
+
+struct rectTree {
+    int size;       /* number of leaves (power of 2) */
+    int *nactive;   /* number of active rectangles */
+    double *xmax, *ymin, *ymax;
+};
+
+static int rect_overlap(const double *m, int nrow, int i, int j,
+                        double xdiff, double ydiff) {
+    return !(m[i] - m[nrow + j] > xdiff || m[j] - m[nrow + i] > xdiff ||
+             m[2*nrow + i] - m[3*nrow + j] > ydiff ||
+             m[2*nrow + j] - m[3*nrow + i] > ydiff);
+}
+
+/* Is an active rectangle (leaves < last) overlapping rectangle i? */
+static int rectTree_overlap(const struct rectTree *t, const int *sidx,
+                            int last, const double *m, int nrow, int i,
+                            double xdiff, double ydiff, int node, int lo,
+                            int hi) {
+    if (lo >= last || t->nactive[node] == 0 ||
+        m[i] - t->xmax[node] > xdiff ||
+        m[2*nrow + i] - t->ymax[node] > ydiff ||
+        t->ymin[node] - m[3*nrow + i] > ydiff)
+        return 0;
+    if (hi - lo == 1)
+        return rect_overlap(m, nrow, i, sidx[lo], xdiff, ydiff);
+    return rectTree_overlap(t, sidx, last, m, nrow, i, xdiff, ydiff,
+                            2*node, lo, (lo + hi) / 2) ||
+        rectTree_overlap(t, sidx, last, m, nrow, i, xdiff, ydiff,
+                         2*node + 1, (lo + hi) / 2, hi);
+}
+
+static void rectTree_activate(struct rectTree *t, int pos, double xmax,
+                              double ymin, double ymax) {
+    int node = t->size + pos;
+    t->nactive[node] = 1;
+    t->xmax[node] = xmax;
+    t->ymin[node] = ymin;
+    t->ymax[node] = ymax;
+    for (node /= 2; node > 0; node /= 2) {
+        t->nactive[node]++;
+        t->xmax[node] = fmax(t->xmax[2*node], t->xmax[2*node + 1]);
+        t->ymin[node] = fmin(t->ymin[2*node], t->ymin[2*node + 1]);
+        t->ymax[node] = fmax(t->ymax[2*node], t->ymax[2*node + 1]);
+    }
+}
+
+/* The pairwise comparison, for orders that are not a permutation. */
+static void RectUniquePairwise(const double *m, const int *order, int nrow,
+                               double xdiff, double ydiff, int *keep) {
 
     int    i, j, io, jo;
-    int    x1 = 0, x2 = *nrow, y1 = *nrow*2, y2 = *nrow*3;
 
-    for (i = 0; i < *nrow; i++) {
+    for (i = 0; i < nrow; i++) {
         io = order[i];
         keep[io] = 1;
         for (j = 0; j < i; j++) {
             jo = order[j];
-            if (keep[jo] &&
-                !(m[x1+io] - m[x2+jo] > *xdiff || m[x1+jo] - m[x2+io] > *xdiff ||
-                  m[y1+io] - m[y2+jo] > *ydiff || m[y1+jo] - m[y2+io] > *ydiff)) {
+            if (keep[jo] && rect_overlap(m, nrow, io, jo, xdiff, ydiff)) {
                 keep[io] = 0;
-                /* Debuging Code
-                printf("%i\t%3.1f\t%3.1f\t%4.0f\t%4.0f\t%i\t%3.1f\t%3.1f\t%4.0f\t%4.0f\n",
-                       i, m[x1+io], m[x2+io], m[y1+io], m[y2+io],
-                       j, m[x1+jo], m[x2+jo], m[y1+jo], m[y2+jo]);
-                */
                 break;
             }
         }
     }
 }
 
+void RectUnique(const double *m, const int *order, const int *nrow,
+                const int *ncol, const double *xdiff, const double *ydiff,
+                int *keep) {
+
+    int    i, k, io, n = *nrow, nkept = 0;
+    int    *pos, *sidx, *seen;
+    double *r, *sx;
+    struct rectTree t;
+
+    seen = (int *) R_alloc(n, sizeof(int));
+    for (i = 0; i < n; i++)
+        seen[i] = 0;
+    for (i = 0; i < n; i++) {
+        if (order[i] < 0 || order[i] >= n || seen[order[i]]) {
+            RectUniquePairwise(m, order, n, *xdiff, *ydiff, keep);
+            return;
+        }
+        seen[order[i]] = 1;
+    }
+
+    /* comparisons with missing values are never true: a missing minimum
+       (maximum) is equivalent to -Inf (Inf) */
+    r = (double *) R_alloc(4 * n, sizeof(double));
+    for (k = 0; k < 4; k++)
+        for (i = 0; i < n; i++)
+            r[k*n + i] = ISNAN(m[k*n + i]) ? (k % 2 ? R_PosInf : R_NegInf) :
+                m[k*n + i];
+
+    /* sort the rectangles by xmin */
+    sx = (double *) R_alloc(n, sizeof(double));
+    sidx = (int *) R_alloc(n, sizeof(int));
+    pos = (int *) R_alloc(n, sizeof(int));
+    for (i = 0; i < n; i++) {
+        sx[i] = r[i];
+        sidx[i] = i;
+    }
+    rsort_with_index(sx, sidx, n);
+    for (k = 0; k < n; k++)
+        pos[sidx[k]] = k;
+
+    for (t.size = 1; t.size < n; t.size *= 2)
+        ;
+    t.nactive = (int *) R_alloc(2 * t.size, sizeof(int));
+    t.xmax = (double *) R_alloc(2 * t.size, sizeof(double));
+    t.ymin = (double *) R_alloc(2 * t.size, sizeof(double));
+    t.ymax = (double *) R_alloc(2 * t.size, sizeof(double));
+    for (k = 0; k < 2 * t.size; k++) {
+        t.nactive[k] = 0;
+        t.xmax[k] = R_NegInf;
+        t.ymin[k] = R_PosInf;
+        t.ymax[k] = R_NegInf;
+    }
+
+    for (i = 0; i < n; i++) {
+        int lo = 0, hi = n;
+        io = order[i];
+        /* first rectangle with xmin - xmax(io) > xdiff */
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (sx[mid] - r[n + io] > *xdiff)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        if (nkept && rectTree_overlap(&t, sidx, lo, r, n, io, *xdiff, *ydiff,
+                                      1, 0, t.size)) {
+            keep[io] = 0;
+            continue;
+        }
+        rectTree_activate(&t, pos[io], r[n + io], r[2*n + io], r[3*n + io]);
+        keep[io] = 1;
+        nkept++;
+    }
+}
+
 SEXP DoubleMatrix(SEXP nrow, SEXP ncol) {
 
     SEXP matrix, dim;
@@ -4,6 +4,11 @@
 #include <limits.h>
 #include "util.h"
 #include "xcms.h"
+#include "float32Matrix.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 void ProfBinLin(double *xvals, double *yvals, int *numin,
                 double *xstart, double *xend, int *numout, double *out) {
@@ -321,33 +326,242 @@ void ProfMaxIdxM(double *xvals, double *yvals, int *numin, int *mindex, int *num
     }
 }
 
-void MedianFilter(double *inmat, int *m, int *n, int *mrad, int *nrad, double *outmat) {
-
-    int    i, j, k, l, mmin, mmax, nmin, nmax, bufLen;
-    double * sortBuf = (double *) malloc((*mrad*2+1)*(*nrad*2+1)*sizeof(double));
-
-    for (i = 0; i < *m; i++) {
-        for (j = 0; j < *n; j++) {
-            mmin = (i - *mrad > 0) ? (i - *mrad) : 0;
-            mmax = (i + *mrad < *m) ? (i + *mrad) : *m - 1;
-            nmin = (j - *nrad > 0) ? (j - *nrad) : 0;
-            nmax = (j + *nrad < *n) ? (j + *nrad) : *n - 1;
-            bufLen = 0;
-            for (k = mmin; k <= mmax; k++) {
-                for (l = nmin; l <= nmax; l++) {
-                    sortBuf[bufLen] = *(inmat + k + *m*l);
-                    bufLen++;
-                }
-            }
-            qsort(sortBuf, bufLen, sizeof(double), CompareDouble);
-            if (bufLen % 2 == 1)
-                *(outmat + i + *m*j) = sortBuf[(bufLen-1)/2];
+/*
+ * Sliding window median: the values of the window are split into a max-heap
+ * (lower half) and a min-heap (upper half). Values leaving the window are
+ * not removed from the heaps but only no longer counted (the row of each
+ * entry tells whether it is still in the window) and are dropped once they
+ * reach the top of a heap, or when the heap is full.
+ */
+struct mfEntry {
+    double v;
+    int k;          /* row */
+    int slot;       /* position in the window */
+};
+
+struct mfHeap {
+    struct mfEntry *e;
+    int n, cap;
+    int valid;      /* number of entries still in the window */
+    int max;        /* 1 for a max-heap */
+};
+
+static int mfHeap_above(const struct mfHeap *h, const struct mfEntry *a,
+                        const struct mfEntry *b) {
+    return h->max ? a->v > b->v : a->v < b->v;
+}
+
+static void mfHeap_down(struct mfHeap *h, int i) {
+    struct mfEntry v = h->e[i];
+    int c;
+    while ((c = 2 * i + 1) < h->n) {
+        if (c + 1 < h->n && mfHeap_above(h, &h->e[c + 1], &h->e[c]))
+            c++;
+        if (!mfHeap_above(h, &h->e[c], &v))
+            break;
+        h->e[i] = h->e[c];
+        i = c;
+    }
+    h->e[i] = v;
+}
+
+/* drops the entries of rows before kmin */
+static void mfHeap_compact(struct mfHeap *h, int kmin) {
+    int i, n = 0;
+    for (i = 0; i < h->n; i++)
+        if (h->e[i].k >= kmin)
+            h->e[n++] = h->e[i];
+    h->n = n;
+    for (i = n / 2 - 1; i >= 0; i--)
+        mfHeap_down(h, i);
+}
+
+static void mfHeap_push(struct mfHeap *h, struct mfEntry v, int kmin,
+                        char *side, char s) {
+    int i;
+    if (h->n == h->cap)
+        mfHeap_compact(h, kmin);
+    i = h->n++;
+    while (i > 0 && mfHeap_above(h, &v, &h->e[(i - 1) / 2])) {
+        h->e[i] = h->e[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->e[i] = v;
+    h->valid++;
+    side[v.slot] = s;
+}
+
+static struct mfEntry mfHeap_pop(struct mfHeap *h) {
+    struct mfEntry top = h->e[0];
+    h->e[0] = h->e[--h->n];
+    if (h->n > 0)
+        mfHeap_down(h, 0);
+    return top;
+}
+
+/* drops entries of rows before kmin from the top */
+static void mfHeap_prune(struct mfHeap *h, int kmin) {
+    while (h->n > 0 && h->e[0].k < kmin)
+        mfHeap_pop(h);
+}
+
+struct medianWindow {
+    struct mfHeap lo, hi;
+    char *side;     /* heap (1: lo, 2: hi) of the value at each slot */
+    int nnan;       /* number of NaN values in the window */
+    double *buf;
+};
+
+static void medianWindow_balance(struct medianWindow *w, int kmin) {
+    while (w->lo.valid > w->hi.valid + 1) {
+        mfHeap_prune(&w->lo, kmin);
+        w->lo.valid--;
+        mfHeap_push(&w->hi, mfHeap_pop(&w->lo), kmin, w->side, 2);
+    }
+    while (w->lo.valid < w->hi.valid) {
+        mfHeap_prune(&w->hi, kmin);
+        w->hi.valid--;
+        mfHeap_push(&w->lo, mfHeap_pop(&w->hi), kmin, w->side, 1);
+    }
+    mfHeap_prune(&w->lo, kmin);
+    mfHeap_prune(&w->hi, kmin);
+}
+
+static void medianWindow_add(struct medianWindow *w, double v, int k,
+                             int slot, int kmin) {
+    struct mfEntry e;
+    if (ISNAN(v)) {
+        w->nnan++;
+        w->side[slot] = 0;
+        return;
+    }
+    e.v = v;
+    e.k = k;
+    e.slot = slot;
+    mfHeap_prune(&w->lo, kmin);
+    mfHeap_prune(&w->hi, kmin);
+    if (w->lo.valid > 0 ? v <= w->lo.e[0].v :
+        (w->hi.valid == 0 || v <= w->hi.e[0].v))
+        mfHeap_push(&w->lo, e, kmin, w->side, 1);
+    else
+        mfHeap_push(&w->hi, e, kmin, w->side, 2);
+}
+
+static void medianWindow_remove(struct medianWindow *w, int slot) {
+    if (w->side[slot] == 0)
+        w->nnan--;
+    else if (w->side[slot] == 1)
+        w->lo.valid--;
+    else
+        w->hi.valid--;
+}
+
+/*
+ * Median filter on the numeric (inmat) or single precision (finmat, if
+ * inmat is NULL) m x n matrix. The columns are processed in parallel, the
+ * window moving down the rows of a column and being updated with the values
+ * of the rows entering and leaving it. Windows with NaN values are sorted
+ * as a whole (in the original order of the values), to return the same
+ * result as sorting each window.
+ */
+static void median_filter(const double *inmat, const float *finmat, int m,
+                          int n, int mrad, int nrad, double *outmat,
+                          int threads) {
+
+    int    wrow = 2 * mrad + 1, wcol = 2 * nrad + 1, wsize = wrow * wcol, t;
+    struct medianWindow *win;
+
+    if (threads < 1 || threads == NA_INTEGER)
+        threads = 1;
+    win = (struct medianWindow *) R_alloc(threads,
+                                          sizeof(struct medianWindow));
+    for (t = 0; t < threads; t++) {
+        win[t].lo.cap = 2 * wsize;
+        win[t].hi.cap = 2 * wsize;
+        win[t].lo.e = (struct mfEntry *) R_alloc(2 * wsize,
+                                                 sizeof(struct mfEntry));
+        win[t].hi.e = (struct mfEntry *) R_alloc(2 * wsize,
+                                                 sizeof(struct mfEntry));
+        win[t].side = R_alloc(wsize, sizeof(char));
+        win[t].buf = (double *) R_alloc(wsize, sizeof(double));
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(threads) if(threads > 1)
+#endif
+    for (int j = 0; j < n; j++) {
+        int i, k, l, cmin = 0, cmax = -1, mmin, mmax, bufLen;
+        int nmin = (j - nrad > 0) ? (j - nrad) : 0;
+        int nmax = (j + nrad < n) ? (j + nrad) : n - 1;
+#ifdef _OPENMP
+        struct medianWindow *w = win + omp_get_thread_num();
+#else
+        struct medianWindow *w = win;
+#endif
+        w->lo.n = w->lo.valid = 0;
+        w->lo.max = 1;
+        w->hi.n = w->hi.valid = 0;
+        w->hi.max = 0;
+        w->nnan = 0;
+        for (i = 0; i < m; i++) {
+            mmin = (i - mrad > 0) ? (i - mrad) : 0;
+            mmax = (i + mrad < m) ? (i + mrad) : m - 1;
+            for (; cmin < mmin; cmin++)
+                for (l = nmin; l <= nmax; l++)
+                    medianWindow_remove(w, (cmin % wrow) * wcol + l - nmin);
+            for (cmax++; cmax <= mmax; cmax++)
+                for (l = nmin; l <= nmax; l++)
+                    medianWindow_add(w, (inmat != NULL) ?
+                                     inmat[cmax + (size_t)m*l] :
+                                     finmat[cmax + (size_t)m*l], cmax,
+                                     (cmax % wrow) * wcol + l - nmin, cmin);
+            cmax = mmax;
+            medianWindow_balance(w, cmin);
+            if (w->nnan > 0) {
+                /* the order of a sort with NaN values depends on the input */
+                bufLen = 0;
+                for (k = mmin; k <= mmax; k++)
+                    for (l = nmin; l <= nmax; l++)
+                        w->buf[bufLen++] = (inmat != NULL) ?
+                            inmat[k + (size_t)m*l] : finmat[k + (size_t)m*l];
+                qsort(w->buf, bufLen, sizeof(double), CompareDouble);
+                if (bufLen % 2 == 1)
+                    outmat[i + (size_t)m*j] = w->buf[(bufLen-1)/2];
+                else
+                    outmat[i + (size_t)m*j] =
+                        (w->buf[(bufLen-2)/2] + w->buf[(bufLen)/2])/2;
+            } else if ((w->lo.valid + w->hi.valid) % 2 == 1)
+                outmat[i + (size_t)m*j] = w->lo.e[0].v;
             else
-                *(outmat + i + *m*j) = (sortBuf[(bufLen-2)/2] + sortBuf[(bufLen)/2])/2;
+                outmat[i + (size_t)m*j] = (w->lo.e[0].v + w->hi.e[0].v)/2;
         }
     }
+}
 
-    free(sortBuf);
+void MedianFilter(double *inmat, int *m, int *n, int *mrad, int *nrad,
+                  double *outmat, int *threads) {
+    median_filter(inmat, NULL, *m, *n, *mrad, *nrad, outmat, *threads);
+}
+
+/*
+ * Median filter on a file backed single precision matrix x (see
+ * float32Matrix.h) reading the values directly from the mapped file.
+ * Returns the filtered numeric matrix.
+ */
+SEXP MedianFilterFloat32(SEXP x, SEXP mrad, SEXP nrad, SEXP threads) {
+    SEXP ptr, res;
+    struct f32Matrix *mat;
+    int pmrad = asInteger(mrad), pnrad = asInteger(nrad);
+    if (pmrad < 0 || pnrad < 0)
+        error("'mrad' and 'nrad' have to be positive");
+    PROTECT(ptr = float32_file_open(x));
+    mat = float32_file_get(ptr);
+    PROTECT(res = allocMatrix(REALSXP, mat->nrow, mat->ncol));
+    median_filter(NULL, mat->data, mat->nrow, mat->ncol, pmrad, pnrad,
+                  REAL(res), asInteger(threads));
+    float32_file_close(ptr);
+    UNPROTECT(2);
+    return res;
 }
 
 int CompareDouble(const void *a, const void *b) {
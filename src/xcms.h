@@ -29,7 +29,10 @@ void ProfMaxIdx(double *xvals, double *yvals, int *numin,
 void ProfMaxIdxM(double *xvals, double *yvals, int *numin, int *mindex, int *nummi,
                  double *xstart, double *xend, int *numout, int *out);
 
-void MedianFilter(double *inmat, int *m, int *n, int *mrad, int *nrad, double *outmat);
+void MedianFilter(double *inmat, int *m, int *n, int *mrad, int *nrad, double *outmat,
+                  int *threads);
+
+SEXP MedianFilterFloat32(SEXP x, SEXP mrad, SEXP nrad, SEXP threads);
 
 int CompareDouble(const void *a, const void *b);
 
@@ -1,6 +1,9 @@
 // STDLIB:
 #include <cstdio>
 #include <cstring>
+#include <algorithm>
+#include <vector>
+#include <new>
 #include <iostream>
 #include <fstream>
 #include "string.h"
@@ -10,6 +13,8 @@
 #include "obiwarp/mat.h"
 #include "obiwarp/lmat.h"
 #include "obiwarp/xcms_dynprog.h"
+#include "obiwarp/xcms_alignref.h"
+#include "float32Matrix.h"
 
 // R
 #include <R.h>
@@ -23,21 +28,272 @@
 
 #define DEBUG (0)
 
+// Radius (in cells of the coarse level) of the corridor around the coarse
+// path in which the full resolution alignment is performed.
+#define MULTIRES_CORRIDOR (3)
+// Minimal number of scans at the coarse level.
+#define MULTIRES_MIN_SCANS (20)
+
+// Settings of the alignment (from the arguments of the R functions).
+struct AlignSettings {
+    const char *score;
+    double gap_init;
+    double gap_extend;
+    double factor_diag;
+    double factor_gap;
+    double init_penalty;
+    double rtdev;
+    int local;
+    int response;
+    int coarse;
+};
+
+static void align_settings(AlignSettings &set, SEXP response, SEXP score,
+			   SEXP gap_init, SEXP gap_extend,
+			   SEXP factor_diag, SEXP factor_gap,
+			   SEXP local_alignment, SEXP init_penalty,
+			   SEXP max_rt_dev, SEXP coarse_factor)
+{
+    set.score = CHAR(STRING_ELT(score, 0));
+    set.gap_init = *REAL(gap_init);
+    set.gap_extend = *REAL(gap_extend);
+    set.factor_diag = *REAL(factor_diag);
+    set.factor_gap = *REAL(factor_gap);
+    set.init_penalty = *REAL(init_penalty);
+    set.local = *INTEGER(AS_INTEGER(local_alignment));
+    set.response = *INTEGER(AS_INTEGER(response));
+    // with a maximal retention time deviation only the cells of the score
+    // matrix and of the dynamic program within the band are stored
+    set.rtdev = asReal(max_rt_dev);
+    set.coarse = asInteger(coarse_factor);
+}
+
+// Scores the rows of mmat against those of nmat (only within band if it is
+// not NULL) and finds the path through the score matrix with dyn.
+static void score_find_path(DynProg &dyn, MatF &mmat, MatF &nmat, Band *band,
+			    const AlignSettings &set)
+{
+    MatF smat;
+    BandMatF bsmat;
+
+    // ************************************************************
+    // * SCORE THE MATRICES
+    // ************************************************************
+    if (DEBUG) {
+      std::cerr << "Scoring the mats!\n";
+    }
+
+    if (band) {
+      bsmat.set_band(*band);
+      dyn.score_band(mmat, nmat, bsmat, set.score);
+    }
+    else
+      dyn.score(mmat, nmat, smat, set.score);
+
+    if (DEBUG) {
+      std::cerr << "Checking scoring\n";
+    }
+
+    if (!strcmp(set.score,"euc")) {
+      smat *= -1; // inverting euclidean
+      for (size_t i = 0; i < bsmat.vals.size(); i++)
+	bsmat.vals[i] *= -1;
+    }
+
+
+    // ************************************************************
+    // * PREPARE GAP PENALTY ARRAY
+    // ************************************************************
+
+    int gp_length = mmat.rows() + nmat.rows();
+
+    VecF gp_array;
+    dyn.linear_less_before(set.gap_extend, set.gap_init, gp_length, gp_array);
+
+    // ************************************************************
+    // * DYNAMIC PROGRAM
+    // ************************************************************
+    int minimize = 0;
+    if (DEBUG) {
+        std::cerr << "Dynamic Time Warping Score Matrix!\n";
+    }
+    if (band)
+      dyn.find_path_band(bsmat, gp_array, minimize, set.factor_diag,
+			 set.factor_gap, set.local, set.init_penalty);
+    else
+      dyn.find_path(smat, gp_array, minimize,
+		    set.factor_diag, set.factor_gap, set.local, set.init_penalty);
+}
+
+// Aggregates factor consecutive rows (mean) and factor consecutive columns
+// (sum) of mat and the corresponding times (mean) for the coarse level of
+// the multiresolution alignment.
+static void coarsen(MatF &mat, const double *tm, int factor, MatF &out,
+		    std::vector<double> &out_tm)
+{
+    int rows = mat.rows();
+    int cols = mat.cols();
+    int crows = (rows + factor - 1) / factor;
+    int ccols = (cols + factor - 1) / factor;
+    float *dat = new float[(size_t)crows * ccols];
+    out_tm.assign(crows, 0);
+    for (int r = 0; r < crows; r++) {
+      float *orow = dat + (size_t)r * ccols;
+      std::fill(orow, orow + ccols, 0.f);
+      int r1 = std::min(rows, (r + 1) * factor);
+      for (int i = r * factor; i < r1; i++) {
+	const float *row = mat.pointer(i);
+	for (int j = 0; j < cols; j++)
+	  orow[j / factor] += row[j];
+	out_tm[r] += tm[i];
+      }
+      int n = r1 - r * factor;
+      for (int j = 0; j < ccols; j++)
+	orow[j] /= n;
+      out_tm[r] /= n;
+    }
+    MatF tmp(crows, ccols, dat);
+    out.take(tmp);
+}
+
+// Aligns the profile matrix lmat2 (scan times pscantime2) against lmat1 (scan
+// times pscantime) and stores the adjusted scan times of lmat2 in corrected.
+// The score settings (number of threads, precomputed row statistics of
+// lmat1) are taken from dyn. With set.coarse > 1 the matrices with coarse
+// scans and m/z bins aggregated are aligned first and the full resolution
+// alignment is only performed in a corridor around the coarse path. Does not
+// use the R API, errors are thrown as DynProgError (and std::bad_alloc), lmat1
+// is only read.
+static void obiwarp_align(LMat &lmat1, const double *pscantime,
+			  int pvalscantime, LMat &lmat2,
+			  const double *pscantime2, int pvalscantime2,
+			  DynProg &dyn, const AlignSettings &set,
+			  std::vector<double> &corrected)
+{
+    int coarse = set.coarse;
+    Band band;
+    Band *pband = NULL;
+
+    if (coarse > 1 && pvalscantime / coarse >= MULTIRES_MIN_SCANS &&
+	pvalscantime2 / coarse >= MULTIRES_MIN_SCANS) {
+      MatF cmat1, cmat2;
+      std::vector<double> ctm1, ctm2;
+      Band cband;
+      DynProg cdyn;
+      cdyn.threads = dyn.threads;
+      coarsen(*(lmat1.mat()), pscantime, coarse, cmat1, ctm1);
+      coarsen(*(lmat2.mat()), pscantime2, coarse, cmat2, ctm2);
+      if (set.rtdev > 0)
+	cband.set_from_times(&ctm1[0], cmat1.rows(), &ctm2[0], cmat2.rows(),
+			     set.rtdev);
+      score_find_path(cdyn, cmat1, cmat2, set.rtdev > 0 ? &cband : NULL,
+		      set);
+      band.set_from_path(cdyn._mCoords, cdyn._nCoords, coarse,
+			 MULTIRES_CORRIDOR, pvalscantime, pvalscantime2);
+      pband = &band;
+    } else if (set.rtdev > 0) {
+      band.set_from_times(pscantime, pvalscantime, pscantime2, pvalscantime2,
+			  set.rtdev);
+      pband = &band;
+    }
+    score_find_path(dyn, *(lmat1.mat()), *(lmat2.mat()), pband, set);
+
+    int minimize = 0;
+    VecI mOut;
+    VecI nOut;
+    dyn.warp_map(mOut, nOut, set.response, minimize);
+
+    VecF nOutF;
+    VecF mOutF;
+    lmat1.tm_axis_vals(mOut, mOutF);
+    lmat2.tm_axis_vals(nOut, nOutF);
+    lmat2.warp_tm(nOutF, mOutF);
+
+    corrected.resize(pvalscantime2);
+    for(int i=0; i < pvalscantime2;i++){
+      corrected[i] = lmat2.tm()->back()[i];
+    }
+}
+
+// obiwarp_align returning the error message (NULL on success) instead of
+// throwing it, the R error has to be raised by the caller.
+static const char *try_obiwarp_align(LMat &lmat1, const double *pscantime,
+				     int pvalscantime, LMat &lmat2,
+				     const double *pscantime2,
+				     int pvalscantime2, DynProg &dyn,
+				     const AlignSettings &set,
+				     std::vector<double> &corrected)
+{
+    try {
+      obiwarp_align(lmat1, pscantime, pvalscantime, lmat2, pscantime2,
+		    pvalscantime2, dyn, set, corrected);
+    } catch (DynProgError &e) {
+      return e.msg;
+    } catch (std::bad_alloc &e) {
+      return "memory could not be allocated";
+    }
+    return NULL;
+}
+
+// The adjusted scan times as R vector (of length n).
+static SEXP corrected_times(const std::vector<double> &corrected, int n)
+{
+    SEXP res;
+    PROTECT(res = allocVector(REALSXP, n));
+    for (int i = 0; i < n; i++)
+      REAL(res)[i] = i < (int)corrected.size() ? corrected[i] : NA_REAL;
+    UNPROTECT(1);
+    return res;
+}
+
+// External pointer with the mapped matrix if x is a file backed single
+// precision matrix (see float32Matrix.h), R_NilValue otherwise. The matrix
+// is mapped as long as the pointer is protected (or until
+// float32_file_close).
+static SEXP map_float32(SEXP x)
+{
+    return is_float32_file(x) ? float32_file_open(x) : R_NilValue;
+}
+
+// Fills lmat from a profile matrix, either a numeric matrix (copied to single
+// precision), a raw vector with single precision values (as returned by
+// R_float32_matrix) or a mapped single precision matrix (map, see
+// map_float32); the latter two are used without copying.
+static void set_lmat(LMat &lmat, int valscantime, double *scantime,
+		     int mzrange, double *mz, SEXP intensity, SEXP map)
+{
+    if (map != R_NilValue) {
+      f32Matrix *m = float32_file_get(map);
+      if (m->nrow != mzrange || m->ncol != valscantime)
+	error("dimensions of the single precision profile matrix do not match the number of scans and m/z values\n");
+      lmat.set_from_xcms(valscantime, scantime, mzrange, mz, m->data);
+    } else if (TYPEOF(intensity) == RAWSXP) {
+      if (XLENGTH(intensity) !=
+	  (R_xlen_t)sizeof(float) * valscantime * mzrange)
+	error("length of the single precision profile matrix does not match the number of scans and m/z values\n");
+      lmat.set_from_xcms(valscantime, scantime, mzrange, mz,
+			 (float *)RAW(intensity));
+    } else
+      lmat.set_from_xcms(valscantime, scantime, mzrange, mz, REAL(intensity));
+}
+
 extern "C" SEXP R_set_from_xcms(SEXP valscantime, SEXP scantime, SEXP mzrange, SEXP mz, SEXP intensity,
 				SEXP valscantime2, SEXP scantime2, SEXP mzrange2, SEXP mz2, SEXP intensity2,
 				SEXP response, SEXP score,
 				SEXP gap_init, SEXP gap_extend,
 				SEXP factor_diag, SEXP factor_gap,
-				SEXP local_alignment, SEXP init_penalty)
+				SEXP local_alignment, SEXP init_penalty,
+				SEXP threads, SEXP max_rt_dev,
+				SEXP coarse_factor)
 {
 
   // Create two matrices in LMata format
 
     int pvalscantime, pmzrange;
     int pvalscantime2, pmzrange2;
-    double *pscantime, *pmz, *pintensity;
-    double *pscantime2, *pmz2, *pintensity2;
-    SEXP corrected;
+    double *pscantime, *pmz;
+    double *pscantime2, *pmz2;
+    SEXP corrected, map1, map2;
 
     PROTECT(valscantime = coerceVector(valscantime, INTSXP));
     mzrange = coerceVector(mzrange, INTSXP);
@@ -45,7 +301,6 @@ extern "C" SEXP R_set_from_xcms(SEXP valscantime, SEXP scantime, SEXP mzrange, S
     pmzrange = INTEGER(mzrange)[0];
     pscantime = REAL(scantime);
     pmz = REAL(mz);
-    pintensity = REAL(intensity);
 
     PROTECT(valscantime2 = coerceVector(valscantime2, INTSXP));
     mzrange2 = coerceVector(mzrange2, INTSXP);
@@ -53,80 +308,562 @@ extern "C" SEXP R_set_from_xcms(SEXP valscantime, SEXP scantime, SEXP mzrange, S
     pmzrange2 = INTEGER(mzrange2)[0];
     pscantime2 = REAL(scantime2);
     pmz2 = REAL(mz2);
-    pintensity2 = REAL(intensity2);
 
     // ************************************************************
     // * READ IN FILES TO GET MAT
     // ************************************************************
     LMat lmat1;
     LMat lmat2;
-    MatF smat;
     DynProg dyn;
+    dyn.threads = asInteger(threads);
 
-    lmat1.set_from_xcms(pvalscantime, pscantime, pmzrange, pmz, pintensity);
-    lmat2.set_from_xcms(pvalscantime2, pscantime2, pmzrange2, pmz2, pintensity2);
+    PROTECT(map1 = map_float32(intensity));
+    PROTECT(map2 = map_float32(intensity2));
+    set_lmat(lmat1, pvalscantime, pscantime, pmzrange, pmz, intensity, map1);
+    set_lmat(lmat2, pvalscantime2, pscantime2, pmzrange2, pmz2, intensity2,
+	     map2);
 
-    // ************************************************************
-    // * SCORE THE MATRICES
-    // ************************************************************
-    if (DEBUG) {
-      std::cerr << "Scoring the mats!\n";
+    AlignSettings set;
+    align_settings(set, response, score, gap_init, gap_extend, factor_diag,
+		   factor_gap, local_alignment, init_penalty, max_rt_dev,
+		   coarse_factor);
+    std::vector<double> corr;
+    const char *err = try_obiwarp_align(lmat1, pscantime, pvalscantime,
+					lmat2, pscantime2, pvalscantime2,
+					dyn, set, corr);
+    if (err != NULL)
+      error("obiwarp: %s\n", err);
+    corrected = corrected_times(corr, length(scantime2));
+    if (map1 != R_NilValue)
+      float32_file_close(map1);
+    if (map2 != R_NilValue)
+      float32_file_close(map2);
+
+    UNPROTECT(4);
+
+    return corrected;
+
+}
+
+static void alignRef_finalize(SEXP ptr) {
+    AlignRef *ref = (AlignRef *) R_ExternalPtrAddr(ptr);
+    if (ref != NULL) {
+      delete ref;
+      R_ClearExternalPtr(ptr);
     }
+}
 
-    dyn.score(*(lmat1.mat()), *(lmat2.mat()), smat, CHAR(STRING_ELT(score, 0)));
+static AlignRef *alignRef_get(SEXP ptr) {
+    AlignRef *ref = NULL;
+    if (TYPEOF(ptr) == EXTPTRSXP)
+      ref = (AlignRef *) R_ExternalPtrAddr(ptr);
+    if (ref == NULL)
+      error("invalid obiwarp reference; references can not be serialized and have to be re-created or loaded from a file\n");
+    return ref;
+}
 
-    if (DEBUG) {
-      std::cerr << "Checking scoring\n";
+static SEXP alignRef_ptr(AlignRef *ref) {
+    SEXP res;
+    PROTECT(res = R_MakeExternalPtr(ref, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(res, alignRef_finalize, TRUE);
+    UNPROTECT(1);
+    return res;
+}
+
+// Sparse profile matrix as returned by profile_matrix_sparse: a list with
+// the (0-based) column pointers p, the (0-based) bins i, the values x and
+// the dimensions dim.
+struct SparseProf {
+    int nrow;
+    int ncol;
+    const int *p;
+    const int *i;
+    const double *x;
+};
+
+static SEXP list_elt(SEXP list, const char *name)
+{
+    SEXP names = getAttrib(list, R_NamesSymbol);
+    for (int k = 0; k < length(list); k++)
+      if (strcmp(CHAR(STRING_ELT(names, k)), name) == 0)
+	return VECTOR_ELT(list, k);
+    error("sparse profile matrix without element '%s'\n", name);
+    return R_NilValue;
+}
+
+static void sparse_prof(SEXP list, SparseProf &sp)
+{
+    SEXP p = list_elt(list, "p"), i = list_elt(list, "i"),
+      x = list_elt(list, "x"), dim = list_elt(list, "dim");
+    if (TYPEOF(p) != INTSXP || TYPEOF(i) != INTSXP || TYPEOF(x) != REALSXP ||
+	TYPEOF(dim) != INTSXP || length(dim) != 2)
+      error("invalid sparse profile matrix\n");
+    sp.nrow = INTEGER(dim)[0];
+    sp.ncol = INTEGER(dim)[1];
+    sp.p = INTEGER(p);
+    sp.i = INTEGER(i);
+    sp.x = REAL(x);
+    if (length(p) != sp.ncol + 1 || sp.p[0] != 0 ||
+	sp.p[sp.ncol] != length(i) || length(i) != length(x))
+      error("invalid sparse profile matrix\n");
+    for (int j = 0; j < sp.ncol; j++)
+      if (sp.p[j + 1] < sp.p[j])
+	error("invalid sparse profile matrix\n");
+    for (int k = 0; k < length(i); k++)
+      if (sp.i[k] < 0 || sp.i[k] >= sp.nrow)
+	error("invalid sparse profile matrix\n");
+}
+
+// Creates the reference of the center sample (AlignRef) from its profile
+// matrix (m/z bins in rows, scans in columns; dense or sparse) and scan
+// times; returned as an external pointer, freed by the garbage collector.
+extern "C" SEXP R_obiwarp_reference(SEXP scantime, SEXP intensity)
+{
+    AlignRef *ref = new AlignRef();
+    if (is_float32_file(intensity)) {
+      SEXP map;
+      PROTECT(map = float32_file_open(intensity));
+      f32Matrix *m = float32_file_get(map);
+      if (m->ncol != length(scantime))
+	error("number of columns of the profile matrix does not match the number of scan times\n");
+      ref->set_from_xcms(length(scantime), REAL(scantime), m->nrow, m->data);
+      float32_file_close(map);
+      UNPROTECT(1);
+    } else if (TYPEOF(intensity) == VECSXP) {
+      SparseProf sp;
+      sparse_prof(intensity, sp);
+      if (sp.ncol != length(scantime))
+	error("number of columns of the profile matrix does not match the number of scan times\n");
+      ref->set_from_sparse(length(scantime), REAL(scantime), sp.nrow, sp.p,
+			   sp.i, sp.x);
+    } else {
+      if (ncols(intensity) != length(scantime))
+	error("number of columns of the profile matrix does not match the number of scan times\n");
+      ref->set_from_xcms(length(scantime), REAL(scantime), nrows(intensity),
+			 REAL(intensity));
     }
+    return alignRef_ptr(ref);
+}
 
-    if (!strcmp(CHAR(STRING_ELT(score, 0)),"euc")) {
-      smat *= -1; // inverting euclidean
+// Writes a reference created by R_obiwarp_reference to a file.
+extern "C" SEXP R_obiwarp_reference_save(SEXP ref, SEXP file)
+{
+    if (alignRef_get(ref)->save(CHAR(STRING_ELT(file, 0))))
+      error("failed to write the obiwarp reference to '%s'\n",
+	    CHAR(STRING_ELT(file, 0)));
+    return R_NilValue;
+}
+
+// Loads (maps) a reference written by R_obiwarp_reference_save; the data is
+// shared between all processes mapping the same file.
+extern "C" SEXP R_obiwarp_reference_load(SEXP file)
+{
+    AlignRef *ref = new AlignRef();
+    if (ref->load(CHAR(STRING_ELT(file, 0)))) {
+      delete ref;
+      error("failed to read the obiwarp reference from '%s'\n",
+	    CHAR(STRING_ELT(file, 0)));
     }
+    return alignRef_ptr(ref);
+}
 
+// As R_set_from_xcms, but for the scans first to last (1-based) of a
+// reference of the center sample with pad_before and pad_after m/z bins with
+// zeros added. The precomputed row statistics of the reference are used for
+// the score matrix.
+extern "C" SEXP R_set_from_reference(SEXP reference, SEXP first, SEXP last,
+				     SEXP pad_before, SEXP pad_after, SEXP mz,
+				     SEXP valscantime2, SEXP scantime2, SEXP mzrange2, SEXP mz2, SEXP intensity2,
+				     SEXP response, SEXP score,
+				     SEXP gap_init, SEXP gap_extend,
+				     SEXP factor_diag, SEXP factor_gap,
+				     SEXP local_alignment, SEXP init_penalty,
+				     SEXP threads, SEXP max_rt_dev,
+				     SEXP coarse_factor)
+{
+    AlignRef *ref = alignRef_get(reference);
+    int pfirst = asInteger(first) - 1;
+    int plast = asInteger(last) - 1;
+    int ppad_before = asInteger(pad_before);
+    int ppad_after = asInteger(pad_after);
+    int pvalscantime2, pmzrange2;
+    double *pscantime2, *pmz2;
+    SEXP corrected, map2;
 
-    // ************************************************************
-    // * PREPARE GAP PENALTY ARRAY
-    // ************************************************************
+    if (pfirst < 0 || plast >= ref->nscan || plast < pfirst)
+      error("invalid scan range for the obiwarp reference\n");
+    if (ppad_before < 0 || ppad_after < 0 ||
+	length(mz) != ppad_before + ref->nbin + ppad_after)
+      error("number of m/z values does not match the obiwarp reference\n");
 
-    MatF time_tester;
-    MatF time_tester_trans;
-    VecF mpt;
-    VecF npt;
-    VecF mOut_tm;
-    VecF nOut_tm;
+    PROTECT(valscantime2 = coerceVector(valscantime2, INTSXP));
+    mzrange2 = coerceVector(mzrange2, INTSXP);
+    pvalscantime2 = INTEGER(valscantime2)[0];
+    pmzrange2 = INTEGER(mzrange2)[0];
+    pscantime2 = REAL(scantime2);
+    pmz2 = REAL(mz2);
 
-    int gp_length = smat.rows() + smat.cols();
+    LMat lmat1;
+    LMat lmat2;
+    DynProg dyn;
+    dyn.threads = asInteger(threads);
+    dyn.m_sum = ref->fsum + pfirst;
+    dyn.m_sumsq = ref->fsumsq + pfirst;
+    dyn.m_dsum = ref->dsum + pfirst;
 
-    VecF gp_array;
-    dyn.linear_less_before(*REAL(gap_extend), *REAL(gap_init), gp_length, gp_array);
+    lmat1.set_from_reference(*ref, pfirst, plast, ppad_before, ppad_after,
+			     REAL(mz));
+    PROTECT(map2 = map_float32(intensity2));
+    set_lmat(lmat2, pvalscantime2, pscantime2, pmzrange2, pmz2, intensity2,
+	     map2);
 
-    // ************************************************************
-    // * DYNAMIC PROGRAM
-    // ************************************************************
-    int minimize = 0;
-    if (DEBUG) {
-        std::cerr << "Dynamic Time Warping Score Matrix!\n";
+    AlignSettings set;
+    align_settings(set, response, score, gap_init, gap_extend, factor_diag,
+		   factor_gap, local_alignment, init_penalty, max_rt_dev,
+		   coarse_factor);
+    std::vector<double> corr;
+    const char *err = try_obiwarp_align(lmat1, ref->scantime + pfirst,
+					plast - pfirst + 1, lmat2, pscantime2,
+					pvalscantime2, dyn, set, corr);
+    if (err != NULL)
+      error("obiwarp: %s\n", err);
+    corrected = corrected_times(corr, length(scantime2));
+    if (map2 != R_NilValue)
+      float32_file_close(map2);
+
+    UNPROTECT(2);
+
+    return corrected;
+}
+
+// One sample of R_obiwarp_batch.
+struct BatchSample {
+    int first;          // scan range and padding of the reference
+    int last;
+    int pad_before;
+    int pad_after;
+    int nscan;
+    int nmz;
+    double *scantime;
+    double *mz;
+    float *fintensity;  // single precision profile matrix or
+    double *intensity;  // numeric profile matrix
+};
+
+static bool batch_order(const BatchSample *a, const BatchSample *b)
+{
+    if (a->first != b->first)
+      return a->first < b->first;
+    if (a->last != b->last)
+      return a->last < b->last;
+    if (a->pad_before != b->pad_before)
+      return a->pad_before < b->pad_before;
+    return a->pad_after < b->pad_after;
+}
+
+// Aligns the profile matrices of several samples against the obiwarp
+// reference (external pointer) and returns the list of adjusted scan times.
+// first, last, pad_before and pad_after are integer vectors with the scan
+// range and padding of the reference for each sample, mz, scantime2 and
+// intensity2 lists with the m/z values, scan times and profile matrices
+// (numeric, single precision as returned by R_float32_matrix or file backed
+// single precision matrices) of the samples. The samples are grouped by scan range and padding of the
+// reference: the rows of the reference and their statistics (centered and
+// normalized rows for cov and cor) are computed once per group and shared by
+// all alignments of the group. Up to threads samples are aligned at the same
+// time, but only as many as the (estimated) memory of the score matrices and
+// the dynamic program fits into memory (in bytes, no limit if <= 0). With a
+// single alignment at a time the threads are used within the alignment.
+extern "C" SEXP R_obiwarp_batch(SEXP reference, SEXP first, SEXP last,
+				SEXP pad_before, SEXP pad_after, SEXP mz,
+				SEXP scantime2, SEXP intensity2,
+				SEXP response, SEXP score,
+				SEXP gap_init, SEXP gap_extend,
+				SEXP factor_diag, SEXP factor_gap,
+				SEXP local_alignment, SEXP init_penalty,
+				SEXP threads, SEXP max_rt_dev,
+				SEXP coarse_factor, SEXP memory)
+{
+    AlignRef *ref = alignRef_get(reference);
+    int nsample = length(mz);
+    int nthreads = asInteger(threads);
+    double pmemory = asReal(memory);
+    SEXP res, maps;
+
+    if (nthreads < 1 || nthreads == NA_INTEGER)
+      nthreads = 1;
+    if (length(scantime2) != nsample || length(intensity2) != nsample ||
+	length(first) != nsample || length(last) != nsample ||
+	length(pad_before) != nsample || length(pad_after) != nsample)
+      error("lengths of the parameters do not match the number of samples\n");
+    PROTECT(first = coerceVector(first, INTSXP));
+    PROTECT(last = coerceVector(last, INTSXP));
+    PROTECT(pad_before = coerceVector(pad_before, INTSXP));
+    PROTECT(pad_after = coerceVector(pad_after, INTSXP));
+    PROTECT(maps = allocVector(VECSXP, nsample));
+
+    // check all input before any alignment is performed
+    std::vector<BatchSample> samples(nsample);
+    for (int i = 0; i < nsample; i++) {
+      BatchSample &smp = samples[i];
+      SEXP cur_mz = VECTOR_ELT(mz, i);
+      SEXP cur_tm = VECTOR_ELT(scantime2, i);
+      SEXP cur_int = VECTOR_ELT(intensity2, i);
+      smp.first = INTEGER(first)[i] - 1;
+      smp.last = INTEGER(last)[i] - 1;
+      smp.pad_before = INTEGER(pad_before)[i];
+      smp.pad_after = INTEGER(pad_after)[i];
+      if (smp.first < 0 || smp.last >= ref->nscan || smp.last < smp.first)
+	error("invalid scan range for the obiwarp reference\n");
+      if (TYPEOF(cur_mz) != REALSXP || TYPEOF(cur_tm) != REALSXP)
+	error("m/z values and scan times have to be numeric\n");
+      smp.nmz = length(cur_mz);
+      smp.nscan = length(cur_tm);
+      if (smp.pad_before < 0 || smp.pad_after < 0 ||
+	  smp.nmz != smp.pad_before + ref->nbin + smp.pad_after)
+	error("number of m/z values does not match the obiwarp reference\n");
+      smp.scantime = REAL(cur_tm);
+      smp.mz = REAL(cur_mz);
+      smp.fintensity = NULL;
+      smp.intensity = NULL;
+      if (is_float32_file(cur_int)) {
+	SET_VECTOR_ELT(maps, i, float32_file_open(cur_int));
+	f32Matrix *m = float32_file_get(VECTOR_ELT(maps, i));
+	if (m->nrow != smp.nmz || m->ncol != smp.nscan)
+	  error("dimensions of the single precision profile matrix do not match the number of scans and m/z values\n");
+	smp.fintensity = m->data;
+      } else if (TYPEOF(cur_int) == RAWSXP) {
+	if (XLENGTH(cur_int) !=
+	    (R_xlen_t)sizeof(float) * smp.nscan * smp.nmz)
+	  error("length of the single precision profile matrix does not match the number of scans and m/z values\n");
+	smp.fintensity = (float *)RAW(cur_int);
+      } else if (TYPEOF(cur_int) == REALSXP) {
+	if (XLENGTH(cur_int) != (R_xlen_t)smp.nscan * smp.nmz)
+	  error("size of the profile matrix does not match the number of scans and m/z values\n");
+	smp.intensity = REAL(cur_int);
+      } else
+	error("profile matrices have to be numeric, raw vectors or single precision matrix files\n");
     }
-    dyn.find_path(smat, gp_array, minimize,
-		  *REAL(factor_diag), *REAL(factor_gap), *INTEGER(AS_INTEGER(local_alignment)), *REAL(init_penalty));
 
-    VecI mOut;
-    VecI nOut;
-    dyn.warp_map(mOut, nOut, *INTEGER(AS_INTEGER(response)), minimize);
+    AlignSettings set;
+    align_settings(set, response, score, gap_init, gap_extend, factor_diag,
+		   factor_gap, local_alignment, init_penalty, max_rt_dev,
+		   coarse_factor);
 
-    VecF nOutF;
-    VecF mOutF;
-    lmat1.tm_axis_vals(mOut, mOutF);
-    lmat2.tm_axis_vals(nOut, nOutF);
-    lmat2.warp_tm(nOutF, mOutF);
+    std::vector<BatchSample*> order(nsample);
+    for (int i = 0; i < nsample; i++)
+      order[i] = &samples[i];
+    std::stable_sort(order.begin(), order.end(), batch_order);
+    std::vector<std::vector<double> > corrected(nsample);
+    // the error of each sample, raised after the parallel region
+    std::vector<const char *> errs(nsample, (const char *)NULL);
+
+    int start = 0;
+    while (start < nsample) {
+      int end = start + 1;
+      while (end < nsample && !batch_order(order[start], order[end]))
+	end++;
+      BatchSample &grp = *order[start];
+      int nscan1 = grp.last - grp.first + 1;
+      LMat lmat1;
+      lmat1.set_from_reference(*ref, grp.first, grp.last, grp.pad_before,
+			       grp.pad_after, grp.mz);
+      DynProg tmpl;
+      tmpl.m_sum = ref->fsum + grp.first;
+      tmpl.m_sumsq = ref->fsumsq + grp.first;
+      tmpl.m_dsum = ref->dsum + grp.first;
+      std::vector<float> rows1;
+      tmpl.prepare_rows(*(lmat1.mat()), set.score, rows1);
+
+      // memory of one alignment: score matrix, dynamic program (score,
+      // trace back and float matrices) and a copy of a numeric profile matrix
+      double est = 0;
+      for (int i = start; i < end; i++) {
+	double cur = 20.0 * nscan1 * order[i]->nscan;
+	if (order[i]->intensity)
+	  cur += sizeof(float) * (double)order[i]->nscan * order[i]->nmz;
+	est = std::max(est, cur);
+      }
+      int nconc = std::min(nthreads, end - start);
+      if (pmemory > 0)
+	nconc = std::min(nconc, std::max(1, (int)(pmemory / est)));
 
-    PROTECT(corrected = allocVector(REALSXP, length(scantime2)));
-    for(int i=0; i < length(scantime2);i++){
-      REAL(corrected)[i] = lmat2.tm()->back()[i];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nconc) if(nconc > 1)
+#endif
+      for (int i = start; i < end; i++) {
+	BatchSample &smp = *order[i];
+	int idx = &smp - &samples[0];
+	// errors (also of the copy of a numeric profile matrix) are raised
+	// after the parallel region
+	try {
+	  LMat lmat2;
+	  if (smp.fintensity)
+	    lmat2.set_from_xcms(smp.nscan, smp.scantime, smp.nmz, smp.mz,
+				smp.fintensity);
+	  else
+	    lmat2.set_from_xcms(smp.nscan, smp.scantime, smp.nmz, smp.mz,
+				smp.intensity);
+	  DynProg dyn;
+	  dyn.threads = nconc > 1 ? 1 : nthreads;
+	  dyn.verbose = nconc > 1 ? 0 : 1;
+	  dyn.m_sum = tmpl.m_sum;
+	  dyn.m_sumsq = tmpl.m_sumsq;
+	  dyn.m_dsum = tmpl.m_dsum;
+	  dyn.m_rows = rows1.empty() ? NULL : &rows1[0];
+	  obiwarp_align(lmat1, ref->scantime + grp.first, nscan1, lmat2,
+			smp.scantime, smp.nscan, dyn, set, corrected[idx]);
+	} catch (DynProgError &e) {
+	  errs[idx] = e.msg;
+	} catch (std::bad_alloc &e) {
+	  errs[idx] = "memory could not be allocated";
+	} catch (...) {
+	  errs[idx] = "unexpected error";
+	}
+      }
+      start = end;
     }
 
-    UNPROTECT(3);
+    for (int i = 0; i < nsample; i++)
+      if (VECTOR_ELT(maps, i) != R_NilValue)
+	float32_file_close(VECTOR_ELT(maps, i));
+    for (int i = 0; i < nsample; i++)
+      if (errs[i] != NULL)
+	error("obiwarp: %s (sample %d)\n", errs[i], i + 1);
+    PROTECT(res = allocVector(VECSXP, nsample));
+    for (int i = 0; i < nsample; i++)
+      SET_VECTOR_ELT(res, i, corrected_times(corrected[i],
+					     samples[i].nscan));
+    UNPROTECT(6);
+    return res;
+}
 
-    return corrected;
+// Converts the columns first to last (1-based) of the numeric matrix x (or
+// of a sparse or file backed single precision profile matrix) to single
+// precision values (column-major) adding pad_before and pad_after rows of
+// zeros to each column, i.e. creates the (padded) profile matrix of one
+// sample for R_set_from_xcms in one pass. The values are returned in a raw
+// vector or, if file is a file name, written to that file (see
+// float32Matrix.h) in which case the list with elements file and dim is
+// returned.
+extern "C" SEXP R_float32_matrix(SEXP x, SEXP first, SEXP last,
+				 SEXP pad_before, SEXP pad_after, SEXP file)
+{
+    SEXP res, map = R_NilValue;
+    SparseProf sp;
+    f32Matrix *fin = NULL;
+    int nprotect = 0;
+    bool sparse = false;
+    int nr, nc;
+    if (is_float32_file(x)) {
+      PROTECT(map = float32_file_open(x));
+      nprotect++;
+      fin = float32_file_get(map);
+      nr = fin->nrow;
+      nc = fin->ncol;
+    } else if (TYPEOF(x) == VECSXP) {
+      sparse = true;
+      sparse_prof(x, sp);
+      nr = sp.nrow;
+      nc = sp.ncol;
+    } else if (TYPEOF(x) == REALSXP) {
+      nr = nrows(x);
+      nc = ncols(x);
+    } else
+      error("'x' has to be a numeric matrix\n");
+    int pfirst = asInteger(first) - 1;
+    int plast = asInteger(last) - 1;
+    int pb = asInteger(pad_before);
+    int pa = asInteger(pad_after);
+    if (pfirst < 0 || plast >= nc || plast < pfirst)
+      error("invalid column range\n");
+    if (pb < 0 || pa < 0)
+      error("invalid padding\n");
+    size_t nout = (size_t)pb + nr + pa;
+    int ncol = plast - pfirst + 1;
+    float *out;
+    f32Matrix fout;
+    if (file == R_NilValue) {
+      PROTECT(res = allocVector(RAWSXP, (R_xlen_t)(sizeof(float) * nout *
+						   ncol)));
+      out = (float *)RAW(res);
+    } else {
+      const char *fname = CHAR(STRING_ELT(file, 0));
+      // allocate before mapping the file: an R error would leak the mapping
+      PROTECT(res = float32_file_sexp(fname, (int)nout, ncol));
+      if (f32Matrix_create(&fout, fname, (int)nout, ncol) != F32MATRIX_OK)
+	error("failed to create file '%s'\n", fname);
+      out = fout.data;
+    }
+    nprotect++;
+    if (sparse) {
+      std::fill(out, out + nout * ncol, 0.f);
+      for (int j = pfirst; j <= plast; j++) {
+	for (int k = sp.p[j]; k < sp.p[j + 1]; k++)
+	  out[pb + sp.i[k]] = sp.x[k];
+	out += nout;
+      }
+    } else {
+      const double *in = fin ? NULL : REAL(x);
+      for (int j = pfirst; j <= plast; j++) {
+	std::fill(out, out + pb, 0.f);
+	out += pb;
+	if (fin)
+	  memcpy(out, fin->data + (size_t)j * nr, sizeof(float) * nr);
+	else {
+	  const double *col = in + (size_t)j * nr;
+	  for (int i = 0; i < nr; i++)
+	    out[i] = col[i];
+	}
+	out += nr;
+	std::fill(out, out + pa, 0.f);
+	out += pa;
+      }
+    }
+    if (map != R_NilValue)
+      float32_file_close(map);
+    if (file != R_NilValue && f32Matrix_close(&fout) != F32MATRIX_OK)
+      error("failed to write file '%s'\n",
+	    CHAR(STRING_ELT(file, 0)));
+    UNPROTECT(nprotect);
+    return res;
+}
+
+// Score matrix between the scans (columns) of the profile matrices x and y
+// (m/z bins in rows); with blocked = FALSE the original (naive) kernels are
+// used. Used to test and benchmark the score kernels.
+extern "C" SEXP R_obiwarp_scores(SEXP x, SEXP y, SEXP score, SEXP blocked,
+				 SEXP threads)
+{
+    SEXP res;
+    int nbin = nrows(x);
+    int m = ncols(x);
+    int n = ncols(y);
+    if (nrows(y) != nbin)
+      error("'x' and 'y' must have the same number of rows");
+
+    PROTECT(x = coerceVector(x, REALSXP));
+    PROTECT(y = coerceVector(y, REALSXP));
+    // one row per scan
+    MatF mCoords(m, nbin);
+    MatF nCoords(n, nbin);
+    MatF smat;
+    for (int i = 0; i < m * nbin; i++)
+      mCoords.pointer()[i] = (float)REAL(x)[i];
+    for (int i = 0; i < n * nbin; i++)
+      nCoords.pointer()[i] = (float)REAL(y)[i];
+
+    DynProg dyn;
+    dyn.blocked = asLogical(blocked);
+    dyn.threads = asInteger(threads);
+    dyn.score(mCoords, nCoords, smat, CHAR(STRING_ELT(score, 0)));
 
+    PROTECT(res = allocMatrix(REALSXP, m, n));
+    for (int j = 0; j < n; j++) {
+      for (int i = 0; i < m; i++) {
+	REAL(res)[i + j * m] = smat(i, j);
+      }
+    }
+    UNPROTECT(3);
+    return res;
 }